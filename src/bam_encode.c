@@ -0,0 +1,53 @@
+//
+// BAM record serialization shared by several outputs
+//
+
+#include "bam_encode.h"
+#include <string.h>
+#include "htslib/bgzf.h"
+
+int encode_bam_record(const bam1_t *read, kstring_t *buf) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return -1;
+#endif
+    const bam1_core_t *c = &read->core;
+    uint32_t name_len = c->l_qname - c->l_extranul;
+    if (c->n_cigar > 0xffff || name_len > 255 ||
+        c->pos > INT32_MAX || c->mpos > INT32_MAX ||
+        c->isize < INT32_MIN || c->isize > INT32_MAX) {
+        return -1;
+    }
+
+    uint32_t block_len = read->l_data - c->l_extranul + 32;
+    uint32_t fields[9] = {
+        block_len,
+        (uint32_t) c->tid,
+        (uint32_t) c->pos,
+        (uint32_t) c->bin << 16 | (uint32_t) c->qual << 8 | name_len,
+        (uint32_t) c->flag << 16 | c->n_cigar,
+        (uint32_t) c->l_qseq,
+        (uint32_t) c->mtid,
+        (uint32_t) c->mpos,
+        (uint32_t) c->isize
+    };
+
+    // The in-memory name is NUL-padded for alignment; the padding is not written
+    buf->l = 0;
+    if (ks_resize(buf, sizeof(fields) + block_len - 32) < 0) return -1;
+    memcpy(buf->s, fields, sizeof(fields));
+    memcpy(buf->s + sizeof(fields), read->data, name_len);
+    memcpy(buf->s + sizeof(fields) + name_len, read->data + c->l_qname,
+           read->l_data - c->l_qname);
+    buf->l = sizeof(fields) + block_len - 32;
+    return 0;
+}
+
+int8_t append_encoded(samFile *out, const kstring_t *buf) {
+    // Only BAM streams take the bytes; SAM and CRAM outputs encode their own
+    BGZF *bgzf = hts_get_format(out)->format == bam ? hts_get_bgzfp(out) : NULL;
+    if (!bgzf) return -1;
+    // Start a new block first if the record would straddle one, as bam_write1() does
+    if (bgzf_flush_try(bgzf, buf->l) < 0) return 1;
+    if (bgzf_write(bgzf, buf->s, buf->l) != (ssize_t) buf->l) return 1;
+    return 0;
+}
@@ -0,0 +1,29 @@
+//
+// BAM record serialization shared by several outputs
+//
+// A read going to several labels, or buffered for CB-sorted output, is
+// serialized once in the layout bam_write1() uses on disk, and the bytes
+// are appended to each BAM stream. tests/test_bam_encode.c checks the
+// bytes against bam_write1() and reads them back with sam_read1().
+
+#ifndef SCBAMSPLIT_BAM_ENCODE_H
+#define SCBAMSPLIT_BAM_ENCODE_H
+
+// Standard library includes
+#include <stdint.h>
+
+// External library includes
+#include "htslib/sam.h"
+#include "htslib/kstring.h"
+
+// Serialize a record exactly as bam_write1() does. Returns -1 for records
+// bam_write1() encodes specially or rejects (CIGARs over 65535 operations,
+// positions beyond 32 bits, big-endian hosts); those go through
+// sam_write1() instead.
+int encode_bam_record(const bam1_t *read, kstring_t *buf);
+
+// Append a serialized record to a BAM output. Returns -1, writing nothing,
+// if the output is not BAM, or 1 if the write fails.
+int8_t append_encoded(samFile *out, const kstring_t *buf);
+
+#endif //SCBAMSPLIT_BAM_ENCODE_H
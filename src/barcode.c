@@ -0,0 +1,320 @@
+//
+// Packed barcode kernels (scalar, SSE4.2 and AVX2 with runtime dispatch)
+//
+
+#include "barcode.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "uthash.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define BC_HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+// Signature shared by every base-packing kernel: n <= 32 bases
+typedef int8_t (*pack_kernel_t)(const char *seq, size_t n, uint64_t *bits);
+
+static pack_kernel_t pack_kernel = NULL;
+static const char *pack_kernel_label = "unselected";
+
+// 2-bit codes follow (c >> 1) & 3 so the SIMD kernels can derive them arithmetically
+static int8_t pack_bases_scalar(const char *seq, size_t n, uint64_t *bits) {
+    uint64_t out = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint8_t c = (uint8_t) seq[i];
+        if (c != 'A' && c != 'C' && c != 'G' && c != 'T') return -1;
+        out |= (uint64_t)((c >> 1) & 3) << (2 * i);
+    }
+    *bits = out;
+    return 0;
+}
+
+#ifdef BC_HAVE_X86_KERNELS
+// Pack 16 valid bases from v into 32 bits, base i at bits 2i
+__attribute__((target("sse4.2")))
+static inline uint32_t pack16_sse42(__m128i v) {
+    __m128i codes = _mm_and_si128(_mm_srli_epi16(v, 1), _mm_set1_epi8(3));
+    // c0 + 4*c1 per 16-bit lane, then (c0 + 4*c1) + 16*(c2 + 4*c3) per 32-bit lane
+    __m128i pairs = _mm_maddubs_epi16(codes, _mm_set1_epi16(0x0401));
+    __m128i quads = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00100001));
+    __m128i packed = _mm_shuffle_epi8(quads, _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1,
+                                                           -1, -1, -1, -1, -1, -1, -1, -1));
+    return (uint32_t) _mm_cvtsi128_si32(packed);
+}
+
+__attribute__((target("sse4.2")))
+static inline int valid16_sse42(__m128i v) {
+    __m128i ok = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('A')), _mm_cmpeq_epi8(v, _mm_set1_epi8('C'))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('G')), _mm_cmpeq_epi8(v, _mm_set1_epi8('T'))));
+    return _mm_movemask_epi8(ok) == 0xFFFF;
+}
+
+__attribute__((target("sse4.2")))
+static int8_t pack_bases_sse42(const char *seq, size_t n, uint64_t *bits) {
+    // Pad with 'A' (code 0) so short sequences never read past the input
+    char padded[32];
+    memset(padded, 'A', sizeof(padded));
+    memcpy(padded, seq, n);
+
+    __m128i lo = _mm_loadu_si128((const __m128i *) padded);
+    __m128i hi = _mm_loadu_si128((const __m128i *) (padded + 16));
+    if (!valid16_sse42(lo) || !valid16_sse42(hi)) return -1;
+
+    *bits = (uint64_t) pack16_sse42(lo) | ((uint64_t) pack16_sse42(hi) << 32);
+    return 0;
+}
+
+__attribute__((target("avx2")))
+static int8_t pack_bases_avx2(const char *seq, size_t n, uint64_t *bits) {
+    char padded[32];
+    memset(padded, 'A', sizeof(padded));
+    memcpy(padded, seq, n);
+
+    __m256i v = _mm256_loadu_si256((const __m256i *) padded);
+    __m256i ok = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('A')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('C'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('G')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('T'))));
+    if ((uint32_t) _mm256_movemask_epi8(ok) != 0xFFFFFFFFu) return -1;
+
+    __m256i codes = _mm256_and_si256(_mm256_srli_epi16(v, 1), _mm256_set1_epi8(3));
+    __m256i pairs = _mm256_maddubs_epi16(codes, _mm256_set1_epi16(0x0401));
+    __m256i quads = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00100001));
+    __m256i packed = _mm256_shuffle_epi8(quads, _mm256_setr_epi8(
+        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+
+    *bits = (uint64_t)(uint32_t) _mm256_extract_epi32(packed, 0) |
+            ((uint64_t)(uint32_t) _mm256_extract_epi32(packed, 4) << 32);
+    return 0;
+}
+#endif
+
+// Pick the widest kernel the CPU supports
+void bc_init_kernels(void) {
+    pack_kernel = pack_bases_scalar;
+    pack_kernel_label = "scalar";
+#ifdef BC_HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        pack_kernel = pack_bases_avx2;
+        pack_kernel_label = "avx2";
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        pack_kernel = pack_bases_sse42;
+        pack_kernel_label = "sse4.2";
+    }
+#endif
+}
+
+int8_t bc_select_kernel(const char *name) {
+    if (strcmp(name, "scalar") == 0) {
+        pack_kernel = pack_bases_scalar;
+        pack_kernel_label = "scalar";
+        return 0;
+    }
+#ifdef BC_HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        pack_kernel = pack_bases_avx2;
+        pack_kernel_label = "avx2";
+        return 0;
+    }
+    if (strcmp(name, "sse4.2") == 0 && __builtin_cpu_supports("sse4.2")) {
+        pack_kernel = pack_bases_sse42;
+        pack_kernel_label = "sse4.2";
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+const char *bc_kernel_name(void) {
+    return pack_kernel_label;
+}
+
+int8_t bc_pack(const char *seq, size_t len, bc_key_t *key) {
+    if (!pack_kernel) bc_init_kernels();
+
+    // Split off a single-digit "-N" suffix
+    uint64_t suffix = 0;
+    if (len >= 2 && seq[len - 2] == '-' && seq[len - 1] >= '1' && seq[len - 1] <= '7') {
+        suffix = (uint64_t)(seq[len - 1] - '0');
+        len -= 2;
+    }
+    if (len > BC_MAX_BASES) return -1;
+
+    uint64_t bits;
+    if (pack_kernel(seq, len, &bits) != 0) return -1;
+
+    *key = bits | ((uint64_t) len << BC_BASE_BITS) | (suffix << BC_SUFFIX_SHIFT);
+    return 0;
+}
+
+// Visium HD fields in the base bits: row, column, then bin size
+#define VISIUM_HD_ROW_BITS 17
+#define VISIUM_HD_BIN_SHIFT (2 * VISIUM_HD_ROW_BITS)
+#define VISIUM_HD_FORMAT "s_%03uum_%05u_%05u"
+
+// Value of n decimal digits at s, or -1 if any is not a digit
+static int64_t parse_digits(const char *s, size_t n) {
+    int64_t value = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] < '0' || s[i] > '9') return -1;
+        value = value * 10 + (s[i] - '0');
+    }
+    return value;
+}
+
+int8_t bc_pack_visium_hd(const char *id, size_t len, bc_key_t *key) {
+    // s_BBBum_RRRRR_CCCCC, 19 characters, then an optional -N
+    uint64_t suffix = 0;
+    if (len == 21 && id[19] == '-' && id[20] >= '1' && id[20] <= '7') {
+        suffix = (uint64_t) (id[20] - '0');
+        len = 19;
+    }
+    if (len != 19 || memcmp(id, "s_", 2) != 0 || memcmp(id + 5, "um_", 3) != 0 ||
+        id[13] != '_') {
+        return -1;
+    }
+    int64_t bin = parse_digits(id + 2, 3);
+    int64_t row = parse_digits(id + 8, 5);
+    int64_t col = parse_digits(id + 14, 5);
+    if (bin < 0 || row < 0 || col < 0) return -1;
+
+    *key = (uint64_t) row | (uint64_t) col << VISIUM_HD_ROW_BITS |
+           (uint64_t) bin << VISIUM_HD_BIN_SHIFT | (uint64_t) BC_VISIUM_HD << BC_BASE_BITS |
+           suffix << BC_SUFFIX_SHIFT;
+    return 0;
+}
+
+int8_t bc_pack_umi(const char *seq, size_t len, bc_key_t *key) {
+    if (bc_pack(seq, len, key) == 0) return 0;
+    uint64_t h = 14695981039346656037ull;   // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t) seq[i]) * 1099511628211ull;
+    }
+    *key = BC_BASES(h ^ (h >> BC_BASE_BITS)) | (uint64_t) BC_HASHED << BC_BASE_BITS;
+    return 0;
+}
+
+// Interned cell ids: id -> key by hash, dense id -> string by index
+typedef struct {
+    char id[BC_INTERNED_MAX_LEN + 1];
+    bc_key_t key;
+    UT_hash_handle hh;
+} interned_id_t;
+
+static interned_id_t *interned_by_id = NULL;
+static interned_id_t **interned = NULL;
+static uint64_t n_interned = 0;
+static uint64_t interned_capacity = 0;
+
+int8_t bc_find_interned(const char *id, size_t len, bc_key_t *key) {
+    interned_id_t *entry;
+    HASH_FIND(hh, interned_by_id, id, len, entry);
+    if (!entry) return -1;
+    *key = entry->key;
+    return 0;
+}
+
+int8_t bc_intern(const char *id, size_t len, bc_key_t *key) {
+    if (len == 0 || len > BC_INTERNED_MAX_LEN) return -1;
+    if (bc_find_interned(id, len, key) == 0) return 0;
+
+    if (n_interned == interned_capacity) {
+        uint64_t new_capacity = interned_capacity ? interned_capacity * 2 : 256;
+        interned_id_t **new_interned = realloc(interned, new_capacity * sizeof(interned_id_t *));
+        if (!new_interned) return -1;
+        interned = new_interned;
+        interned_capacity = new_capacity;
+    }
+    interned_id_t *entry = calloc(1, sizeof(interned_id_t));
+    if (!entry) return -1;
+    memcpy(entry->id, id, len);
+    entry->key = n_interned | (uint64_t) BC_INTERNED << BC_BASE_BITS;
+    interned[n_interned++] = entry;
+    HASH_ADD(hh, interned_by_id, id, len, entry);
+    *key = entry->key;
+    return 0;
+}
+
+void bc_clear_interned(void) {
+    interned_id_t *entry, *tmp;
+    HASH_ITER(hh, interned_by_id, entry, tmp) {
+        HASH_DEL(interned_by_id, entry);
+        free(entry);
+    }
+    free(interned);
+    interned = NULL;
+    n_interned = interned_capacity = 0;
+}
+
+void bc_unpack(bc_key_t key, char *out) {
+    static const char bases[4] = {'A', 'C', 'T', 'G'};
+    uint32_t len = BC_LENGTH(key);
+    if (len == BC_INTERNED) {
+        uint64_t index = BC_BASES(key);
+        strcpy(out, index < n_interned ? interned[index]->id : "");
+        return;
+    }
+    if (len == BC_HASHED) {
+        // Only the hash of the string was kept
+        out[0] = '\0';
+        return;
+    }
+    if (len == BC_VISIUM_HD) {
+        uint64_t row_mask = (UINT64_C(1) << VISIUM_HD_ROW_BITS) - 1;
+        int n = sprintf(out, VISIUM_HD_FORMAT, (unsigned) (BC_BASES(key) >> VISIUM_HD_BIN_SHIFT),
+                        (unsigned) (key & row_mask),
+                        (unsigned) ((key >> VISIUM_HD_ROW_BITS) & row_mask));
+        if (BC_SUFFIX(key)) sprintf(out + n, "-%u", BC_SUFFIX(key));
+        return;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        out[i] = bases[(key >> (2 * i)) & 3];
+    }
+    if (BC_SUFFIX(key)) {
+        out[len++] = '-';
+        out[len++] = (char)('0' + BC_SUFFIX(key));
+    }
+    out[len] = '\0';
+}
+
+bc_bloom_t *bc_bloom_create(uint64_t n_keys) {
+    bc_bloom_t *bloom = malloc(sizeof(bc_bloom_t));
+    if (!bloom) return NULL;
+
+    // Round the block count up to a power of two for mask indexing
+    uint64_t wanted = (n_keys * BC_BLOOM_BITS_PER_KEY + 511) / 512;
+    uint64_t n_blocks = 1;
+    while (n_blocks < wanted) n_blocks <<= 1;
+
+    bloom->blocks = calloc(n_blocks * 8, sizeof(uint64_t));
+    if (!bloom->blocks) {
+        free(bloom);
+        return NULL;
+    }
+    bloom->block_mask = n_blocks - 1;
+    return bloom;
+}
+
+void bc_bloom_add(bc_bloom_t *bloom, uint64_t hash) {
+    uint64_t *block = bloom->blocks + ((hash >> 32) & bloom->block_mask) * 8;
+    uint32_t a = (uint32_t) hash;
+    uint32_t b = (a >> 9) | 1;
+    for (uint32_t i = 0; i < BC_BLOOM_K; i++) {
+        uint32_t bit = (a + i * b) & 511;
+        block[bit >> 6] |= UINT64_C(1) << (bit & 63);
+    }
+}
+
+void bc_bloom_destroy(bc_bloom_t *bloom) {
+    if (bloom) {
+        free(bloom->blocks);
+        free(bloom);
+    }
+}
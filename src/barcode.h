@@ -0,0 +1,145 @@
+//
+// Packed barcode kernels: 2-bit encoding of cell barcodes and UMIs
+//
+// Barcodes and UMIs are converted once at extraction time into a single
+// 64-bit word so that lookups, sort keys and UMI comparisons work on
+// integers. SIMD kernels (SSE4.2/AVX2) are selected at runtime with a
+// scalar fallback; all kernels produce identical keys.
+// Dependencies: None (leaf node in dependency graph)
+
+#ifndef SCBAMSPLIT_BARCODE_H
+#define SCBAMSPLIT_BARCODE_H
+
+// Standard library includes
+#include <stddef.h>
+#include <stdint.h>
+
+// Packed key layout:
+//   bits  0..55  bases, 2 bits each, base i at bits 2i..2i+1 (A=0 C=1 T=2 G=3)
+//   bits 56..60  number of bases
+//   bits 61..63  numeric "-N" suffix (Cell Ranger GEM well, 1-7), 0 if absent
+// Cell ids that are not A/C/G/T take length values no sequence reaches:
+// Visium HD spot ids (BC_VISIUM_HD) keep their numbers in the base bits, and
+// other ids (read groups, well names; BC_INTERNED) a dense interned id.
+// UMIs that do not pack (BC_HASHED) keep a hash of the string instead.
+typedef uint64_t bc_key_t;
+
+#define BC_MAX_BASES 28
+#define BC_BASE_BITS 56
+#define BC_SUFFIX_SHIFT 61
+#define BC_BASES(key) ((key) & ((UINT64_C(1) << BC_BASE_BITS) - 1))
+#define BC_LENGTH(key) ((uint32_t)(((key) >> BC_BASE_BITS) & 0x1F))
+#define BC_SUFFIX(key) ((uint32_t)((key) >> BC_SUFFIX_SHIFT))
+#define BC_STRIP_SUFFIX(key) ((key) & ~(UINT64_C(7) << BC_SUFFIX_SHIFT))
+#define BC_IS_SEQUENCE(key) (BC_LENGTH(key) <= BC_MAX_BASES)
+#define BC_HASHED 29
+#define BC_VISIUM_HD 30
+#define BC_INTERNED 31
+#define BC_INTERNED_MAX_LEN 31
+#define BC_IS_INTERNED(key) (BC_LENGTH(key) == BC_INTERNED)
+
+// Kernel selection
+void bc_init_kernels(void);
+const char *bc_kernel_name(void);
+
+// Force a kernel by name ("scalar", "sse4.2", "avx2"), for tests and
+// benchmarks. Returns -1, keeping the current kernel, if the CPU lacks it.
+int8_t bc_select_kernel(const char *name);
+
+// Encode an A/C/G/T string (optionally ending in "-N") into a packed key.
+// Returns 0 on success, -1 if the sequence has N/invalid bases or is too long.
+int8_t bc_pack(const char *seq, size_t len, bc_key_t *key);
+
+// Decode a packed key back into a NUL-terminated string (out needs 32 bytes)
+void bc_unpack(bc_key_t key, char *out);
+
+// Visium HD spot id "s_002um_00123_00456-1" (bin size in um, row, column,
+// optional suffix) packed from its numbers, so tens of millions of spots
+// need no interning. Only the zero-padded form, which unpacks back exactly,
+// is accepted; returns -1 for anything else.
+int8_t bc_pack_visium_hd(const char *id, size_t len, bc_key_t *key);
+
+// Key of a cell id: a sequence or a Visium HD spot id (no interning)
+static inline int8_t bc_pack_id(const char *id, size_t len, bc_key_t *key) {
+    if (bc_pack(id, len, key) == 0) return 0;
+    return bc_pack_visium_hd(id, len, key);
+}
+
+// Key of a UMI: packed if bc_pack accepts it, else (N bases, more than
+// BC_MAX_BASES) a 56-bit hash of the string under BC_HASHED. Hashed UMIs
+// still collapse when identical but are never one mismatch from another.
+int8_t bc_pack_umi(const char *seq, size_t len, bc_key_t *key);
+
+// Key of a cell id bc_pack_id rejects, interned on first sight; -1 if the id is
+// empty, longer than BC_INTERNED_MAX_LEN or cannot be stored. Ids are added
+// while metadata loads, before any read loop starts.
+int8_t bc_intern(const char *id, size_t len, bc_key_t *key);
+
+// Key of an id interned earlier, without adding it; -1 if it never was
+int8_t bc_find_interned(const char *id, size_t len, bc_key_t *key);
+
+void bc_clear_interned(void);
+
+// Integer hash of a packed key (murmur3 finalizer)
+static inline uint64_t bc_hash(bc_key_t key) {
+    key ^= key >> 33;
+    key *= UINT64_C(0xff51afd7ed558ccd);
+    key ^= key >> 33;
+    key *= UINT64_C(0xc4ceb9fe1a85ec53);
+    key ^= key >> 33;
+    return key;
+}
+
+// Order key that sorts packed barcodes as their strings sort: bases
+// alphabetically, a shorter barcode before its extensions, then by suffix.
+// Other cell ids are grouped but not in string order.
+static inline uint64_t bc_sort_key(bc_key_t key) {
+    static const uint8_t rank[4] = {0, 1, 3, 2};   // packed A, C, T, G
+    uint32_t len = BC_LENGTH(key);
+    // Other ids keep their own length field, so they never tie with a sequence
+    if (len > BC_MAX_BASES) return BC_BASES(key) << 8 | (uint64_t) len << 3 | BC_SUFFIX(key);
+    uint64_t bases = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        bases = (bases << 2) | rank[(key >> (2 * i)) & 3];
+    }
+    bases <<= 2 * (BC_MAX_BASES - len);
+    return bases << 8 | (uint64_t) len << 3 | BC_SUFFIX(key);
+}
+
+// Hamming distance between two packed keys of equal length: XOR the bases,
+// fold each 2-bit pair onto its low bit and count. Keys of different length
+// or suffix, or that are not sequences, are reported as BC_MAX_BASES + 1 apart.
+static inline uint32_t bc_hamming(bc_key_t a, bc_key_t b) {
+    uint64_t x = a ^ b;
+    if ((x >> BC_BASE_BITS) || !BC_IS_SEQUENCE(a)) return BC_MAX_BASES + 1;
+    return (uint32_t) __builtin_popcountll((x | (x >> 1)) & UINT64_C(0x0055555555555555));
+}
+
+// Blocked Bloom filter over packed barcode hashes. Each key sets
+// BC_BLOOM_K bits inside a single 512-bit (cache line) block, so a
+// membership test costs one cache miss at most.
+#define BC_BLOOM_K 6
+#define BC_BLOOM_BITS_PER_KEY 12
+
+typedef struct {
+    uint64_t *blocks;       // n_blocks * 8 words
+    uint64_t block_mask;    // n_blocks - 1 (n_blocks is a power of two)
+} bc_bloom_t;
+
+bc_bloom_t *bc_bloom_create(uint64_t n_keys);
+void bc_bloom_add(bc_bloom_t *bloom, uint64_t hash);
+void bc_bloom_destroy(bc_bloom_t *bloom);
+
+// Returns 0 if the key is definitely absent, 1 if it may be present
+static inline int bc_bloom_test(const bc_bloom_t *bloom, uint64_t hash) {
+    const uint64_t *block = bloom->blocks + ((hash >> 32) & bloom->block_mask) * 8;
+    uint32_t a = (uint32_t) hash;
+    uint32_t b = (a >> 9) | 1;
+    for (uint32_t i = 0; i < BC_BLOOM_K; i++) {
+        uint32_t bit = (a + i * b) & 511;
+        if (!(block[bit >> 6] & (UINT64_C(1) << (bit & 63)))) return 0;
+    }
+    return 1;
+}
+
+#endif //SCBAMSPLIT_BARCODE_H
@@ -0,0 +1,365 @@
+//
+// Cell-barcode-sorted per-label outputs
+//
+
+#include "cb_sort.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bam_encode.h"
+#include "utils.h"
+
+cb_sorter_t *create_cb_sorter(const label_registry_t *registry, uint64_t memory_budget) {
+    cb_sorter_t *sorter = calloc(1, sizeof(cb_sorter_t));
+    if (!sorter) {
+        log_msg("Failed to allocate CB sorter", ERROR);
+        return NULL;
+    }
+    sorter->labels = calloc(registry->count ? registry->count : 1, sizeof(label_sort_buffer_t));
+    if (!sorter->labels) {
+        log_msg("Failed to allocate CB sort buffers for %u labels", ERROR, registry->count);
+        free(sorter);
+        return NULL;
+    }
+    sorter->registry = registry;
+    sorter->n_labels = registry->count;
+    sorter->memory_budget = memory_budget;
+    return sorter;
+}
+
+static int run_path(const cb_sorter_t *sorter, uint32_t label_id, uint32_t run,
+                    char *path, size_t size) {
+    const label_entry_t *entry = &sorter->registry->entries[label_id];
+    if (snprintf(path, size, "%s%s.cbsort.%04u.tmp", entry->prefix, entry->label, run)
+        >= (int) size) {
+        log_msg("Output path too long for label: %s", ERROR, entry->label);
+        return -1;
+    }
+    return 0;
+}
+
+static void free_buffer(cb_sorter_t *sorter, label_sort_buffer_t *buffer) {
+    sorter->memory_used -= buffer->capacity + buffer->items_capacity * sizeof(sort_item_t);
+    free(buffer->data);
+    free(buffer->items);
+    buffer->data = NULL;
+    buffer->items = NULL;
+    buffer->used = buffer->capacity = 0;
+    buffer->n_items = buffer->items_capacity = 0;
+}
+
+void destroy_cb_sorter(cb_sorter_t *sorter) {
+    if (!sorter) return;
+    char path[4096];
+    for (uint32_t i = 0; i < sorter->n_labels; i++) {
+        for (uint32_t r = 0; r < sorter->labels[i].n_runs; r++) {
+            if (run_path(sorter, i, r, path, sizeof(path)) == 0) remove(path);
+        }
+        free(sorter->labels[i].data);
+        free(sorter->labels[i].items);
+    }
+    free(sorter->labels);
+    free(sorter);
+}
+
+static int compare_sort_items(const void *a, const void *b) {
+    const sort_item_t *ia = a;
+    const sort_item_t *ib = b;
+    if (ia->cb != ib->cb) return ia->cb < ib->cb ? -1 : 1;
+    if (ia->coord != ib->coord) return ia->coord < ib->coord ? -1 : 1;
+    // Arrival order breaks ties, keeping the sort stable
+    return (ia->offset > ib->offset) - (ia->offset < ib->offset);
+}
+
+// Sort a label's buffer and write it out as the next run
+static int spill_label(cb_sorter_t *sorter, uint32_t label_id) {
+    label_sort_buffer_t *buffer = &sorter->labels[label_id];
+    char path[4096];
+    if (run_path(sorter, label_id, buffer->n_runs, path, sizeof(path)) != 0) return -1;
+
+    qsort(buffer->items, buffer->n_items, sizeof(sort_item_t), compare_sort_items);
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        log_msg("Failed to create sort run: %s", ERROR, path);
+        return -1;
+    }
+    // Count the run before writing so a partial file is cleaned up too
+    buffer->n_runs++;
+    int ret = 0;
+    for (uint64_t i = 0; i < buffer->n_items && ret == 0; i++) {
+        const sort_item_t *item = &buffer->items[i];
+        if (fwrite(item, sizeof(sort_item_t), 1, fp) != 1 ||
+            fwrite(buffer->data + item->offset, 1, item->len, fp) != item->len) {
+            ret = -1;
+        }
+    }
+    if (fclose(fp) != 0) ret = -1;
+    if (ret != 0) {
+        log_msg("Failed to write sort run: %s", ERROR, path);
+        return -1;
+    }
+    log_msg("Spilled %llu reads of %s to %s", DEBUG,
+            (unsigned long long) buffer->n_items, sorter->registry->entries[label_id].label, path);
+    free_buffer(sorter, buffer);
+    return 0;
+}
+
+int cb_sorter_add(cb_sorter_t *sorter, uint32_t label_id, bc_key_t cb,
+                  const bam1_t *read, const kstring_t *encoded) {
+    label_sort_buffer_t *buffer = &sorter->labels[label_id];
+
+    if (buffer->n_items == buffer->items_capacity) {
+        uint64_t new_capacity = buffer->items_capacity ? buffer->items_capacity * 2 : 4096;
+        sort_item_t *items = realloc(buffer->items, new_capacity * sizeof(sort_item_t));
+        if (!items) {
+            log_msg("Failed to expand CB sort buffer", ERROR);
+            return -1;
+        }
+        sorter->memory_used += (new_capacity - buffer->items_capacity) * sizeof(sort_item_t);
+        buffer->items = items;
+        buffer->items_capacity = new_capacity;
+    }
+    if (buffer->used + encoded->l > buffer->capacity) {
+        size_t new_capacity = buffer->capacity ? buffer->capacity : 1 << 20;
+        while (new_capacity < buffer->used + encoded->l) new_capacity *= 2;
+        char *data = realloc(buffer->data, new_capacity);
+        if (!data) {
+            log_msg("Failed to expand CB sort buffer", ERROR);
+            return -1;
+        }
+        sorter->memory_used += new_capacity - buffer->capacity;
+        buffer->data = data;
+        buffer->capacity = new_capacity;
+    }
+
+    sort_item_t *item = &buffer->items[buffer->n_items++];
+    item->cb = bc_sort_key(cb);
+    item->coord = (uint64_t) (uint32_t) read->core.tid << 32 | (uint32_t) (read->core.pos + 1);
+    item->offset = buffer->used;
+    item->len = (uint32_t) encoded->l;
+    memcpy(buffer->data + buffer->used, encoded->s, encoded->l);
+    buffer->used += encoded->l;
+
+    if (sorter->memory_used <= sorter->memory_budget) return 0;
+
+    // Over budget: spill whichever label holds the most
+    uint32_t largest = label_id;
+    for (uint32_t i = 0; i < sorter->n_labels; i++) {
+        if (sorter->labels[i].used > sorter->labels[largest].used) largest = i;
+    }
+    return spill_label(sorter, largest);
+}
+
+// One input of a label's merge: a run file or the sorted in-memory buffer
+typedef struct {
+    FILE *fp;                             /* NULL for the in-memory buffer */
+    sort_item_t item;                     /* current record */
+    kstring_t record;                     /* current record bytes (runs) */
+    uint64_t next;                        /* next buffered item (memory) */
+    bool done;
+} merge_cursor_t;
+
+static int advance_cursor(merge_cursor_t *cursor, const label_sort_buffer_t *buffer) {
+    if (!cursor->fp) {
+        if (cursor->next == buffer->n_items) {
+            cursor->done = true;
+            return 0;
+        }
+        cursor->item = buffer->items[cursor->next++];
+        cursor->record.s = buffer->data + cursor->item.offset;
+        cursor->record.l = cursor->item.len;
+        return 0;
+    }
+    if (fread(&cursor->item, sizeof(sort_item_t), 1, cursor->fp) != 1) {
+        cursor->done = true;
+        return ferror(cursor->fp) ? -1 : 0;
+    }
+    if (ks_resize(&cursor->record, cursor->item.len) < 0 ||
+        fread(cursor->record.s, 1, cursor->item.len, cursor->fp) != cursor->item.len) {
+        return -1;
+    }
+    cursor->record.l = cursor->item.len;
+    return 0;
+}
+
+// Order of two cursor heads; the lower cursor index wins ties, so earlier
+// runs (and the in-memory buffer last) keep arrival order
+static bool cursor_before(const merge_cursor_t *cursors, uint32_t a, uint32_t b) {
+    const sort_item_t *ia = &cursors[a].item;
+    const sort_item_t *ib = &cursors[b].item;
+    if (ia->cb != ib->cb) return ia->cb < ib->cb;
+    if (ia->coord != ib->coord) return ia->coord < ib->coord;
+    return a < b;
+}
+
+static void sift_down(uint32_t *heap, uint32_t n, uint32_t i, const merge_cursor_t *cursors) {
+    for (;;) {
+        uint32_t min = i;
+        uint32_t l = 2 * i + 1, r = l + 1;
+        if (l < n && cursor_before(cursors, heap[l], heap[min])) min = l;
+        if (r < n && cursor_before(cursors, heap[r], heap[min])) min = r;
+        if (min == i) return;
+        uint32_t tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+// Where merged records go: the label's BAM stream, or an intermediate run
+typedef struct {
+    samFile *out;                         /* final pass */
+    FILE *run;                            /* intermediate pass */
+} merge_sink_t;
+
+static int emit_record(merge_sink_t *sink, const merge_cursor_t *cursor) {
+    if (sink->out) return append_encoded(sink->out, &cursor->record) == 0 ? 0 : -1;
+    if (fwrite(&cursor->item, sizeof(sort_item_t), 1, sink->run) != 1 ||
+        fwrite(cursor->record.s, 1, cursor->item.len, sink->run) != cursor->item.len) {
+        return -1;
+    }
+    return 0;
+}
+
+// Merge the given cursors through a min-heap of their heads
+static int merge_cursors(merge_cursor_t *cursors, uint32_t n_cursors,
+                         const label_sort_buffer_t *buffer, merge_sink_t *sink) {
+    uint32_t *heap = malloc(n_cursors * sizeof(uint32_t));
+    if (!heap) {
+        log_msg("Failed to allocate merge heap", ERROR);
+        return -1;
+    }
+    uint32_t n = 0;
+    int ret = 0;
+    for (uint32_t c = 0; c < n_cursors && ret == 0; c++) {
+        ret = advance_cursor(&cursors[c], buffer);
+        if (ret == 0 && !cursors[c].done) heap[n++] = c;
+    }
+    for (uint32_t i = n / 2; i-- > 0;) sift_down(heap, n, i, cursors);
+
+    while (ret == 0 && n > 0) {
+        merge_cursor_t *min = &cursors[heap[0]];
+        if (emit_record(sink, min) != 0 || advance_cursor(min, buffer) != 0) {
+            ret = -1;
+            break;
+        }
+        if (min->done) heap[0] = heap[--n];
+        sift_down(heap, n, 0, cursors);
+    }
+    free(heap);
+    return ret;
+}
+
+// Open runs ids[0..n) as cursors; the caller closes them with close_runs()
+static int open_runs(const cb_sorter_t *sorter, uint32_t label_id, const uint32_t *ids,
+                     uint32_t n, merge_cursor_t *cursors) {
+    char path[4096];
+    for (uint32_t r = 0; r < n; r++) {
+        if (run_path(sorter, label_id, ids[r], path, sizeof(path)) != 0 ||
+            !(cursors[r].fp = fopen(path, "rb"))) {
+            log_msg("Failed to open sort run for %s", ERROR, sorter->registry->entries[label_id].label);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void close_runs(const cb_sorter_t *sorter, uint32_t label_id, const uint32_t *ids,
+                       uint32_t n, merge_cursor_t *cursors) {
+    char path[4096];
+    for (uint32_t r = 0; r < n; r++) {
+        if (cursors[r].fp) fclose(cursors[r].fp);
+        ks_free(&cursors[r].record);
+        if (run_path(sorter, label_id, ids[r], path, sizeof(path)) == 0) remove(path);
+    }
+    memset(cursors, 0, n * sizeof(merge_cursor_t));
+}
+
+// Merge runs ids[0..n) into a new run, numbered after the existing ones
+static int merge_runs(cb_sorter_t *sorter, uint32_t label_id, const uint32_t *ids, uint32_t n,
+                      merge_cursor_t *cursors, uint32_t *merged_id) {
+    label_sort_buffer_t *buffer = &sorter->labels[label_id];
+    char path[4096];
+    *merged_id = buffer->n_runs;
+    if (run_path(sorter, label_id, *merged_id, path, sizeof(path)) != 0) return -1;
+    merge_sink_t sink = {NULL, fopen(path, "wb")};
+    if (!sink.run) {
+        log_msg("Failed to create sort run: %s", ERROR, path);
+        return -1;
+    }
+    // Count the run before writing so a partial file is cleaned up too
+    buffer->n_runs++;
+    int ret = open_runs(sorter, label_id, ids, n, cursors);
+    if (ret == 0) ret = merge_cursors(cursors, n, buffer, &sink);
+    close_runs(sorter, label_id, ids, n, cursors);
+    if (fclose(sink.run) != 0) ret = -1;
+    if (ret != 0) log_msg("Failed to write sort run: %s", ERROR, path);
+    return ret;
+}
+
+static int merge_label(cb_sorter_t *sorter, label_registry_t *registry, uint32_t label_id) {
+    label_sort_buffer_t *buffer = &sorter->labels[label_id];
+    label_entry_t *entry = &registry->entries[label_id];
+    if (buffer->n_items) {
+        qsort(buffer->items, buffer->n_items, sizeof(sort_item_t), compare_sort_items);
+    }
+
+    // Run ids in spill order; one cursor slot per run plus the buffer
+    uint32_t n_ids = buffer->n_runs;
+    uint32_t *ids = malloc((n_ids ? n_ids : 1) * sizeof(uint32_t));
+    merge_cursor_t *cursors = calloc(CB_SORT_MAX_FAN_IN, sizeof(merge_cursor_t));
+    if (!ids || !cursors) {
+        log_msg("Failed to allocate merge cursors", ERROR);
+        free(ids);
+        free(cursors);
+        return -1;
+    }
+    for (uint32_t r = 0; r < n_ids; r++) ids[r] = r;
+
+    // Too many runs to open at once: merge consecutive groups into longer
+    // runs, level by level, until the rest fit next to the buffer
+    int ret = 0;
+    while (ret == 0 && n_ids > CB_SORT_MAX_FAN_IN - 1) {
+        log_msg("Merging %u sort runs of %s in groups of %d", DEBUG, n_ids, entry->label,
+                CB_SORT_MAX_FAN_IN);
+        uint32_t n_out = 0;
+        for (uint32_t first = 0; first < n_ids && ret == 0; first += CB_SORT_MAX_FAN_IN) {
+            uint32_t n = n_ids - first < CB_SORT_MAX_FAN_IN ? n_ids - first : CB_SORT_MAX_FAN_IN;
+            uint32_t merged_id = ids[first];
+            if (n > 1) ret = merge_runs(sorter, label_id, &ids[first], n, cursors, &merged_id);
+            ids[n_out++] = merged_id;
+        }
+        n_ids = n_out;
+    }
+
+    // Final pass: the remaining runs, then the buffer, into the BAM stream
+    if (ret == 0) ret = open_runs(sorter, label_id, ids, n_ids, cursors);
+    if (ret == 0) {
+        merge_sink_t sink = {entry->fp, NULL};
+        ret = merge_cursors(cursors, n_ids + 1, buffer, &sink);
+    }
+    if (ret != 0) {
+        log_msg("Failed to merge sorted output for %s", ERROR, entry->label);
+    }
+    close_runs(sorter, label_id, ids, n_ids, cursors);
+
+    // Remove whatever a failed level left behind
+    char path[4096];
+    for (uint32_t r = 0; r < buffer->n_runs && ret != 0; r++) {
+        if (run_path(sorter, label_id, r, path, sizeof(path)) == 0) remove(path);
+    }
+    buffer->n_runs = 0;
+    free(ids);
+    free(cursors);
+    free_buffer(sorter, buffer);
+    return ret;
+}
+
+int write_cb_sorted_outputs(cb_sorter_t *sorter, label_registry_t *registry) {
+    int ret = 0;
+    for (uint32_t i = 0; i < sorter->n_labels; i++) {
+        if (merge_label(sorter, registry, i) != 0) ret = -1;
+    }
+    return ret;
+}
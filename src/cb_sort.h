@@ -0,0 +1,70 @@
+//
+// Cell-barcode-sorted per-label outputs
+//
+// Reads are serialized once and buffered per label with a (barcode,
+// coordinate) key. When the buffers together exceed the memory budget the
+// largest is sorted and spilled to a run file next to the label's BAM; at
+// close each label merges its runs (in groups of at most CB_SORT_MAX_FAN_IN)
+// with what is still in memory straight into its BGZF stream, so outputs
+// come out grouped by CB (then coordinate) without a separate
+// `samtools sort -t CB`.
+
+#ifndef SCBAMSPLIT_CB_SORT_H
+#define SCBAMSPLIT_CB_SORT_H
+
+// Standard library includes
+#include <stdint.h>
+#include <stddef.h>
+
+// External library includes
+#include "htslib/sam.h"
+#include "htslib/kstring.h"
+
+// Project includes
+#include "hash.h"
+
+#define CB_SORT_DEFAULT_MEMORY (UINT64_C(1) << 30)
+
+// Most runs merged at once; more are merged in several passes so a label
+// never holds more run files open than this
+#define CB_SORT_MAX_FAN_IN 64
+
+// Sort key and length of one buffered record; also the run file record header
+typedef struct {
+    uint64_t cb;                          /* bc_sort_key() of the barcode */
+    uint64_t coord;                       /* tid << 32 | pos + 1, unmapped reads last */
+    uint64_t offset;                      /* in memory: start of the record bytes */
+    uint32_t len;                         /* serialized record bytes */
+} sort_item_t;
+
+typedef struct {
+    char *data;                           /* serialized records, in arrival order */
+    size_t used;
+    size_t capacity;
+    sort_item_t *items;                   /* one per buffered record */
+    uint64_t n_items;
+    uint64_t items_capacity;
+    uint32_t n_runs;                      /* runs spilled to disk so far */
+} label_sort_buffer_t;
+
+typedef struct cb_sorter {
+    const label_registry_t *registry;     /* label names and output prefixes */
+    label_sort_buffer_t *labels;          /* indexed by label id */
+    uint32_t n_labels;
+    uint64_t memory_budget;               /* bytes buffered across all labels */
+    uint64_t memory_used;
+} cb_sorter_t;
+
+cb_sorter_t *create_cb_sorter(const label_registry_t *registry, uint64_t memory_budget);
+
+// Remove any run files left behind (after a failure) and free the buffers
+void destroy_cb_sorter(cb_sorter_t *sorter);
+
+// Buffer a serialized read for one label, spilling if over budget
+int cb_sorter_add(cb_sorter_t *sorter, uint32_t label_id, bc_key_t cb,
+                  const bam1_t *read, const kstring_t *encoded);
+
+// Merge every label's runs and buffer into its output, in sorted order
+int write_cb_sorted_outputs(cb_sorter_t *sorter, label_registry_t *registry);
+
+#endif //SCBAMSPLIT_CB_SORT_H
@@ -0,0 +1,196 @@
+//
+// Automatic cell calling from UMI counts
+//
+
+#include "cell_call.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+
+cell_caller_t *create_cell_caller(uint32_t min_umis) {
+    cell_caller_t *caller = calloc(1, sizeof(cell_caller_t));
+    if (!caller) {
+        log_msg("Failed to allocate cell caller", ERROR);
+        return NULL;
+    }
+    caller->min_umis = min_umis;
+    return caller;
+}
+
+void destroy_cell_caller(cell_caller_t *caller) {
+    if (!caller) return;
+    free(caller->barcodes);
+    free(caller->cells);
+    free(caller->label_ids);
+    free(caller);
+}
+
+int add_barcode_umis(cell_caller_t *caller, bc_key_t cb, uint32_t umis) {
+    if (caller->n_barcodes == caller->capacity) {
+        uint64_t new_capacity = caller->capacity ? caller->capacity * 2 : 1 << 16;
+        barcode_umis_t *new_barcodes = realloc(caller->barcodes,
+                                               new_capacity * sizeof(barcode_umis_t));
+        if (!new_barcodes) {
+            log_msg("Failed to expand barcode UMI counts", ERROR);
+            return -1;
+        }
+        caller->barcodes = new_barcodes;
+        caller->capacity = new_capacity;
+    }
+    caller->barcodes[caller->n_barcodes].cb = cb;
+    caller->barcodes[caller->n_barcodes].umis = umis;
+    caller->n_barcodes++;
+    return 0;
+}
+
+static int compare_umis_desc(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return (x < y) - (x > y);
+}
+
+// Threshold at the knee of the log-log barcode rank curve, taken as its
+// steepest drop: the rank r where UMIs fall most between r and 2r, with the
+// threshold halfway (in log scale) down that drop. The first ranks are
+// skipped so a few outlier barcodes cannot pass for the cliff.
+static int knee_threshold(const cell_caller_t *caller, uint32_t *threshold) {
+    uint64_t n = 0;
+    for (uint64_t i = 0; i < caller->n_barcodes; i++) {
+        if (caller->barcodes[i].umis >= CELL_KNEE_MIN_UMIS) n++;
+    }
+    if (n < 2 * CELL_KNEE_MIN_CELLS) {
+        log_msg("Only %llu barcodes have %d or more UMIs, too few to find a knee; "
+                "give a UMI threshold instead", ERROR, (unsigned long long) n,
+                CELL_KNEE_MIN_UMIS);
+        return -1;
+    }
+
+    uint32_t *umis = malloc(n * sizeof(uint32_t));
+    if (!umis) {
+        log_msg("Failed to allocate barcode rank curve", ERROR);
+        return -1;
+    }
+    n = 0;
+    for (uint64_t i = 0; i < caller->n_barcodes; i++) {
+        if (caller->barcodes[i].umis >= CELL_KNEE_MIN_UMIS) umis[n++] = caller->barcodes[i].umis;
+    }
+    qsort(umis, n, sizeof(uint32_t), compare_umis_desc);
+
+    // umis[r - 1] is the UMI count at rank r
+    uint64_t knee = CELL_KNEE_MIN_CELLS;
+    double steepest = 0;
+    for (uint64_t r = CELL_KNEE_MIN_CELLS; 2 * r <= n; r++) {
+        double drop = log10(umis[2 * r - 1]) - log10(umis[r - 1]);
+        if (drop < steepest) {
+            steepest = drop;
+            knee = r;
+        }
+    }
+    if (steepest == 0) {
+        log_msg("Barcode rank curve has no knee; calling every barcode with %d or more UMIs",
+                WARNING, CELL_KNEE_MIN_UMIS);
+        *threshold = CELL_KNEE_MIN_UMIS;
+    } else {
+        *threshold = (uint32_t) (sqrt((double) umis[knee - 1] * umis[2 * knee - 1]) + 0.5);
+    }
+    free(umis);
+    return 0;
+}
+
+int select_cells(cell_caller_t *caller) {
+    caller->threshold = caller->min_umis;
+    if (caller->min_umis == CELLS_AT_KNEE && knee_threshold(caller, &caller->threshold) != 0) {
+        return -1;
+    }
+
+    uint64_t total_umis = 0;
+    uint64_t cell_umis = 0;
+    caller->n_cells = 0;
+    for (uint64_t i = 0; i < caller->n_barcodes; i++) {
+        total_umis += caller->barcodes[i].umis;
+        if (caller->barcodes[i].umis >= caller->threshold) {
+            cell_umis += caller->barcodes[i].umis;
+            caller->n_cells++;
+        }
+    }
+    if (caller->n_cells == 0) {
+        log_msg("No barcode has %u or more UMIs; no cells called", ERROR, caller->threshold);
+        return -1;
+    }
+
+    caller->cells = calloc(caller->n_cells, sizeof(cb2fp));
+    caller->label_ids = calloc(caller->n_cells, sizeof(uint32_t));
+    if (!caller->cells || !caller->label_ids) {
+        log_msg("Failed to allocate called cells", ERROR);
+        return -1;
+    }
+    uint64_t c = 0;
+    for (uint64_t i = 0; i < caller->n_barcodes; i++) {
+        if (caller->barcodes[i].umis >= caller->threshold) {
+            caller->cells[c].cb = caller->barcodes[i].cb;
+            caller->cells[c].label_ids = &caller->label_ids[c];
+            caller->cells[c].n_labels = 1;
+            caller->cells[c].id = (uint32_t) c;
+            c++;
+        }
+    }
+
+    log_msg("Called %llu cells at %u or more UMIs (%s) from %llu barcodes, "
+            "holding %.1f%% of molecules", INFO, (unsigned long long) caller->n_cells,
+            caller->threshold, caller->min_umis == CELLS_AT_KNEE ? "knee" : "threshold",
+            (unsigned long long) caller->n_barcodes,
+            total_umis ? 100.0 * cell_umis / total_umis : 0.0);
+    return 0;
+}
+
+int open_cell_outputs(cell_caller_t *caller, label_registry_t *registry, const char *prefix,
+                      sam_hdr_t *header, bool per_cell) {
+    // One output per cell must fit under ulimit -n next to those already open
+    uint64_t open_limit = output_file_limit();
+    uint64_t room = open_limit > registry->count ? open_limit - registry->count : 0;
+    if (per_cell && caller->n_cells > room) {
+        log_msg("Called %llu cells, but the open-file limit (ulimit -n) leaves room for %llu "
+                "outputs; drop --per-cell or raise the limit", ERROR,
+                (unsigned long long) caller->n_cells, (unsigned long long) room);
+        return -1;
+    }
+
+    char path[512];
+    if (snprintf(path, sizeof(path), "%s%s.csv", prefix, CELLS_LABEL) >= (int) sizeof(path)) {
+        log_msg("Output path too long for cell list", ERROR);
+        return -1;
+    }
+    FILE *list = fopen(path, "w");
+    if (!list) {
+        log_msg("Failed to create cell list: %s", ERROR, path);
+        return -1;
+    }
+    int failed = fprintf(list, "barcode,umis\n") < 0;
+
+    int32_t shared_id = -1;
+    if (!per_cell && (shared_id = open_label_output(registry, CELLS_LABEL, prefix, header)) < 0) {
+        fclose(list);
+        return -1;
+    }
+    uint64_t row = 0;
+    for (uint64_t c = 0; c < caller->n_cells && !failed; c++) {
+        char barcode[32];
+        bc_unpack(caller->cells[c].cb, barcode);
+        while (caller->barcodes[row].cb != caller->cells[c].cb) row++;
+        failed = fprintf(list, "%s,%u\n", barcode, caller->barcodes[row].umis) < 0;
+
+        int32_t label_id = shared_id;
+        if (per_cell && (label_id = open_label_output(registry, barcode, prefix, header)) < 0) {
+            fclose(list);
+            return -1;
+        }
+        caller->label_ids[c] = (uint32_t) label_id;
+    }
+    if (fclose(list) != 0 || failed) {
+        log_msg("Failed to write cell list: %s", ERROR, path);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,69 @@
+//
+// Automatic cell calling from UMI counts
+//
+// Without metadata, pass 1 keeps every barcode's reads. Pass 2 sorts them by
+// molecule, so each barcode's molecules form one contiguous run and its UMI
+// count takes a single scan into a flat (barcode, UMIs) row per barcode; the
+// long tail of near-empty barcodes costs 16 bytes each and no hash table.
+// Cells are the barcodes at or above a UMI threshold, either given or found
+// at the knee of the barcode rank curve. Each cell gets a cb2fp routing it
+// to a single "cells" output or to its own output, and reads from other
+// barcodes are dropped before pass 3.
+
+#ifndef SCBAMSPLIT_CELL_CALL_H
+#define SCBAMSPLIT_CELL_CALL_H
+
+// Standard library includes
+#include <stdint.h>
+#include <stdbool.h>
+
+// External library includes
+#include "htslib/sam.h"
+
+// Project includes
+#include "hash.h"
+
+// Minimum UMIs meaning "find the threshold at the knee"
+#define CELLS_AT_KNEE 0
+
+// Barcodes below this many UMIs are ambient and left off the knee curve
+#define CELL_KNEE_MIN_UMIS 100
+
+// The knee is looked for from this rank down, so at least this many cells are called
+#define CELL_KNEE_MIN_CELLS 10
+
+// Label of the single output all cells share
+#define CELLS_LABEL "cells"
+
+typedef struct {
+    bc_key_t cb;                          /* packed cell barcode */
+    uint32_t umis;                        /* molecules kept after deduplication */
+} barcode_umis_t;
+
+typedef struct {
+    barcode_umis_t *barcodes;             /* one row per barcode, in molecule order */
+    uint64_t n_barcodes;
+    uint64_t capacity;
+    uint32_t min_umis;                    /* requested threshold, or CELLS_AT_KNEE */
+    uint32_t threshold;                   /* threshold used, set by select_cells() */
+    cb2fp *cells;                         /* called cells, in row order */
+    uint32_t *label_ids;                  /* one per cell, backing cells[i].label_ids */
+    uint64_t n_cells;
+} cell_caller_t;
+
+cell_caller_t *create_cell_caller(uint32_t min_umis);
+void destroy_cell_caller(cell_caller_t *caller);
+
+// Record the next barcode's UMI count; barcodes arrive in molecule order
+int add_barcode_umis(cell_caller_t *caller, bc_key_t cb, uint32_t umis);
+
+// Pick the threshold and create an entry for every barcode reaching it
+int select_cells(cell_caller_t *caller);
+
+// Create <prefix>cells.bam, or <prefix><barcode>.bam per cell, point the
+// cells at them and write the called barcodes to <prefix>cells.csv. Per-cell
+// outputs fail up front if they would not fit under the open-file limit.
+int open_cell_outputs(cell_caller_t *caller, label_registry_t *registry, const char *prefix,
+                      sam_hdr_t *header, bool per_cell);
+
+#endif //SCBAMSPLIT_CELL_CALL_H
@@ -0,0 +1,286 @@
+//
+// Per-label cell x gene UMI count matrices
+//
+
+#include "count_matrix.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+
+gene_table_t *create_gene_table(void) {
+    gene_table_t *genes = calloc(1, sizeof(gene_table_t));
+    if (!genes) {
+        log_msg("Failed to allocate gene table", ERROR);
+    }
+    return genes;
+}
+
+void destroy_gene_table(gene_table_t *genes) {
+    if (!genes) return;
+    gene_entry_t *gene, *tmp;
+    HASH_ITER(hh, genes->by_id, gene, tmp) {
+        HASH_DEL(genes->by_id, gene);
+        free(gene->id);
+        free(gene->name);
+        free(gene);
+    }
+    free(genes->genes);
+    free(genes);
+}
+
+// Return the dense id of a gene, adding it on first sight (GENE_NONE on error)
+uint32_t intern_gene(gene_table_t *genes, const char *id, const char *name) {
+    gene_entry_t *gene;
+    HASH_FIND_STR(genes->by_id, id, gene);
+    if (gene) return gene->index;
+
+    if (genes->count == genes->capacity) {
+        uint32_t new_capacity = genes->capacity ? genes->capacity * 2 : 1024;
+        gene_entry_t **new_genes = realloc(genes->genes, new_capacity * sizeof(gene_entry_t *));
+        if (!new_genes) {
+            log_msg("Failed to expand gene table", ERROR);
+            return GENE_NONE;
+        }
+        genes->genes = new_genes;
+        genes->capacity = new_capacity;
+    }
+
+    gene = calloc(1, sizeof(gene_entry_t));
+    if (!gene) {
+        log_msg("Failed to allocate gene entry", ERROR);
+        return GENE_NONE;
+    }
+    gene->id = strdup(id);
+    gene->name = strdup(name ? name : id);
+    if (!gene->id || !gene->name) {
+        log_msg("Failed to allocate gene entry", ERROR);
+        free(gene->id);
+        free(gene->name);
+        free(gene);
+        return GENE_NONE;
+    }
+    gene->index = genes->count;
+    genes->genes[genes->count++] = gene;
+    HASH_ADD_KEYPTR(hh, genes->by_id, gene->id, strlen(gene->id), gene);
+    return gene->index;
+}
+
+// String value of a Z-type aux tag, or NULL
+static const char *aux_string(const bam1_t *read, const char tag[2]) {
+    const uint8_t *aux = bam_aux_get(read, tag);
+    if (!aux || *aux != 'Z') return NULL;
+    return (const char *) aux + 1;
+}
+
+// Whether a GX/GN value names exactly one gene. STARsolo writes '-' for
+// reads with no gene, and several genes (';'-separated) are ambiguous.
+static bool single_gene(const char *value) {
+    return value && *value && strcmp(value, "-") != 0 && !strchr(value, ';');
+}
+
+// Gene of a read from GX (falling back to GN). Reads with no gene or
+// assigned to several genes count as having none.
+uint32_t read_gene(gene_table_t *genes, const bam1_t *read) {
+    const char *id = aux_string(read, "GX");
+    const char *name = aux_string(read, "GN");
+    if (!id) id = name;
+    if (!single_gene(id)) return GENE_NONE;
+
+    // Coordinate-sorted input sees the same gene many times in a row
+    if (genes->last && strcmp(genes->last->id, id) == 0) {
+        return genes->last->index;
+    }
+    uint32_t index = intern_gene(genes, id, single_gene(name) ? name : NULL);
+    if (index != GENE_NONE) genes->last = genes->genes[index];
+    return index;
+}
+
+count_matrix_t *create_count_matrix(gene_table_t *genes, uint32_t n_labels, bool distinct_umis) {
+    count_matrix_t *matrix = calloc(1, sizeof(count_matrix_t));
+    if (!matrix) {
+        log_msg("Failed to allocate count matrix", ERROR);
+        return NULL;
+    }
+    matrix->labels = calloc(n_labels ? n_labels : 1, sizeof(label_matrix_t));
+    if (!matrix->labels) {
+        log_msg("Failed to allocate count matrix labels", ERROR);
+        free(matrix);
+        return NULL;
+    }
+    matrix->genes = genes;
+    matrix->n_labels = n_labels;
+    matrix->distinct_umis = distinct_umis;
+    return matrix;
+}
+
+void destroy_count_matrix(count_matrix_t *matrix) {
+    if (!matrix) return;
+    for (uint32_t i = 0; i < matrix->n_labels; i++) {
+        free(matrix->labels[i].cells);
+        free(matrix->labels[i].entries);
+    }
+    free(matrix->labels);
+    free(matrix->molecules);
+    free(matrix);
+}
+
+int count_molecule(count_matrix_t *matrix, uint32_t gene, bc_key_t ub) {
+    if (gene == GENE_NONE) return 0;
+
+    if (matrix->n_molecules == matrix->molecules_cap) {
+        uint64_t new_cap = matrix->molecules_cap ? matrix->molecules_cap * 2 : 4096;
+        cell_molecule_t *molecules = realloc(matrix->molecules, new_cap * sizeof(cell_molecule_t));
+        if (!molecules) return -1;
+        matrix->molecules = molecules;
+        matrix->molecules_cap = new_cap;
+    }
+    matrix->molecules[matrix->n_molecules].ub = ub;
+    matrix->molecules[matrix->n_molecules].gene = gene;
+    matrix->n_molecules++;
+    return 0;
+}
+
+static int compare_molecules(const void *a, const void *b) {
+    const cell_molecule_t *ma = a;
+    const cell_molecule_t *mb = b;
+    if (ma->gene != mb->gene) return (ma->gene > mb->gene) - (ma->gene < mb->gene);
+    return (ma->ub > mb->ub) - (ma->ub < mb->ub);
+}
+
+static int append_cell(label_matrix_t *label, bc_key_t cb) {
+    if (label->n_cells == label->cells_cap) {
+        uint32_t new_cap = label->cells_cap ? label->cells_cap * 2 : 256;
+        bc_key_t *cells = realloc(label->cells, new_cap * sizeof(bc_key_t));
+        if (!cells) return -1;
+        label->cells = cells;
+        label->cells_cap = new_cap;
+    }
+    label->cells[label->n_cells++] = cb;
+    return 0;
+}
+
+static int append_entry(label_matrix_t *label, uint32_t gene, uint32_t umis) {
+    if (label->n_entries == label->entries_cap) {
+        uint64_t new_cap = label->entries_cap ? label->entries_cap * 2 : 4096;
+        mtx_entry_t *entries = realloc(label->entries, new_cap * sizeof(mtx_entry_t));
+        if (!entries) return -1;
+        label->entries = entries;
+        label->entries_cap = new_cap;
+    }
+    mtx_entry_t *entry = &label->entries[label->n_entries++];
+    entry->gene = gene;
+    entry->cell = label->n_cells - 1;
+    entry->umis = umis;
+    return 0;
+}
+
+// Move the current cell's counts into the matrix of each of its labels.
+// Sorted by (gene, UMI), each gene is one run and repeated UMIs are adjacent.
+int flush_cell_counts(count_matrix_t *matrix, bc_key_t cb, const cb2fp *barcode) {
+    if (matrix->n_molecules == 0) return 0;
+
+    int ret = 0;
+    const cell_molecule_t *molecules = matrix->molecules;
+    uint64_t n = matrix->n_molecules;
+    qsort(matrix->molecules, n, sizeof(cell_molecule_t), compare_molecules);
+    for (uint32_t l = 0; l < barcode->n_labels && ret == 0; l++) {
+        label_matrix_t *label = &matrix->labels[barcode->label_ids[l]];
+        if (append_cell(label, cb) != 0) {
+            ret = -1;
+            break;
+        }
+        uint32_t umis = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            if (!matrix->distinct_umis || i == 0 || molecules[i].gene != molecules[i - 1].gene ||
+                molecules[i].ub != molecules[i - 1].ub) {
+                umis++;
+            }
+            if (i + 1 == n || molecules[i + 1].gene != molecules[i].gene) {
+                if (append_entry(label, molecules[i].gene, umis) != 0) {
+                    ret = -1;
+                    break;
+                }
+                umis = 0;
+            }
+        }
+    }
+
+    matrix->n_molecules = 0;
+    if (ret != 0) log_msg("Failed to expand count matrix", ERROR);
+    return ret;
+}
+
+static FILE *open_matrix_file(const label_entry_t *entry, const char *suffix) {
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s%s%s", entry->prefix, entry->label, suffix)
+        >= (int) sizeof(path)) {
+        log_msg("Output path too long for label: %s", ERROR, entry->label);
+        return NULL;
+    }
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        log_msg("Failed to create output file: %s", ERROR, path);
+    }
+    return fp;
+}
+
+// Close a matrix file, reporting a failed write or a failed final flush
+static int close_matrix_file(FILE *fp, int failed, const label_entry_t *entry,
+                             const char *suffix) {
+    if (fclose(fp) != 0 || failed) {
+        log_msg("Failed to write output file: %s%s%s", ERROR, entry->prefix, entry->label, suffix);
+        return -1;
+    }
+    return 0;
+}
+
+static int write_label_matrix(const count_matrix_t *matrix, const label_matrix_t *label,
+                              const label_entry_t *entry) {
+    const gene_table_t *genes = matrix->genes;
+
+    FILE *fp = open_matrix_file(entry, ".matrix.mtx");
+    if (!fp) return -1;
+    int failed = fprintf(fp, "%%%%MatrixMarket matrix coordinate integer general\n") < 0 ||
+                 fprintf(fp, "%u %u %llu\n", genes->count, label->n_cells,
+                         (unsigned long long) label->n_entries) < 0;
+    for (uint64_t i = 0; i < label->n_entries && !failed; i++) {
+        const mtx_entry_t *e = &label->entries[i];
+        failed = fprintf(fp, "%u %u %u\n", e->gene + 1, e->cell + 1, e->umis) < 0;
+    }
+    if (close_matrix_file(fp, failed, entry, ".matrix.mtx") != 0) return -1;
+
+    fp = open_matrix_file(entry, ".barcodes.tsv");
+    if (!fp) return -1;
+    char cb[32];
+    failed = 0;
+    for (uint32_t i = 0; i < label->n_cells && !failed; i++) {
+        bc_unpack(label->cells[i], cb);
+        failed = fprintf(fp, "%s\n", cb) < 0;
+    }
+    if (close_matrix_file(fp, failed, entry, ".barcodes.tsv") != 0) return -1;
+
+    fp = open_matrix_file(entry, ".features.tsv");
+    if (!fp) return -1;
+    failed = 0;
+    for (uint32_t i = 0; i < genes->count && !failed; i++) {
+        failed = fprintf(fp, "%s\t%s\tGene Expression\n", genes->genes[i]->id,
+                         genes->genes[i]->name) < 0;
+    }
+    if (close_matrix_file(fp, failed, entry, ".features.tsv") != 0) return -1;
+
+    log_msg("Wrote %u cells x %u genes (%llu non-zero) for %s", INFO, label->n_cells,
+            genes->count, (unsigned long long) label->n_entries, entry->label);
+    return 0;
+}
+
+int write_count_matrices(count_matrix_t *matrix, label_registry_t *registry) {
+    for (uint32_t l = 0; l < matrix->n_labels && l < registry->count; l++) {
+        if (!registry->entries[l].prefix) continue;
+        if (write_label_matrix(matrix, &matrix->labels[l], &registry->entries[l]) != 0) {
+            log_msg("Failed to write count matrix for %s", ERROR, registry->entries[l].label);
+            return -1;
+        }
+    }
+    return 0;
+}
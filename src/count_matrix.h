@@ -0,0 +1,92 @@
+//
+// Per-label cell x gene UMI count matrices
+//
+// Genes come from the GX (gene id) and GN (gene name) aux tags and are
+// interned to dense ids in pass 1. Pass 2 walks the molecule-sorted
+// decisions one cell at a time, collecting the cell's (gene, UMI) pairs;
+// when the cell ends they are sorted and each distinct UMI counts once per
+// gene, so a UMI kept at several positions of one gene is one molecule.
+// Only the non-zero (gene, cell, UMIs) entries are kept.
+
+#ifndef SCBAMSPLIT_COUNT_MATRIX_H
+#define SCBAMSPLIT_COUNT_MATRIX_H
+
+// Standard library includes
+#include <stdint.h>
+#include <stdbool.h>
+
+// External library includes
+#include "htslib/sam.h"
+#include "uthash.h"
+
+// Project includes
+#include "hash.h"
+
+// Reads with no gene, or with several (ambiguous) genes
+#define GENE_NONE UINT32_MAX
+
+// Interned gene
+typedef struct {
+    char *id;                             /* GX value (or GN if no GX) */
+    char *name;                           /* GN value, or the id if absent */
+    uint32_t index;                       /* dense gene id */
+    UT_hash_handle hh;                    /* keyed on id */
+} gene_entry_t;
+
+typedef struct {
+    gene_entry_t *by_id;                  /* id -> gene */
+    gene_entry_t **genes;                 /* dense id -> gene */
+    uint32_t count;
+    uint32_t capacity;
+    gene_entry_t *last;                   /* last gene seen; sorted input repeats it */
+} gene_table_t;
+
+gene_table_t *create_gene_table(void);
+void destroy_gene_table(gene_table_t *genes);
+uint32_t intern_gene(gene_table_t *genes, const char *id, const char *name);
+uint32_t read_gene(gene_table_t *genes, const bam1_t *read);
+
+// One non-zero matrix entry
+typedef struct {
+    uint32_t gene;
+    uint32_t cell;                        /* column within the label */
+    uint32_t umis;
+} mtx_entry_t;
+
+typedef struct {
+    bc_key_t *cells;                      /* column -> cell barcode */
+    uint32_t n_cells;
+    uint32_t cells_cap;
+    mtx_entry_t *entries;
+    uint64_t n_entries;
+    uint64_t entries_cap;
+} label_matrix_t;
+
+// One kept molecule of the current cell
+typedef struct {
+    bc_key_t ub;                          /* packed UMI */
+    uint32_t gene;
+} cell_molecule_t;
+
+typedef struct {
+    gene_table_t *genes;                  /* shared with pass 1 */
+    label_matrix_t *labels;               /* indexed by label id */
+    uint32_t n_labels;
+    bool distinct_umis;                   /* count a UMI once per gene; false without UMIs */
+    cell_molecule_t *molecules;           /* current cell's molecules with a gene */
+    uint64_t n_molecules;
+    uint64_t molecules_cap;
+} count_matrix_t;
+
+count_matrix_t *create_count_matrix(gene_table_t *genes, uint32_t n_labels, bool distinct_umis);
+void destroy_count_matrix(count_matrix_t *matrix);
+
+// Accumulate one molecule of the current cell, then flush the cell once
+// all its molecules are seen
+int count_molecule(count_matrix_t *matrix, uint32_t gene, bc_key_t ub);
+int flush_cell_counts(count_matrix_t *matrix, bc_key_t cb, const cb2fp *barcode);
+
+// Write <prefix><label>.matrix.mtx, .barcodes.tsv and .features.tsv per label
+int write_count_matrices(count_matrix_t *matrix, label_registry_t *registry);
+
+#endif //SCBAMSPLIT_COUNT_MATRIX_H
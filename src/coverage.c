@@ -0,0 +1,127 @@
+//
+// Streaming per-label coverage tracks (bedGraph)
+//
+
+#include "coverage.h"
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+
+#define COVERAGE_INITIAL_WINDOW (1 << 16)
+
+coverage_track_t *create_coverage_track(const char *path, const sam_hdr_t *header) {
+    coverage_track_t *track = calloc(1, sizeof(coverage_track_t));
+    if (!track) {
+        log_msg("Failed to allocate coverage track", ERROR);
+        return NULL;
+    }
+    track->delta = calloc(COVERAGE_INITIAL_WINDOW, sizeof(int32_t));
+    track->out = fopen(path, "w");
+    if (!track->delta || !track->out) {
+        log_msg("Failed to create coverage track: %s", ERROR, path);
+        if (track->out) fclose(track->out);
+        free(track->delta);
+        free(track);
+        return NULL;
+    }
+    track->mask = COVERAGE_INITIAL_WINDOW - 1;
+    track->header = header;
+    track->tid = -1;
+    return track;
+}
+
+// Write the open run, which ends just before pos
+static int emit_run(coverage_track_t *track, int64_t pos) {
+    if (track->run_depth == 0 || pos <= track->run_start) return 0;
+    int n = fprintf(track->out, "%s\t%lld\t%lld\t%d\n",
+                    sam_hdr_tid2name(track->header, track->tid),
+                    (long long) track->run_start, (long long) pos, track->run_depth);
+    return n < 0 ? -1 : 0;
+}
+
+// Emit every position before `to`; no later read can change them
+static int advance(coverage_track_t *track, int64_t to) {
+    int64_t stop = to < track->end ? to : track->end;
+    for (int64_t pos = track->start; pos < stop; pos++) {
+        int32_t *slot = &track->delta[pos & track->mask];
+        if (*slot == 0) continue;
+        track->depth += *slot;
+        *slot = 0;
+        if (emit_run(track, pos) != 0) return -1;
+        track->run_start = pos;
+        track->run_depth = track->depth;
+    }
+    // Past the last pending change the depth is zero and the run is closed
+    if (to > track->start) track->start = to;
+    return 0;
+}
+
+// Grow the ring so positions [start, start + span) fit
+static int reserve_window(coverage_track_t *track, int64_t span) {
+    uint64_t capacity = track->mask + 1;
+    if ((uint64_t) span <= capacity) return 0;
+    while (capacity < (uint64_t) span) capacity *= 2;
+
+    int32_t *delta = calloc(capacity, sizeof(int32_t));
+    if (!delta) {
+        log_msg("Failed to expand coverage window to %llu positions", ERROR,
+                (unsigned long long) capacity);
+        return -1;
+    }
+    for (int64_t pos = track->start; pos < track->end; pos++) {
+        delta[pos & (capacity - 1)] = track->delta[pos & track->mask];
+    }
+    free(track->delta);
+    track->delta = delta;
+    track->mask = capacity - 1;
+    return 0;
+}
+
+int coverage_add_read(coverage_track_t *track, const bam1_t *read) {
+    const bam1_core_t *c = &read->core;
+    if ((c->flag & COVERAGE_SKIP_FLAGS) || c->tid < 0) return 0;
+
+    if (c->tid < track->tid || (c->tid == track->tid && c->pos < track->start)) {
+        log_msg("Coverage tracks need coordinate-sorted input", ERROR);
+        return -1;
+    }
+    if (c->tid != track->tid) {
+        // Finish the previous contig
+        if (track->tid >= 0 && advance(track, track->end) != 0) return -1;
+        track->tid = c->tid;
+        track->start = track->end = c->pos;
+        track->depth = 0;
+        track->run_depth = 0;
+    } else if (advance(track, c->pos) != 0) {
+        return -1;
+    }
+
+    // Aligned blocks (M, =, X) and deletions cover the reference; skips and clips do not
+    const uint32_t *cigar = bam_get_cigar(read);
+    int64_t pos = c->pos;
+    for (uint32_t i = 0; i < c->n_cigar; i++) {
+        int op = bam_cigar_op(cigar[i]);
+        int64_t len = bam_cigar_oplen(cigar[i]);
+        if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF || op == BAM_CDEL) {
+            if (reserve_window(track, pos + len + 1 - track->start) != 0) return -1;
+            track->delta[pos & track->mask]++;
+            track->delta[(pos + len) & track->mask]--;
+            if (pos + len + 1 > track->end) track->end = pos + len + 1;
+            pos += len;
+        } else if (op == BAM_CREF_SKIP) {
+            pos += len;
+        }
+    }
+    return 0;
+}
+
+// Flush the remaining positions and close the file
+int close_coverage_track(coverage_track_t *track) {
+    if (!track) return 0;
+    int ret = 0;
+    if (track->tid >= 0 && advance(track, track->end) != 0) ret = -1;
+    if (fclose(track->out) != 0) ret = -1;
+    free(track->delta);
+    free(track);
+    return ret;
+}
@@ -0,0 +1,41 @@
+//
+// Streaming per-label coverage tracks (bedGraph)
+//
+// Depth is kept as a ring buffer of +1/-1 changes over the window between
+// the last emitted position and the end of the furthest read seen. With
+// coordinate-sorted input every position before the current read's start
+// is final, so it is emitted as run-length encoded bedGraph lines and its
+// slots are reused: memory is bounded by the longest read span, not the
+// genome.
+
+#ifndef SCBAMSPLIT_COVERAGE_H
+#define SCBAMSPLIT_COVERAGE_H
+
+// Standard library includes
+#include <stdio.h>
+#include <stdint.h>
+
+// External library includes
+#include "htslib/sam.h"
+
+// Reads not counted, following samtools depth
+#define COVERAGE_SKIP_FLAGS (BAM_FUNMAP | BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP)
+
+typedef struct {
+    FILE *out;                            /* bedGraph output */
+    const sam_hdr_t *header;              /* contig names */
+    int32_t *delta;                       /* depth changes, indexed by position & mask */
+    uint64_t mask;                        /* ring capacity - 1 */
+    int32_t tid;                          /* current contig, -1 before the first read */
+    int64_t start;                        /* first position not yet emitted */
+    int64_t end;                          /* one past the last pending depth change */
+    int32_t depth;                        /* depth at start - 1 */
+    int64_t run_start;                    /* open bedGraph run */
+    int32_t run_depth;
+} coverage_track_t;
+
+coverage_track_t *create_coverage_track(const char *path, const sam_hdr_t *header);
+int coverage_add_read(coverage_track_t *track, const bam1_t *read);
+int close_coverage_track(coverage_track_t *track);
+
+#endif //SCBAMSPLIT_COVERAGE_H
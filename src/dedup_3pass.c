@@ -12,14 +12,15 @@
 #include "htslib/hts.h"
 #include "htslib/tbx.h"
 
-// Comparison function for sorting by molecule (CB, coord, strand, UB, MAPQ desc)
+// Comparison function for sorting by molecule (CB, coord, strand, UB, score desc)
 int compare_by_molecule(const void *a, const void *b) {
     const read_decision_t *read_a = (const read_decision_t *)a;
     const read_decision_t *read_b = (const read_decision_t *)b;
     
     // 1. Compare cell barcode
-    int cmp = strcmp(read_a->cb, read_b->cb);
-    if (cmp != 0) return cmp;
+    if (read_a->cb != read_b->cb) {
+        return (read_a->cb < read_b->cb) ? -1 : 1;
+    }
     
     // 2. Compare genomic coordinate
     if (read_a->coord != read_b->coord) {
@@ -32,12 +33,13 @@ int compare_by_molecule(const void *a, const void *b) {
     }
     
     // 4. Compare UMI
-    cmp = strcmp(read_a->ub, read_b->ub);
-    if (cmp != 0) return cmp;
+    if (read_a->ub != read_b->ub) {
+        return (read_a->ub < read_b->ub) ? -1 : 1;
+    }
     
-    // 5. Compare MAPQ (higher quality first - descending order)
-    if (read_a->mapq != read_b->mapq) {
-        return read_b->mapq - read_a->mapq;
+    // 5. Compare score (higher quality first - descending order)
+    if (read_a->score != read_b->score) {
+        return read_b->score - read_a->score;
     }
     
     // 6. Tie-breaker: read index (for stable sorting)
@@ -105,6 +107,14 @@ region_decisions_t *create_region_decisions(uint64_t initial_capacity) {
     
     region->capacity = initial_capacity;
     region->count = 0;
+    region->sample_keys = NULL;
+    region->read_names = NULL;
+    region->name_text = NULL;
+    region->name_text_length = 0;
+    region->name_text_capacity = 0;
+    region->labelled_skips = NULL;
+    region->n_labelled_skips = 0;
+    region->labelled_skips_capacity = 0;
     
     return region;
 }
@@ -113,178 +123,840 @@ region_decisions_t *create_region_decisions(uint64_t initial_capacity) {
 void destroy_region_decisions(region_decisions_t *region) {
     if (region) {
         free(region->decisions);
+        free(region->sample_keys);
+        free(region->read_names);
+        free(region->name_text);
+        free(region->labelled_skips);
         free(region);
     }
 }
 
-// Pass 1: Extract minimal information from BAM file
-int extract_region_decisions(samFile *fp, sam_hdr_t *header, 
-                           region_decisions_t *region, 
-                           dedup_context_t *ctx) {
-    bam1_t *read = bam_init1();
-    if (!read) {
-        log_msg("Failed to initialize BAM read", ERROR);
+// Grow the decisions array so it can hold at least `needed` entries
+static int ensure_decision_capacity(region_decisions_t *region, uint64_t needed) {
+    if (needed <= region->capacity) return 0;
+    
+    uint64_t new_capacity = region->capacity;
+    while (new_capacity < needed) {
+        // Check for overflow before doubling capacity
+        if (new_capacity > UINT64_MAX / 2) {
+            log_msg("Cannot expand decisions array: capacity would overflow", ERROR);
+            return -1;
+        }
+        new_capacity *= 2;
+    }
+    
+    // Additional check for multiplication overflow with sizeof
+    if (new_capacity > UINT64_MAX / sizeof(read_decision_t)) {
+        log_msg("Cannot expand decisions array: allocation size would overflow", ERROR);
         return -1;
     }
     
+    read_decision_t *new_decisions = realloc(region->decisions, 
+                                           new_capacity * sizeof(read_decision_t));
+    if (!new_decisions) {
+        log_msg("Failed to expand decisions array", ERROR);
+        return -1;
+    }
+    region->decisions = new_decisions;
+    if (region->sample_keys) {
+        uint64_t *new_keys = realloc(region->sample_keys, new_capacity * sizeof(uint64_t));
+        if (!new_keys) {
+            log_msg("Failed to expand downsampling keys", ERROR);
+            return -1;
+        }
+        region->sample_keys = new_keys;
+    }
+    if (region->read_names) {
+        read_name_t *new_names = realloc(region->read_names, new_capacity * sizeof(read_name_t));
+        if (!new_names) {
+            log_msg("Failed to expand read name index", ERROR);
+            return -1;
+        }
+        region->read_names = new_names;
+    }
+    region->capacity = new_capacity;
+    log_msg("Expanded decisions array to %llu entries", DEBUG, new_capacity);
+    return 0;
+}
+
+// Remember a read whose barcode has a label but which gets no decision
+// (secondary, no usable UMI, no gene), so Pass 3 does not write it as
+// unassigned. Reads arrive in input order, so the list stays sorted.
+static int add_labelled_skip(region_decisions_t *region, uint64_t read_idx) {
+    if (region->n_labelled_skips == region->labelled_skips_capacity) {
+        uint64_t new_capacity = region->labelled_skips_capacity ?
+                                region->labelled_skips_capacity * 2 : 1024;
+        uint64_t *new_skips = realloc(region->labelled_skips, new_capacity * sizeof(uint64_t));
+        if (!new_skips) {
+            log_msg("Failed to expand skipped labelled reads", ERROR);
+            return -1;
+        }
+        region->labelled_skips = new_skips;
+        region->labelled_skips_capacity = new_capacity;
+    }
+    region->labelled_skips[region->n_labelled_skips++] = read_idx;
+    return 0;
+}
+
+// -K ends: store the name of the read about to become decision
+// region->count, so Pass 2 can tell pairs with the same ends apart
+static int add_read_name(region_decisions_t *region, uint64_t read_idx, const bam1_t *read) {
+    const char *name = bam_get_qname(read);
+    uint64_t length = strlen(name) + 1;
+    if (region->name_text_length + length > region->name_text_capacity) {
+        uint64_t new_capacity = region->name_text_capacity ? region->name_text_capacity : 1 << 20;
+        while (new_capacity < region->name_text_length + length) new_capacity *= 2;
+        char *new_text = realloc(region->name_text, new_capacity);
+        if (!new_text) {
+            log_msg("Failed to expand read name storage", ERROR);
+            return -1;
+        }
+        region->name_text = new_text;
+        region->name_text_capacity = new_capacity;
+    }
+    memcpy(region->name_text + region->name_text_length, name, length);
+    region->read_names[region->count].read_idx = read_idx;
+    region->read_names[region->count].offset = region->name_text_length;
+    region->name_text_length += length;
+    return 0;
+}
+
+// Name of a decision's read; decisions were added in input order
+static const char *decision_read_name(const region_decisions_t *region, uint64_t read_idx) {
+    uint64_t lo = 0, hi = region->count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (region->read_names[mid].read_idx < read_idx) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return region->name_text + region->read_names[lo].offset;
+}
+
+// Unclipped 5' end: the leftmost position less leading clips on the
+// forward strand, the rightmost plus trailing clips on the reverse
+static int64_t read_unclipped_5prime(const bam1_t *read) {
+    const uint32_t *cigar = bam_get_cigar(read);
+    uint32_t n_cigar = read->core.n_cigar;
+    if (!bam_is_rev(read)) {
+        int64_t pos = read->core.pos;
+        for (uint32_t i = 0; i < n_cigar; i++) {
+            int op = bam_cigar_op(cigar[i]);
+            if (op != BAM_CSOFT_CLIP && op != BAM_CHARD_CLIP) break;
+            pos -= bam_cigar_oplen(cigar[i]);
+        }
+        return pos;
+    }
+    int64_t end = bam_endpos(read) - 1;
+    for (uint32_t i = n_cigar; i-- > 0;) {
+        int op = bam_cigar_op(cigar[i]);
+        if (op != BAM_CSOFT_CLIP && op != BAM_CHARD_CLIP) break;
+        end += bam_cigar_oplen(cigar[i]);
+    }
+    return end;
+}
+
+// The mate's unclipped 5' end, from its CIGAR in the MC tag. Without the
+// tag (or with a malformed one) its leftmost position has to do.
+static int64_t mate_unclipped_5prime(const bam1_t *read) {
+    int64_t pos = read->core.mpos;
+    uint8_t *mc = bam_aux_get(read, "MC");
+    const char *cigar = mc ? bam_aux2Z(mc) : NULL;
+    if (!cigar) return pos;
+    
+    int64_t leading = 0, trailing = 0, ref_len = 0;
+    bool aligned = false;
+    while (*cigar) {
+        char *op;
+        long len = strtol(cigar, &op, 10);
+        if (op == cigar || len < 0 || *op == '\0') return pos;
+        if (*op == 'S' || *op == 'H') {
+            if (aligned) trailing += len; else leading += len;
+        } else {
+            if (*op == 'M' || *op == 'D' || *op == 'N' || *op == '=' || *op == 'X') {
+                ref_len += len;
+            }
+            aligned = true;
+        }
+        cigar = op + 1;
+    }
+    if (!bam_is_mrev(read)) return pos - leading;
+    return pos + (ref_len ? ref_len : 1) - 1 + trailing;
+}
+
+// One end of a pair: contig, unclipped 5' end and strand
+typedef struct {
+    int32_t tid;
+    int64_t pos;
+    bool rev;
+} read_end_t;
+
+static bool end_before(const read_end_t *a, const read_end_t *b) {
+    if (a->tid != b->tid) return a->tid < b->tid;
+    if (a->pos != b->pos) return a->pos < b->pos;
+    return a->rev < b->rev;
+}
+
+// Molecule key without UMIs: both ends of the pair, as in Picard
+// MarkDuplicates. The near end gives the coordinate, the two strands the
+// strand, and the far end plus which end is read 1 is hashed into the UMI
+// slot. Both mates build the same key, so a pair is kept or dropped as a
+// whole. Unpaired reads are keyed by their own end, and a pair with one end
+// mapped by that end alone, which the unmapped mate reads from the MC tag.
+// Without MC the mate's 5' end is unknown, so both mates of a mapped pair
+// fall back to leftmost positions.
+static void pair_end_key(const bam1_t *read, read_decision_t *decision) {
+    const bam1_core_t *c = &read->core;
+    read_end_t self = {c->tid, read_unclipped_5prime(read), bam_is_rev(read)};
+    if (!(c->flag & BAM_FPAIRED) || (c->flag & (BAM_FUNMAP | BAM_FMUNMAP))) {
+        if ((c->flag & (BAM_FPAIRED | BAM_FUNMAP | BAM_FMUNMAP)) == (BAM_FPAIRED | BAM_FUNMAP)) {
+            self.tid = c->mtid;
+            self.pos = mate_unclipped_5prime(read);
+            self.rev = bam_is_mrev(read);
+        }
+        decision->coord = (int32_t) self.pos;
+        decision->strand = self.rev;
+        decision->ub = bc_hash(UINT64_MAX ^ (uint32_t) self.tid);
+        return;
+    }
+    
+    read_end_t mate = {c->mtid, mate_unclipped_5prime(read), bam_is_mrev(read)};
+    if (!bam_aux_get(read, "MC")) {
+        self.pos = c->pos;
+        mate.pos = c->mpos;
+    }
+    // Identical ends put read 1 first, which both mates agree on
+    bool read1 = (c->flag & BAM_FREAD1) != 0;
+    bool self_near = end_before(&self, &mate) || (!end_before(&mate, &self) && read1);
+    const read_end_t *near = self_near ? &self : &mate;
+    const read_end_t *far = self_near ? &mate : &self;
+    decision->coord = (int32_t) near->pos;
+    decision->strand = (uint8_t) (near->rev | far->rev << 1);
+    uint64_t contigs = (uint64_t) (uint32_t) near->tid << 32 | (uint32_t) far->tid;
+    uint64_t far_end = (uint64_t) (uint32_t) far->pos << 1 | (self_near == read1);
+    decision->ub = bc_hash(bc_hash(contigs) ^ far_end);
+}
+
+// Read name hash (64-bit FNV-1a), shared by both mates to pick the kept pair
+static uint64_t read_name_hash(const char *name) {
+    uint64_t h = 14695981039346656037ull;
+    for (const char *p = name; *p; p++) {
+        h = (h ^ (uint8_t) *p) * 1099511628211ull;
+    }
+    return h;
+}
+
+// Sum of base qualities at or above DEDUP_MIN_BASE_QUALITY, plus the mate's
+// sum when fixmate -m recorded it, so both mates of a pair pick the same pair
+static uint16_t base_quality_score(const bam1_t *read) {
+    uint64_t sum = 0;
+    const uint8_t *qual = bam_get_qual(read);
+    if (read->core.l_qseq > 0 && qual[0] != 0xff) {
+        for (int32_t i = 0; i < read->core.l_qseq; i++) {
+            if (qual[i] >= DEDUP_MIN_BASE_QUALITY) sum += qual[i];
+        }
+    }
+    uint8_t *ms = bam_aux_get(read, MATE_SCORE_TAG);
+    if (ms) {
+        int64_t mate_sum = bam_aux2i(ms);
+        if (mate_sum > 0) sum += (uint64_t) mate_sum;
+    }
+    return sum > UINT16_MAX ? UINT16_MAX : (uint16_t) sum;
+}
+
+// Why a staged read is only looked up for QC and not deduplicated
+#define STAGED_LOW_MAPQ     0x1
+#define STAGED_SECONDARY    0x2
+#define STAGED_COUNT_ONLY   0x4
+
+// Pass 1 loop body, specialised on barcode locations and MAPQ filtering by
+// the variants below so per-read location checks compile away. Records are
+// handled in batches: candidates are staged at the tail of the decisions
+// array while their barcode buckets are prefetched, then resolved and
+// compacted in input order.
+static inline __attribute__((always_inline))
+int extract_region_decisions_impl(samFile *fp, sam_hdr_t *header,
+                                  region_decisions_t *region,
+                                  dedup_context_t *ctx,
+                                  const enum location cb_loc,
+                                  const enum location ub_loc,
+                                  const bool filter_mapq) {
+    read_batch_t *batch = create_read_batch();
+    if (!batch) return -1;
+    
     uint64_t read_idx = 0;
-    int read_stat;
+    uint64_t hashed_umis = 0;
+    uint64_t unannotated = 0;
+    uint64_t barcodes_checked = 0;
+    uint64_t barcodes_rejected = 0;
+    int read_stat = -1;
+    tag_reader_t reader;
+    init_tag_reader(&reader, ctx->cb_meta, ctx->ub_meta);
+    reader.neighbors = ctx->index->neighbors;
+    unsigned hashes[READ_BATCH_SIZE];
+    int staged_reads[READ_BATCH_SIZE];
+    uint8_t staged_flags[READ_BATCH_SIZE];
+    qc_stats_t *qc = ctx->index->qc;
+    const downsampler_t *sampler = ctx->index->registry->sampler;
+    uint64_t barcodes_corrected = 0;
+    const bool by_ends = ctx->options->dedup_key == DEDUP_BY_ENDS;
+    // Labelled reads left out of deduplication must still be looked up, so
+    // Pass 3 can tell them from reads that are really unassigned
+    const bool keep_unassigned = ctx->index->registry->keep_unassigned;
     
     log_msg("Pass 1: Extracting read information", INFO);
     
-    while ((read_stat = sam_read1(fp, header, read)) >= 0) {
-        // Check if we need to expand the array
-        if (region->count >= region->capacity) {
-            // Check for overflow before doubling capacity
-            if (region->capacity > UINT64_MAX / 2) {
-                log_msg("Cannot expand decisions array: capacity would overflow", ERROR);
-                bam_destroy1(read);
-                return -1;
+    while (fill_read_batch(fp, header, batch, &read_stat) > 0) {
+        // Make room to stage the whole batch
+        if (ensure_decision_capacity(region, region->count + batch->count) != 0) {
+            destroy_read_batch(batch);
+            return -1;
+        }
+        
+        // Stage 1: filter and extract into staging slots, prefetch buckets
+        uint64_t n_staged = 0;
+        for (int i = 0; i < batch->count; i++, read_idx++) {
+            bam1_t *read = batch->reads[i];
+            read_decision_t *decision = &region->decisions[region->count + n_staged];
+            decision->read_idx = read_idx;
+            
+            // Check MAPQ threshold before any tag work. Reads below it and
+            // secondary alignments are skipped, unless QC or --keep-unassigned
+            // still needs their barcode looked up.
+            uint8_t flags = 0;
+            if (filter_mapq && read->core.qual < ctx->mapq_threshold) {
+                flags |= STAGED_LOW_MAPQ;
             }
-            uint64_t new_capacity = region->capacity * 2;
             
-            // Additional check for multiplication overflow with sizeof
-            if (new_capacity > UINT64_MAX / sizeof(read_decision_t)) {
-                log_msg("Cannot expand decisions array: allocation size would overflow", ERROR);
-                bam_destroy1(read);
-                return -1;
+            // Check for secondary alignment (0x100 flag)
+            if (read->core.flag & 0x100) {
+                flags |= STAGED_SECONDARY;
+            }
+            if (flags && !qc && !keep_unassigned) {
+                continue;
             }
             
-            read_decision_t *new_decisions = realloc(region->decisions, 
-                                                   new_capacity * sizeof(read_decision_t));
-            if (!new_decisions) {
-                log_msg("Failed to expand decisions array", ERROR);
-                bam_destroy1(read);
-                return -1;
+            // Extract cell barcode (and the UMI too when both sit in the tags or the name)
+            char cb_temp[CB_LENGTH];
+            char ub_temp[UB_LENGTH];
+            // Skip reads without a valid CB: barcodes with N or other invalid
+            // bases cannot be in the metadata
+            int8_t ub_stat = 0;
+            if (UMI_WITH_CB(cb_loc, ub_loc) && !by_ends) {
+                ub_stat = extract_CB_key_UB(read, &reader, cb_temp, ub_temp, cb_loc, ub_loc,
+                                            &decision->cb);
+                if (ub_stat < 0) continue;
+            } else if (extract_CB_key(read, &reader, cb_temp, cb_loc, &decision->cb) != 0) {
+                continue;
             }
-            region->decisions = new_decisions;
-            region->capacity = new_capacity;
-            log_msg("Expanded decisions array to %llu entries", DEBUG, new_capacity);
-        }
-        
-        read_decision_t *decision = &region->decisions[region->count];
-        decision->read_idx = read_idx;
-        
-        // Extract cell barcode
-        char cb_temp[CB_LENGTH];
-        int8_t cb_stat = get_CB(read, ctx->cb_meta, cb_temp);
-        if (cb_stat != 0) {
-            // Skip reads without valid CB
-            read_idx++;
-            continue;
-        }
-        strncpy(decision->cb, cb_temp, sizeof(decision->cb) - 1);
-        decision->cb[sizeof(decision->cb) - 1] = '\0';
-        
-        // Extract UMI
-        char ub_temp[UB_LENGTH];
-        int8_t ub_stat = get_UB(read, ctx->ub_meta, ub_temp);
-        if (ub_stat != 0) {
-            // Skip reads without valid UB
-            read_idx++;
-            continue;
-        }
-        strncpy(decision->ub, ub_temp, sizeof(decision->ub) - 1);
-        decision->ub[sizeof(decision->ub) - 1] = '\0';
-        
-        // Check MAPQ threshold
-        decision->mapq = read->core.qual;
-        if (decision->mapq < ctx->mapq_threshold) {
-            // Skip reads below MAPQ threshold
-            read_idx++;
-            continue;
+            
+            // Reject barcodes outside the metadata before packing the UMI
+            uint64_t hash = bc_hash(decision->cb);
+            barcodes_checked++;
+            if (ctx->index->prefilter && !bc_bloom_test(ctx->index->prefilter, hash)) {
+                barcodes_rejected++;
+                continue;
+            }
+            
+            if (flags) {
+                // Counted by QC only; no UMI needed
+            } else if (by_ends) {
+                // No UMI: the pair's ends make up the key, set below
+            } else if (ub_stat != 0 || (!UMI_WITH_CB(cb_loc, ub_loc) &&
+                                        extract_UB(read, &reader, ub_temp, ub_loc) != 0)) {
+                // Skip reads without valid UB
+                if (!qc && !keep_unassigned) continue;
+                flags |= STAGED_COUNT_ONLY;
+            } else {
+                // UMIs with N or too long to pack are hashed: exact matches only
+                bc_pack_umi(ub_temp, strlen(ub_temp), &decision->ub);
+                hashed_umis += BC_LENGTH(decision->ub) == BC_HASHED;
+            }
+            
+            // Extract genomic coordinate and strand
+            if (by_ends) {
+                pair_end_key(read, decision);
+                decision->score = base_quality_score(read);
+            } else {
+                decision->strand = bam_is_rev(read) ? 1 : 0;
+                decision->coord = read->core.pos;
+                decision->score = read->core.qual;
+            }
+            
+            hashes[n_staged] = (unsigned) hash;
+            staged_reads[n_staged] = i;
+            staged_flags[n_staged] = flags;
+            prefetch_barcode_bucket(ctx->index->direct_map, hashes[n_staged]);
+            n_staged++;
         }
         
-        // Check for secondary alignment (0x100 flag)
-        if (read->core.flag & 0x100) {
-            // Skip secondary alignments
-            read_idx++;
-            continue;
+        // Stage 2: prefetch the first entry of each bucket
+        for (uint64_t j = 0; j < n_staged; j++) {
+            prefetch_barcode_entry(ctx->index->direct_map, hashes[j]);
         }
         
-        // Extract genomic coordinate and strand
-        decision->coord = read->core.pos;
-        decision->strand = bam_is_rev(read) ? 1 : 0;
-        
-        // Check if cell barcode exists in metadata (skip if not found)
-        cb2fp *cluster_entry;
-        HASH_FIND_STR(ctx->direct_map, decision->cb, cluster_entry);
-        if (!cluster_entry) {
-            // Skip reads not in any cluster
-            read_idx++;
-            continue;
+        // Stage 3: keep reads whose barcode is in the metadata, compacting in place
+        uint64_t staged_base = region->count;
+        for (uint64_t j = 0; j < n_staged; j++) {
+            read_decision_t *staged = &region->decisions[staged_base + j];
+            cb2fp *cluster_entry = find_barcode_hashed(ctx->index->direct_map, staged->cb, hashes[j]);
+            if (!cluster_entry && ctx->index->neighbors) {
+                // Recover single-mismatch barcodes; dedup under the corrected one
+                cluster_entry = correct_barcode(ctx->index->neighbors, staged->cb,
+                                                batch->reads[staged_reads[j]]);
+                if (cluster_entry) {
+                    staged->cb = cluster_entry->cb;
+                    barcodes_corrected++;
+                }
+            }
+            if (!cluster_entry && !ctx->options->call_cells) {
+                // Skip reads not in any cluster
+                continue;
+            }
+            if (qc) {
+                qc_count_read(qc, cluster_entry, staged_flags[j] & STAGED_LOW_MAPQ,
+                              staged_flags[j] & STAGED_SECONDARY);
+            }
+            if (staged_flags[j]) {
+                if (keep_unassigned && cluster_entry &&
+                    add_labelled_skip(region, staged->read_idx) != 0) {
+                    destroy_read_batch(batch);
+                    return -1;
+                }
+                continue;
+            }
+            
+            read_decision_t *decision = &region->decisions[region->count];
+            if (decision != staged) *decision = *staged;
+            
+            // Remember the labels so Pass 3 can route without another lookup
+            decision->barcode = cluster_entry;
+            decision->gene = ctx->genes ? read_gene(ctx->genes, batch->reads[staged_reads[j]])
+                                        : GENE_NONE;
+            if (ctx->options->dedup_key == DEDUP_BY_GENE) {
+                // The gene takes the position's place in the molecule key.
+                // Unannotated reads are dropped or keep their position,
+                // flagged in the strand so it cannot collide with a gene id.
+                if (decision->gene != GENE_NONE) {
+                    decision->coord = (int32_t) decision->gene;
+                    decision->strand = 0;
+                } else if (ctx->options->unannotated_by_position) {
+                    decision->strand |= STRAND_BY_POSITION;
+                } else {
+                    unannotated++;
+                    if (keep_unassigned && add_labelled_skip(region, decision->read_idx) != 0) {
+                        destroy_read_batch(batch);
+                        return -1;
+                    }
+                    continue;
+                }
+            }
+            if (region->sample_keys) {
+                // Pass 2 restores input order, so the keys stay aligned
+                region->sample_keys[region->count] =
+                    read_sample_key(sampler, batch->reads[staged_reads[j]]);
+            }
+            if (region->read_names &&
+                add_read_name(region, decision->read_idx, batch->reads[staged_reads[j]]) != 0) {
+                destroy_read_batch(batch);
+                return -1;
+            }
+            
+            // Initialize as keep=true, will be updated in Pass 2
+            decision->keep = true;
+            
+            region->count++;
         }
-        
-        // Initialize as keep=true, will be updated in Pass 2
-        decision->keep = true;
-        
-        region->count++;
-        read_idx++;
     }
     
     log_msg("Pass 1 complete: %llu reads processed, %llu kept for deduplication", 
             INFO, read_idx, region->count);
+    if (hashed_umis > 0) {
+        log_msg("Pass 1: %llu reads with UMIs that do not pack (N or over %d bases) "
+                "deduplicated by exact match only", INFO, (unsigned long long) hashed_umis,
+                BC_MAX_BASES);
+    }
+    if (unannotated > 0) {
+        log_msg("Pass 1: %llu reads without a gene annotation dropped", INFO,
+                (unsigned long long) unannotated);
+    }
+    log_prefilter_stats(barcodes_checked, barcodes_rejected);
+    if (ctx->index->neighbors) {
+        log_msg("Pass 1: corrected %llu reads with one barcode mismatch, %llu with one N", INFO,
+                (unsigned long long) barcodes_corrected, (unsigned long long) reader.n_resolved);
+    }
     
-    bam_destroy1(read);
-    return (read_stat == -1) ? 0 : -1;  // -1 is normal EOF
+    destroy_read_batch(batch);
+    if (read_stat < -1) {
+        log_msg("Pass 1: failed to read input BAM", ERROR);
+        return -1;
+    }
+    return 0;
+}
+
+typedef int (*pass1_loop_t)(samFile *fp, sam_hdr_t *header,
+                            region_decisions_t *region, dedup_context_t *ctx);
+
+#define DEFINE_PASS1_LOOP(name, CB_LOC, UB_LOC, FILTER_MAPQ)                      \
+    static int name(samFile *fp, sam_hdr_t *header,                             \
+                    region_decisions_t *region, dedup_context_t *ctx) {         \
+        return extract_region_decisions_impl(fp, header, region, ctx,           \
+                                             CB_LOC, UB_LOC, FILTER_MAPQ);      \
+    }
+
+DEFINE_PASS1_LOOP(pass1_tag_tag, READ_TAG, READ_TAG, false)
+DEFINE_PASS1_LOOP(pass1_tag_tag_mapq, READ_TAG, READ_TAG, true)
+DEFINE_PASS1_LOOP(pass1_tag_name, READ_TAG, READ_NAME, false)
+DEFINE_PASS1_LOOP(pass1_tag_name_mapq, READ_TAG, READ_NAME, true)
+DEFINE_PASS1_LOOP(pass1_name_tag, READ_NAME, READ_TAG, false)
+DEFINE_PASS1_LOOP(pass1_name_tag_mapq, READ_NAME, READ_TAG, true)
+DEFINE_PASS1_LOOP(pass1_name_name, READ_NAME, READ_NAME, false)
+DEFINE_PASS1_LOOP(pass1_name_name_mapq, READ_NAME, READ_NAME, true)
+
+// Indexed by READ_LOOP_VARIANT()
+static const pass1_loop_t pass1_loops[N_READ_LOOP_VARIANTS] = {
+    pass1_tag_tag, pass1_tag_tag_mapq, pass1_tag_name, pass1_tag_name_mapq,
+    pass1_name_tag, pass1_name_tag_mapq, pass1_name_name, pass1_name_name_mapq
+};
+
+// Pass 1: Extract minimal information from BAM file
+int extract_region_decisions(samFile *fp, sam_hdr_t *header, 
+                           region_decisions_t *region, 
+                           dedup_context_t *ctx) {
+    // Choose the specialised loop once for the whole pass
+    pass1_loop_t loop = pass1_loops[READ_LOOP_VARIANT(ctx->cb_meta->location,
+                                                      ctx->ub_meta->location,
+                                                      ctx->mapq_threshold > 0)];
+    return loop(fp, header, region, ctx);
+}
+
+// Collapse UMIs one mismatch apart within the group [start, end), which is
+// sorted by UMI. Only each UMI's best read is still kept at this point.
+static int cluster_group_umis(region_decisions_t *region, uint64_t start, uint64_t end,
+                              umi_workspace_t *ws, uint64_t *duplicates_marked) {
+    // One node per distinct UMI
+    uint32_t n_nodes = 0;
+    for (uint64_t i = start; i < end; i++) {
+        if (i == start || region->decisions[i].ub != region->decisions[i - 1].ub) {
+            n_nodes++;
+        }
+    }
+    if (n_nodes < 2) return 0;
+    
+    umi_node_t *nodes = umi_workspace_nodes(ws, n_nodes);
+    if (!nodes) return -1;
+    
+    uint32_t k = 0;
+    for (uint64_t i = start; i < end; i++) {
+        if (i == start || region->decisions[i].ub != region->decisions[i - 1].ub) {
+            nodes[k].umi = region->decisions[i].ub;
+            nodes[k].count = 0;
+            nodes[k].first_read = i;
+            k++;
+        }
+        nodes[k - 1].count++;
+    }
+    
+    if (cluster_umis_directional(ws, nodes, n_nodes) != 0) return -1;
+    
+    // Only the read representing each cluster's root UMI survives, and it
+    // takes over the reads of the UMIs merged into it
+    for (uint32_t j = 0; j < n_nodes; j++) {
+        if (nodes[j].cluster != j) {
+            read_decision_t *absorbed = &region->decisions[nodes[j].first_read];
+            region->decisions[nodes[nodes[j].cluster].first_read].molecule_size += nodes[j].count;
+            absorbed->keep = false;
+            absorbed->molecule_size = 0;
+            (*duplicates_marked)++;
+        }
+    }
+    return 0;
 }
 
 // Pass 2: Mark duplicates in memory
-void mark_duplicates_in_region(region_decisions_t *region) {
+// Count each cell's molecules per gene. Decisions are in molecule order,
+// so every cell is one contiguous run.
+static int count_region_molecules(region_decisions_t *region, count_matrix_t *matrix) {
+    for (uint64_t i = 0; i < region->count; i++) {
+        read_decision_t *decision = &region->decisions[i];
+        if (decision->keep && count_molecule(matrix, decision->gene, decision->ub) != 0) {
+            log_msg("Failed to allocate per-cell gene counts", ERROR);
+            return -1;
+        }
+        if (i + 1 == region->count || region->decisions[i + 1].cb != decision->cb) {
+            if (flush_cell_counts(matrix, decision->cb, decision->barcode) != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+// Count each barcode's molecules, call cells, then route the cells' reads
+// to their entries and drop every other barcode's. Decisions are in
+// molecule order, so barcodes come in the same order both times.
+static int call_region_cells(region_decisions_t *region, cell_caller_t *cells,
+                             uint64_t *duplicates_marked) {
+    uint32_t umis = 0;
+    for (uint64_t i = 0; i < region->count; i++) {
+        const read_decision_t *decision = &region->decisions[i];
+        if (decision->keep) umis++;
+        if (i + 1 == region->count || region->decisions[i + 1].cb != decision->cb) {
+            if (add_barcode_umis(cells, decision->cb, umis) != 0) return -1;
+            umis = 0;
+        }
+    }
+    if (select_cells(cells) != 0) return -1;
+
+    uint64_t kept = 0;
+    uint64_t row = 0;
+    bc_key_t run_cb = 0;
+    cb2fp *cell = NULL;
+    cb2fp *next_cell = cells->cells;
+    for (uint64_t i = 0; i < region->count; i++) {
+        read_decision_t *decision = &region->decisions[i];
+        if (i == 0 || decision->cb != run_cb) {
+            // Next barcode: its row, and the next cell if it was called
+            run_cb = decision->cb;
+            cell = cells->barcodes[row++].umis >= cells->threshold ? next_cell++ : NULL;
+        }
+        if (cell) {
+            decision->barcode = cell;
+            region->decisions[kept++] = *decision;
+        } else if (!decision->keep) {
+            (*duplicates_marked)--;
+        }
+    }
+    log_msg("Pass 2: %llu reads from %llu cells kept, %llu reads from other barcodes dropped",
+            INFO, (unsigned long long) kept, (unsigned long long) cells->n_cells,
+            (unsigned long long) (region->count - kept));
+    region->count = kept;
+    return 0;
+}
+
+// Keep only the highest scoring read per molecule, which also counts the
+// reads of its molecule; directional UMIs then merge within each position
+static int mark_molecule_duplicates(region_decisions_t *region, umi_method_t umi_method,
+                                    uint64_t *duplicates_marked) {
+    umi_workspace_t *ws = NULL;
+    if (umi_method == UMI_DIRECTIONAL) {
+        ws = create_umi_workspace();
+        if (!ws) {
+            log_msg("Failed to allocate UMI clustering workspace", ERROR);
+            return -1;
+        }
+    }
+    
+    uint64_t group_start = 0;
+    read_decision_t *representative = &region->decisions[0];
+    representative->molecule_size = 1;
+    
+    for (uint64_t i = 0; i < region->count; i++) {
+        read_decision_t *curr = &region->decisions[i];
+        
+        if (i > 0) {
+            read_decision_t *prev = &region->decisions[i - 1];
+            bool same_position = (
+                prev->cb == curr->cb &&
+                prev->coord == curr->coord &&
+                prev->strand == curr->strand
+            );
+            
+            if (same_position && prev->ub == curr->ub) {
+                // This is a duplicate - mark for removal
+                curr->keep = false;
+                curr->molecule_size = 0;
+                representative->molecule_size++;
+                (*duplicates_marked)++;
+            } else {
+                representative = curr;
+                representative->molecule_size = 1;
+            }
+            
+            if (!same_position) {
+                // Position group finished: merge UMIs with sequencing errors
+                if (ws && cluster_group_umis(region, group_start, i, ws, duplicates_marked) != 0) {
+                    log_msg("UMI clustering failed", ERROR);
+                    destroy_umi_workspace(ws);
+                    return -1;
+                }
+                group_start = i;
+            }
+        }
+    }
+    if (ws && cluster_group_umis(region, group_start, region->count, ws, duplicates_marked) != 0) {
+        log_msg("UMI clustering failed", ERROR);
+        destroy_umi_workspace(ws);
+        return -1;
+    }
+    destroy_umi_workspace(ws);
+    return 0;
+}
+
+// -K ends: a read of a position group with its name, compared by name hash
+// and then by the name itself, so a hash collision never merges two pairs
+typedef struct {
+    uint64_t hash;
+    const char *name;
+    read_decision_t *decision;
+} pair_member_t;
+
+static int compare_pair_members(const void *a, const void *b) {
+    const pair_member_t *member_a = (const pair_member_t *)a;
+    const pair_member_t *member_b = (const pair_member_t *)b;
+    if (member_a->hash != member_b->hash) {
+        return (member_a->hash < member_b->hash) ? -1 : 1;
+    }
+    int order = strcmp(member_a->name, member_b->name);
+    if (order != 0) return order;
+    uint64_t idx_a = member_a->decision->read_idx;
+    uint64_t idx_b = member_b->decision->read_idx;
+    return (idx_a > idx_b) - (idx_a < idx_b);
+}
+
+static bool same_pair(const pair_member_t *a, const pair_member_t *b) {
+    return a->hash == b->hash && strcmp(a->name, b->name) == 0;
+}
+
+// -K ends: the group [start, end) holds both mates of every pair with the
+// same ends. The pair with the highest summed score, then the lowest name
+// hash, is kept whole; both its mates record the number of pairs.
+static void mark_pair_group(region_decisions_t *region, uint64_t start, uint64_t end,
+                            pair_member_t *members, uint64_t *duplicates_marked) {
+    uint64_t n = end - start;
+    for (uint64_t i = 0; i < n; i++) {
+        read_decision_t *decision = &region->decisions[start + i];
+        members[i].name = decision_read_name(region, decision->read_idx);
+        members[i].hash = read_name_hash(members[i].name);
+        members[i].decision = decision;
+    }
+    qsort(members, n, sizeof(pair_member_t), compare_pair_members);
+    
+    uint64_t best_start = 0, best_end = 0;
+    uint64_t best_score = 0;
+    uint32_t n_pairs = 0;
+    for (uint64_t i = 0; i < n;) {
+        uint64_t score = 0;
+        uint64_t j = i;
+        for (; j < n && same_pair(&members[j], &members[i]); j++) {
+            score += members[j].decision->score;
+        }
+        if (n_pairs == 0 || score > best_score) {
+            best_start = i;
+            best_end = j;
+            best_score = score;
+        }
+        n_pairs++;
+        i = j;
+    }
+    
+    for (uint64_t i = 0; i < n; i++) {
+        read_decision_t *decision = members[i].decision;
+        decision->keep = i >= best_start && i < best_end;
+        if (!decision->keep) (*duplicates_marked)++;
+        decision->molecule_size = decision->keep ? n_pairs : 0;
+    }
+}
+
+static int mark_pair_duplicates(region_decisions_t *region, uint64_t *duplicates_marked) {
+    pair_member_t *members = NULL;
+    uint64_t members_capacity = 0;
+    uint64_t start = 0;
+    for (uint64_t i = 1; i <= region->count; i++) {
+        if (i == region->count ||
+            region->decisions[i].cb != region->decisions[start].cb ||
+            region->decisions[i].coord != region->decisions[start].coord ||
+            region->decisions[i].strand != region->decisions[start].strand ||
+            region->decisions[i].ub != region->decisions[start].ub) {
+            if (i - start > members_capacity) {
+                pair_member_t *new_members = realloc(members, (i - start) * sizeof(pair_member_t));
+                if (!new_members) {
+                    log_msg("Failed to allocate read pair group", ERROR);
+                    free(members);
+                    return -1;
+                }
+                members = new_members;
+                members_capacity = i - start;
+            }
+            mark_pair_group(region, start, i, members, duplicates_marked);
+            start = i;
+        }
+    }
+    free(members);
+    return 0;
+}
+
+int mark_duplicates_in_region(region_decisions_t *region, const dedup_options_t *options,
+                              count_matrix_t *matrix, cell_caller_t *cells) {
     if (region->count == 0) {
         log_msg("No reads to deduplicate", INFO);
-        return;
+        return 0;
     }
     
     log_msg("Pass 2: Sorting %llu reads by molecule", INFO, region->count);
     
-    // Sort by molecule (CB, coord, strand, UB, MAPQ desc)
+    // Sort by molecule (CB, coord or gene, strand, UB, score desc)
     qsort(region->decisions, region->count, sizeof(read_decision_t), compare_by_molecule);
     
     log_msg("Pass 2: Marking duplicates", INFO);
     
-    // Mark duplicates: keep only the highest MAPQ read per molecule
     uint64_t duplicates_marked = 0;
-    
-    for (uint64_t i = 0; i < region->count; i++) {
-        if (i == 0) {
-            // First read is always kept
-            continue;
-        }
-        
-        read_decision_t *prev = &region->decisions[i - 1];
-        read_decision_t *curr = &region->decisions[i];
-        
-        // Check if this read is from the same molecule as the previous one
-        bool same_molecule = (
-            strcmp(prev->cb, curr->cb) == 0 &&
-            prev->coord == curr->coord &&
-            prev->strand == curr->strand &&
-            strcmp(prev->ub, curr->ub) == 0
-        );
-        
-        if (same_molecule) {
-            // This is a duplicate - mark for removal
-            curr->keep = false;
-            duplicates_marked++;
-        }
+    if (options->dedup_key == DEDUP_BY_ENDS) {
+        if (mark_pair_duplicates(region, &duplicates_marked) != 0) return -1;
+    } else if (mark_molecule_duplicates(region, options->umi_method, &duplicates_marked) != 0) {
+        return -1;
     }
     
     log_msg("Pass 2: Marked %llu duplicates for removal", INFO, duplicates_marked);
     
+    if (cells) {
+        log_msg("Pass 2: Calling cells from UMI counts", INFO);
+        if (call_region_cells(region, cells, &duplicates_marked) != 0) return -1;
+    }
+    
+    if (matrix) {
+        log_msg("Pass 2: Counting UMIs per cell and gene", INFO);
+        if (count_region_molecules(region, matrix) != 0) return -1;
+    }
+    
     // Sort back by read index to restore original order
     log_msg("Pass 2: Restoring original read order", DEBUG);
     qsort(region->decisions, region->count, sizeof(read_decision_t), compare_by_read_idx);
     
     log_msg("Pass 2 complete: %llu reads to keep, %llu duplicates to discard", 
             INFO, region->count - duplicates_marked, duplicates_marked);
+    return 0;
+}
+
+// Mark-duplicates output: flag non-representative reads 0x400 and give the
+// representative the number of reads in its molecule
+static bool mark_molecule(bam1_t *read, const read_decision_t *decision) {
+    if (!decision->keep) {
+        read->core.flag |= BAM_FDUP;
+        return true;
+    }
+    read->core.flag &= ~BAM_FDUP;
+    if (bam_aux_update_int(read, MOLECULE_SIZE_TAG, decision->molecule_size) < 0) {
+        log_msg("Failed to set molecule size tag", ERROR);
+        return false;
+    }
+    return true;
+}
+
+// True if Pass 1 found a label for this read but left it out; *cursor walks
+// the sorted list alongside the input
+static bool labelled_skip(const region_decisions_t *region, uint64_t *cursor, uint64_t read_idx) {
+    while (*cursor < region->n_labelled_skips && region->labelled_skips[*cursor] < read_idx) {
+        (*cursor)++;
+    }
+    return *cursor < region->n_labelled_skips && region->labelled_skips[*cursor] == read_idx;
 }
 
 // Pass 3: Write deduplicated reads to output files
 int write_deduplicated_region(samFile *fp, sam_hdr_t *header,
                             region_decisions_t *region,
-                            cb2fp *direct_map,
-                            tag_meta_t *cb_meta) {
+                            label_registry_t *registry,
+                            const dedup_options_t *options) {
     
     // No need to read header - we've already seeked to data start position
     
@@ -296,9 +968,11 @@ int write_deduplicated_region(samFile *fp, sam_hdr_t *header,
     
     uint64_t read_idx = 0;
     uint64_t decision_idx = 0;
+    uint64_t skip_idx = 0;
     uint64_t reads_written = 0;
     uint64_t reads_skipped = 0;
     int read_stat;
+    int ret = 0;
     
     log_msg("Pass 3: Writing deduplicated reads to output files", INFO);
     log_msg("Pass 3: Total decisions: %llu", DEBUG, region->count);
@@ -310,31 +984,33 @@ int write_deduplicated_region(samFile *fp, sam_hdr_t *header,
             decision_idx++;
         }
         
-        bool should_write = false;
+        read_decision_t *decision = NULL;
         
         if (decision_idx < region->count && 
             region->decisions[decision_idx].read_idx == read_idx) {
             // We have a decision for this read
-            should_write = region->decisions[decision_idx].keep;
+            decision = &region->decisions[decision_idx];
         }
         
-        if (should_write) {
-            // Extract cell barcode and use read_dump like non-deduplication path
-            char this_CB[CB_LENGTH];
-            int8_t cb_stat = get_CB(read, cb_meta, this_CB);
-            if (cb_stat == 0) {
-                // Use read_dump exactly like non-deduplication path
-                int8_t rdump_stat = read_dump(direct_map, this_CB, header, read);
-                if (rdump_stat == 0) {
-                    reads_written++;
-                } else {
-                    log_msg("Failed to write read using read_dump", ERROR);
-                    reads_skipped++;
-                }
-            } else {
-                log_msg("Failed to extract cell barcode for output", ERROR);
-                reads_skipped++;
+        if (decision && (decision->keep || registry->tagged || options->mark_duplicates)) {
+            // Route by the labels resolved in Pass 1 (no CB re-extraction or lookup).
+            // A failed write (full disk, unsorted input for coverage) ends the run.
+            if ((options->mark_duplicates && !mark_molecule(read, decision)) ||
+                dedup_dump(registry, decision->barcode, header, read, !decision->keep) != 0) {
+                log_msg("Pass 3: failed to write read %llu", ERROR, (unsigned long long) read_idx);
+                ret = -1;
+                break;
             }
+            reads_written++;
+        } else if (!decision && registry->keep_unassigned &&
+                   read->core.qual >= options->mapq_threshold &&
+                   !labelled_skip(region, &skip_idx, read_idx)) {
+            // Tag mode: reads with no label pass through untagged
+            if (unassigned_dump(registry, header, read) != 0) {
+                ret = -1;
+                break;
+            }
+            reads_written++;
         } else {
             reads_skipped++;
         }
@@ -346,14 +1022,18 @@ int write_deduplicated_region(samFile *fp, sam_hdr_t *header,
             INFO, reads_written, reads_skipped);
     
     bam_destroy1(read);
-    return (read_stat == -1) ? 0 : -1;  // -1 is normal EOF
+    if (ret == 0 && read_stat < -1) {
+        log_msg("Pass 3: failed to read input BAM", ERROR);
+        ret = -1;
+    }
+    return ret;  // -1 from sam_read1 is normal EOF
 }
 
 // Main 3-pass deduplication function
 int dedup_3pass(const char *bampath, sam_hdr_t *header, 
-               cb2fp *direct_map,
+               barcode_index_t *index,
                tag_meta_t *cb_meta, tag_meta_t *ub_meta,
-               int16_t mapq_threshold) {
+               const dedup_options_t *options) {
     
     log_msg("Starting 3-pass deduplication algorithm", INFO);
     
@@ -388,37 +1068,128 @@ int dedup_3pass(const char *bampath, sam_hdr_t *header,
         sam_close(fp);
         return -1;
     }
+    label_registry_t *registry = index->registry;
+    if (registry->sampler) {
+        region->sample_keys = malloc(region->capacity * sizeof(uint64_t));
+        if (!region->sample_keys) {
+            log_msg("Failed to allocate downsampling keys", ERROR);
+            destroy_region_decisions(region);
+            sam_close(fp);
+            return -1;
+        }
+    }
+    if (options->dedup_key == DEDUP_BY_ENDS) {
+        region->read_names = malloc(region->capacity * sizeof(read_name_t));
+        if (!region->read_names) {
+            log_msg("Failed to allocate read name index", ERROR);
+            destroy_region_decisions(region);
+            sam_close(fp);
+            return -1;
+        }
+    }
     
     // Create deduplication context
     dedup_context_t ctx = {
         .region = region,
-        .direct_map = direct_map,
+        .index = index,
         .cb_meta = cb_meta,
         .ub_meta = ub_meta,
-        .mapq_threshold = mapq_threshold
+        .mapq_threshold = options->mapq_threshold,
+        .genes = NULL,
+        .options = options
     };
+    if ((options->count_matrix || options->dedup_key == DEDUP_BY_GENE) &&
+        !(ctx.genes = create_gene_table())) {
+        destroy_region_decisions(region);
+        sam_close(fp);
+        return -1;
+    }
     
     // Pass 1: Extract minimal information
     if (extract_region_decisions(fp, header, region, &ctx) != 0) {
         log_msg("Pass 1 failed", ERROR);
+        destroy_gene_table(ctx.genes);
         destroy_region_decisions(region);
         sam_close(fp);
         return -1;
     }
     
-    // Pass 2: Mark duplicates in memory (no file I/O)
-    mark_duplicates_in_region(region);
+    // Pass 2: Mark duplicates in memory (no file I/O), counting each cell's
+    // molecules per gene on the way when asked to, or calling the cells
+    count_matrix_t *matrix = NULL;
+    cell_caller_t *cells = NULL;
+    if (ctx.genes) {
+        log_msg("Pass 1: %u genes seen", INFO, ctx.genes->count);
+    }
+    if (options->count_matrix) {
+        matrix = create_count_matrix(ctx.genes, index->registry->count,
+                                     options->dedup_key != DEDUP_BY_ENDS);
+    }
+    if (options->call_cells) {
+        cells = create_cell_caller(options->min_cell_umis);
+    }
+    if ((options->count_matrix && !matrix) || (options->call_cells && !cells) ||
+        mark_duplicates_in_region(region, options, matrix, cells) != 0 ||
+        (matrix && write_count_matrices(matrix, index->registry) != 0) ||
+        (cells && open_cell_outputs(cells, registry, options->output_prefix, header,
+                                    options->per_cell_outputs) != 0)) {
+        log_msg("Pass 2 failed", ERROR);
+        destroy_cell_caller(cells);
+        destroy_count_matrix(matrix);
+        destroy_gene_table(ctx.genes);
+        destroy_region_decisions(region);
+        sam_close(fp);
+        return -1;
+    }
+    destroy_count_matrix(matrix);
+    destroy_gene_table(ctx.genes);
+    free(region->read_names);
+    free(region->name_text);
+    region->read_names = NULL;
+    region->name_text = NULL;
+    
+    if (index->qc) {
+        for (uint64_t i = 0; i < region->count; i++) {
+            const read_decision_t *decision = &region->decisions[i];
+            qc_counts_t *counts = &index->qc->barcodes[decision->barcode->id];
+            if (decision->keep) {
+                counts->unique_umis++;
+            } else {
+                counts->duplicates++;
+            }
+        }
+    }
+    
+    // Molecule counts per label are known now: select exactly the target
+    // number of kept reads per label before anything is written
+    if (registry->sampler) {
+        for (uint64_t i = 0; i < region->count; i++) {
+            const read_decision_t *decision = &region->decisions[i];
+            if (decision->keep &&
+                offer_sample(registry->sampler, decision->barcode, region->sample_keys[i]) != 0) {
+                destroy_cell_caller(cells);
+                destroy_region_decisions(region);
+                sam_close(fp);
+                return -1;
+            }
+        }
+        finish_sampling(registry->sampler, registry);
+        free(region->sample_keys);
+        region->sample_keys = NULL;
+    }
     
     // Pass 3: Seek back to data start and write deduplicated reads
     if (bgzf_seek(hts_get_bgzfp(fp), data_start_offset, SEEK_SET) < 0) {
         log_msg("Failed to seek back to data start for Pass 3", ERROR);
+        destroy_cell_caller(cells);
         destroy_region_decisions(region);
         sam_close(fp);
         return -1;
     }
     
-    if (write_deduplicated_region(fp, header, region, direct_map, cb_meta) != 0) {
+    if (write_deduplicated_region(fp, header, region, index->registry, options) != 0) {
         log_msg("Pass 3 failed", ERROR);
+        destroy_cell_caller(cells);
         destroy_region_decisions(region);
         sam_close(fp);
         return -1;
@@ -428,6 +1199,7 @@ int dedup_3pass(const char *bampath, sam_hdr_t *header,
     
     log_msg("3-pass deduplication completed successfully", INFO);
     
+    destroy_cell_caller(cells);
     destroy_region_decisions(region);
     return 0;
 }
\ No newline at end of file
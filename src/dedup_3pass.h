@@ -16,32 +16,94 @@
 // Project includes
 #include "utils.h"
 #include "hash.h"
+#include "umi_cluster.h"
+#include "count_matrix.h"
+#include "qc.h"
+#include "downsample.h"
+#include "cell_call.h"
 
 // Core data structure for read decisions
 typedef struct {
     uint64_t read_idx;      // Position in original BAM (0-based)
-    char cb[32];            // Cell barcode 
-    char ub[32];            // UMI
-    int32_t coord;          // Genomic position
-    uint8_t strand;         // 0 for +, 1 for -
-    uint8_t mapq;           // Mapping quality
+    bc_key_t cb;            // Cell barcode (2-bit packed)
+    bc_key_t ub;            // UMI (2-bit packed), or the pair's far end without UMIs
+    const cb2fp *barcode;   // Metadata entry (output labels) resolved in pass 1
+    int32_t coord;          // Genomic position, or the gene id when deduplicating by gene
+    uint32_t molecule_size; // Reads (pairs with -K ends) in the molecule, set in pass 2
+    uint32_t gene;          // Interned gene id when counting, else GENE_NONE
+    uint16_t score;         // Best read kept: MAPQ, or base quality sum without UMIs
+    uint8_t strand;         // 0 for +, 1 for -; STRAND_BY_POSITION marks a position key;
+                            // -K ends: near end's strand | far end's strand << 1
     bool keep;              // Set in pass 2
 } read_decision_t;
 
+// -K ends: where a decision's read name is stored, found by read index
+typedef struct {
+    uint64_t read_idx;
+    uint64_t offset;                // Start of the NUL-terminated name in name_text
+} read_name_t;
+
 // Container for region-based processing
 typedef struct {
     read_decision_t *decisions;     // Array of decisions
     uint64_t capacity;              // Allocated size
     uint64_t count;                 // Current number of decisions
+    uint64_t *sample_keys;          // Downsampling: name key per decision, else NULL
+    read_name_t *read_names;        // -K ends: name per decision in input order, else NULL
+    char *name_text;                // -K ends: the names, back to back
+    uint64_t name_text_length;
+    uint64_t name_text_capacity;
+    uint64_t *labelled_skips;       // --keep-unassigned: read_idx of labelled reads left out
+    uint64_t n_labelled_skips;
+    uint64_t labelled_skips_capacity;
 } region_decisions_t;
 
+// Gene key: set in the strand of unannotated reads kept by position, so
+// their coordinates never meet gene ids (which have strand 0)
+#define STRAND_BY_POSITION 2
+
+// What besides CB and UMI identifies a molecule
+typedef enum {
+    DEDUP_BY_POSITION,              // coordinate and strand
+    DEDUP_BY_GENE,                  // interned gene id (GX/GN), as Cell Ranger counts
+    DEDUP_BY_ENDS                   // no UMI: unclipped 5' ends of read and mate (Picard-like)
+} dedup_key_t;
+
+// Without UMIs, the read with the highest sum of base qualities at or above
+// this is kept; samtools fixmate -m stores the mate's sum in MATE_SCORE_TAG
+// so both mates of a pair score alike
+#define DEDUP_MIN_BASE_QUALITY 15
+#define MATE_SCORE_TAG "ms"
+
+// User-facing deduplication settings
+typedef struct {
+    int16_t mapq_threshold;         // MAPQ threshold
+    umi_method_t umi_method;        // How UMIs within a position are collapsed
+    dedup_key_t dedup_key;          // Molecule key
+    bool unannotated_by_position;   // Gene key: reads without a gene keep position keys
+    bool mark_duplicates;           // Write duplicates flagged 0x400 instead of dropping them
+    bool count_matrix;              // Write per-label cell x gene UMI counts
+    bool call_cells;                // No metadata: keep every barcode and call cells in Pass 2
+    uint32_t min_cell_umis;         // Cell calling threshold, or CELLS_AT_KNEE
+    bool per_cell_outputs;          // Called cells each get an output instead of sharing one
+    const char *output_prefix;      // Where called-cell outputs are created
+} dedup_options_t;
+
+// Aux tag carrying the molecule's read count on its representative read
+#define MOLECULE_SIZE_TAG "DS"
+
+// Tag mode: aux tag recording the deduplication decision (1 = duplicate)
+#define DEDUP_FLAG_TAG "XD"
+
 // Context for deduplication operations
 typedef struct {
     region_decisions_t *region;     // Current region being processed
-    cb2fp *direct_map;              // Direct cell barcode to file pointer mapping
+    barcode_index_t *index;         // Barcode map, prefilter and label registry
     tag_meta_t *cb_meta;            // Cell barcode metadata
     tag_meta_t *ub_meta;            // UMI metadata
     int16_t mapq_threshold;         // MAPQ threshold
+    gene_table_t *genes;            // Gene interning when counting or keying by gene, else NULL
+    const dedup_options_t *options; // Molecule key and unannotated read policy
 } dedup_context_t;
 
 // Comparison functions for qsort
@@ -58,17 +120,18 @@ int extract_region_decisions(samFile *fp, sam_hdr_t *header,
                            region_decisions_t *region, 
                            dedup_context_t *ctx);
 
-void mark_duplicates_in_region(region_decisions_t *region);
+int mark_duplicates_in_region(region_decisions_t *region, const dedup_options_t *options,
+                              count_matrix_t *matrix, cell_caller_t *cells);
 
 int write_deduplicated_region(samFile *fp, sam_hdr_t *header,
                             region_decisions_t *region,
-                            cb2fp *direct_map,
-                            tag_meta_t *cb_meta);
+                            label_registry_t *registry,
+                            const dedup_options_t *options);
 
 // Main deduplication function
 int dedup_3pass(const char *bampath, sam_hdr_t *header, 
-               cb2fp *direct_map,
+               barcode_index_t *index,
                tag_meta_t *cb_meta, tag_meta_t *ub_meta,
-               int16_t mapq_threshold);
+               const dedup_options_t *options);
 
 #endif //SCBAMSPLIT_DEDUP_3PASS_H
\ No newline at end of file
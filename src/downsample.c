@@ -0,0 +1,114 @@
+//
+// Per-label downsampling to a target number of reads or molecules
+//
+
+#include "downsample.h"
+#include <stdlib.h>
+#include "utils.h"
+
+downsampler_t *create_downsampler(uint32_t n_labels, uint64_t target, uint64_t seed) {
+    downsampler_t *sampler = calloc(1, sizeof(downsampler_t));
+    if (!sampler) {
+        log_msg("Failed to allocate downsampler", ERROR);
+        return NULL;
+    }
+    sampler->labels = calloc(n_labels ? n_labels : 1, sizeof(label_sample_t));
+    sampler->selected = calloc(n_labels ? n_labels : 1, sizeof(uint32_t));
+    if (!sampler->labels || !sampler->selected) {
+        log_msg("Failed to allocate downsampling state for %u labels", ERROR, n_labels);
+        destroy_downsampler(sampler);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < n_labels; i++) {
+        sampler->labels[i].threshold = UINT64_MAX;
+    }
+    sampler->n_labels = n_labels;
+    sampler->target = target;
+    sampler->seed = seed;
+    sampler->collecting = true;
+    return sampler;
+}
+
+void destroy_downsampler(downsampler_t *sampler) {
+    if (!sampler) return;
+    if (sampler->labels) {
+        for (uint32_t i = 0; i < sampler->n_labels; i++) {
+            free(sampler->labels[i].keys);
+        }
+    }
+    free(sampler->labels);
+    free(sampler->selected);
+    free(sampler);
+}
+
+static void sift_up(uint64_t *heap, uint64_t i) {
+    while (i > 0) {
+        uint64_t parent = (i - 1) / 2;
+        if (heap[parent] >= heap[i]) break;
+        uint64_t tmp = heap[parent];
+        heap[parent] = heap[i];
+        heap[i] = tmp;
+        i = parent;
+    }
+}
+
+static void sift_down(uint64_t *heap, uint64_t n) {
+    uint64_t i = 0;
+    for (;;) {
+        uint64_t largest = i;
+        uint64_t left = 2 * i + 1;
+        uint64_t right = left + 1;
+        if (left < n && heap[left] > heap[largest]) largest = left;
+        if (right < n && heap[right] > heap[largest]) largest = right;
+        if (largest == i) break;
+        uint64_t tmp = heap[largest];
+        heap[largest] = heap[i];
+        heap[i] = tmp;
+        i = largest;
+    }
+}
+
+static int offer_label(label_sample_t *sample, uint64_t target, uint64_t key) {
+    sample->offered++;
+    if (sample->n_keys < target) {
+        // Grow with the label instead of reserving the target up front
+        if (sample->n_keys == sample->capacity) {
+            uint64_t new_capacity = sample->capacity ? sample->capacity * 2 : 1024;
+            if (new_capacity > target) new_capacity = target;
+            uint64_t *keys = realloc(sample->keys, new_capacity * sizeof(uint64_t));
+            if (!keys) return -1;
+            sample->keys = keys;
+            sample->capacity = new_capacity;
+        }
+        sample->keys[sample->n_keys] = key;
+        sift_up(sample->keys, sample->n_keys++);
+    } else if (key < sample->keys[0]) {
+        sample->keys[0] = key;
+        sift_down(sample->keys, sample->n_keys);
+    }
+    return 0;
+}
+
+int offer_sample(downsampler_t *sampler, const cb2fp *barcode, uint64_t key) {
+    for (uint32_t i = 0; i < barcode->n_labels; i++) {
+        if (offer_label(&sampler->labels[barcode->label_ids[i]], sampler->target, key) != 0) {
+            log_msg("Failed to expand downsampling reservoir", ERROR);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void finish_sampling(downsampler_t *sampler, const label_registry_t *registry) {
+    for (uint32_t i = 0; i < sampler->n_labels; i++) {
+        label_sample_t *sample = &sampler->labels[i];
+        // Labels below the target keep everything
+        sample->threshold = sample->offered > sampler->target ? sample->keys[0] : UINT64_MAX;
+        log_msg("Downsampling %s: keeping %llu of %llu", INFO, registry->entries[i].label,
+                (unsigned long long) sample->n_keys, (unsigned long long) sample->offered);
+        free(sample->keys);
+        sample->keys = NULL;
+        sample->n_keys = sample->capacity = 0;
+    }
+    sampler->collecting = false;
+}
@@ -0,0 +1,65 @@
+//
+// Per-label downsampling to a target number of reads or molecules
+//
+// Every candidate read gets a key from a seeded hash of its name, and each
+// label keeps the N smallest keys it is offered (a bottom-N sketch, i.e. a
+// reservoir sample with hash priorities). Once all candidates have been
+// offered, a read is written to a label when its key is at or below that
+// label's N-th smallest key. Selection is deterministic for a given seed,
+// and mates share a name, so pairs are kept or dropped together.
+
+#ifndef SCBAMSPLIT_DOWNSAMPLE_H
+#define SCBAMSPLIT_DOWNSAMPLE_H
+
+// Standard library includes
+#include <stdbool.h>
+#include <stdint.h>
+
+// External library includes
+#include "htslib/sam.h"
+
+// Project includes
+#include "hash.h"
+
+typedef struct {
+    uint64_t *keys;                       /* max-heap of the smallest keys offered */
+    uint64_t n_keys;
+    uint64_t capacity;
+    uint64_t offered;                     /* candidates seen for this label */
+    uint64_t threshold;                   /* largest selected key; UINT64_MAX keeps all */
+} label_sample_t;
+
+typedef struct downsampler {
+    label_sample_t *labels;               /* indexed by label id */
+    uint32_t n_labels;
+    uint32_t *selected;                   /* scratch: selected labels of one read */
+    uint64_t target;                      /* reads (or molecules) kept per label */
+    uint64_t seed;
+    bool collecting;                      /* offering keys; nothing is written yet */
+} downsampler_t;
+
+downsampler_t *create_downsampler(uint32_t n_labels, uint64_t target, uint64_t seed);
+void destroy_downsampler(downsampler_t *sampler);
+
+// Seeded hash of a read's name
+static inline uint64_t read_sample_key(const downsampler_t *sampler, const bam1_t *read) {
+    const unsigned char *name = (const unsigned char *) bam_get_qname(read);
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
+    while (*name) {
+        h = (h ^ *name++) * UINT64_C(0x100000001b3);
+    }
+    return bc_hash(h ^ sampler->seed);
+}
+
+// Offer a candidate read to every label of its barcode
+int offer_sample(downsampler_t *sampler, const cb2fp *barcode, uint64_t key);
+
+// Fix each label's threshold once every candidate has been offered
+void finish_sampling(downsampler_t *sampler, const label_registry_t *registry);
+
+static inline bool sample_selected(const downsampler_t *sampler, uint32_t label_id,
+                                   uint64_t key) {
+    return key <= sampler->labels[label_id].threshold;
+}
+
+#endif //SCBAMSPLIT_DOWNSAMPLE_H
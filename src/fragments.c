@@ -0,0 +1,411 @@
+//
+// scATAC fragment mode
+//
+
+#include "fragments.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "htslib/bgzf.h"
+#include "htslib/tbx.h"
+#include "utils.h"
+#include "qc.h"
+
+// A mate waiting for its partner, keyed by a hash of the read name
+typedef struct pending_mate {
+    uint64_t name;
+    int32_t tid;
+    int64_t pos;
+    int64_t end;
+    const cb2fp *barcode;
+    struct pending_mate *next_free;
+    UT_hash_handle hh;
+} pending_mate_t;
+
+// Mates in arrival (and so position) order, plus recycled entries
+typedef struct {
+    pending_mate_t *table;
+    pending_mate_t *free_list;
+    uint64_t orphans;
+} mate_pairing_t;
+
+static inline uint64_t read_name_key(const bam1_t *read) {
+    const unsigned char *name = (const unsigned char *) bam_get_qname(read);
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
+    while (*name) {
+        h = (h ^ *name++) * UINT64_C(0x100000001b3);
+    }
+    return bc_hash(h);
+}
+
+static void release_mate(mate_pairing_t *pairing, pending_mate_t *mate) {
+    HASH_DEL(pairing->table, mate);
+    mate->next_free = pairing->free_list;
+    pairing->free_list = mate;
+}
+
+// Drop mates whose partner can no longer arrive. uthash keeps insertion
+// order, so the stale ones are all at the head.
+static void evict_stale_mates(mate_pairing_t *pairing, int32_t tid, int64_t pos) {
+    while (pairing->table &&
+           (pairing->table->tid != tid || pairing->table->pos + FRAGMENT_PAIR_WINDOW < pos)) {
+        release_mate(pairing, pairing->table);
+        pairing->orphans++;
+    }
+}
+
+static int hold_mate(mate_pairing_t *pairing, uint64_t name, const bam1_t *read,
+                     const cb2fp *barcode) {
+    pending_mate_t *mate = pairing->free_list;
+    if (mate) {
+        pairing->free_list = mate->next_free;
+    } else if (!(mate = malloc(sizeof(pending_mate_t)))) {
+        log_msg("Failed to allocate pending mate", ERROR);
+        return -1;
+    }
+    mate->name = name;
+    mate->tid = read->core.tid;
+    mate->pos = read->core.pos;
+    mate->end = bam_endpos(read);
+    mate->barcode = barcode;
+    HASH_ADD_BYHASHVALUE(hh, pairing->table, name, sizeof(uint64_t), (unsigned) name, mate);
+    return 0;
+}
+
+static void destroy_mate_pairing(mate_pairing_t *pairing) {
+    pending_mate_t *mate, *tmp;
+    HASH_ITER(hh, pairing->table, mate, tmp) {
+        HASH_DEL(pairing->table, mate);
+        free(mate);
+    }
+    while ((mate = pairing->free_list)) {
+        pairing->free_list = mate->next_free;
+        free(mate);
+    }
+}
+
+static int add_fragment(fragment_set_t *set, const cb2fp *barcode, int32_t tid,
+                        int64_t start, int64_t end) {
+    start += TN5_SHIFT_START;
+    end -= TN5_SHIFT_END;
+    if (end <= start || start > UINT32_MAX || end - start > UINT32_MAX) return 0;
+
+    if (set->count == set->capacity) {
+        uint64_t new_capacity = set->capacity ? set->capacity * 2 : 1 << 20;
+        fragment_t *fragments = realloc(set->fragments, new_capacity * sizeof(fragment_t));
+        if (!fragments) {
+            log_msg("Failed to expand fragment array", ERROR);
+            return -1;
+        }
+        set->fragments = fragments;
+        set->capacity = new_capacity;
+    }
+    fragment_t *fragment = &set->fragments[set->count++];
+    fragment->cb = barcode->cb;
+    fragment->locus = (uint64_t) tid << 32 | (uint64_t) start;
+    fragment->barcode = barcode;
+    fragment->length = (uint32_t) (end - start);
+    fragment->count = 1;
+    set->paired++;
+    return 0;
+}
+
+// Output order: coordinate, then length and barcode, so identical
+// fragments are adjacent
+static int compare_by_locus(const void *a, const void *b) {
+    const fragment_t *fa = a;
+    const fragment_t *fb = b;
+    if (fa->locus != fb->locus) return fa->locus < fb->locus ? -1 : 1;
+    if (fa->length != fb->length) return fa->length < fb->length ? -1 : 1;
+    return (fa->cb > fb->cb) - (fa->cb < fb->cb);
+}
+
+// One label's fragments file and the tabix index built alongside it
+typedef struct {
+    BGZF *fp;
+    hts_idx_t *idx;
+    char path[4096];
+} fragment_output_t;
+
+// Tabix header: BED column layout followed by the NUL-separated contig names
+static uint8_t *build_tabix_meta(const sam_hdr_t *header, uint32_t *l_meta) {
+    kstring_t names = KS_INITIALIZE;
+    for (int tid = 0; tid < sam_hdr_nref(header); tid++) {
+        kputs(sam_hdr_tid2name(header, tid), &names);
+        kputc('\0', &names);
+    }
+    int32_t conf[7] = {
+        tbx_conf_bed.preset, tbx_conf_bed.sc, tbx_conf_bed.bc, tbx_conf_bed.ec,
+        tbx_conf_bed.meta_char, tbx_conf_bed.line_skip, (int32_t) names.l
+    };
+    uint8_t *meta = malloc(sizeof(conf) + names.l);
+    if (meta) {
+        memcpy(meta, conf, sizeof(conf));
+        if (names.l) memcpy(meta + sizeof(conf), names.s, names.l);
+        *l_meta = sizeof(conf) + names.l;
+    }
+    ks_free(&names);
+    return meta;
+}
+
+static int open_fragment_output(fragment_output_t *out, const label_entry_t *entry,
+                                uint8_t *meta, uint32_t l_meta) {
+    if (snprintf(out->path, sizeof(out->path), "%s%s.fragments.tsv.gz",
+                 entry->prefix, entry->label) >= (int) sizeof(out->path)) {
+        log_msg("Output path too long for label: %s", ERROR, entry->label);
+        return -1;
+    }
+    out->fp = bgzf_open(out->path, "w");
+    if (!out->fp) {
+        log_msg("Failed to create output file: %s", ERROR, out->path);
+        return -1;
+    }
+    // Tabix defaults: 16 kb bins over 5 levels
+    out->idx = hts_idx_init(0, HTS_FMT_TBI, bgzf_tell(out->fp), 14, 5);
+    if (!out->idx || hts_idx_set_meta(out->idx, l_meta, meta, 1) != 0) {
+        log_msg("Failed to create tabix index for %s", ERROR, out->path);
+        return -1;
+    }
+    return 0;
+}
+
+// Finish the index once everything is written; on failure just close
+static int close_fragment_output(fragment_output_t *out, bool complete) {
+    int ret = 0;
+    if (out->fp && out->idx && complete) {
+        if (bgzf_flush(out->fp) != 0 || hts_idx_finish(out->idx, bgzf_tell(out->fp)) != 0) {
+            ret = -1;
+        }
+    }
+    if (out->fp && bgzf_close(out->fp) != 0) ret = -1;
+    if (ret == 0 && out->idx && complete &&
+        hts_idx_save_as(out->idx, out->path, NULL, HTS_FMT_TBI) != 0) {
+        ret = -1;
+    }
+    if (ret != 0) log_msg("Failed to finish %s", ERROR, out->path);
+    hts_idx_destroy(out->idx);
+    out->fp = NULL;
+    out->idx = NULL;
+    return ret;
+}
+
+// Per-label outputs, open for the whole run
+typedef struct {
+    fragment_output_t *outputs;           /* indexed by label id */
+    uint32_t n_outputs;
+    sam_hdr_t *header;
+    qc_stats_t *qc;
+} fragment_writer_t;
+
+static int open_fragment_writer(fragment_writer_t *writer, sam_hdr_t *header,
+                                const label_registry_t *registry, qc_stats_t *qc) {
+    writer->header = header;
+    writer->qc = qc;
+    writer->n_outputs = registry->count;
+    writer->outputs = calloc(registry->count ? registry->count : 1, sizeof(fragment_output_t));
+    uint32_t l_meta = 0;
+    uint8_t *meta = build_tabix_meta(header, &l_meta);
+    if (!writer->outputs || !meta) {
+        log_msg("Failed to allocate fragment outputs", ERROR);
+        free(meta);
+        return -1;
+    }
+    int ret = 0;
+    for (uint32_t l = 0; l < registry->count && ret == 0; l++) {
+        ret = open_fragment_output(&writer->outputs[l], &registry->entries[l], meta, l_meta);
+    }
+    free(meta);
+    return ret;
+}
+
+static int close_fragment_writer(fragment_writer_t *writer, bool complete) {
+    int ret = 0;
+    for (uint32_t l = 0; writer->outputs && l < writer->n_outputs; l++) {
+        if (close_fragment_output(&writer->outputs[l], complete) != 0) ret = -1;
+    }
+    free(writer->outputs);
+    writer->outputs = NULL;
+    return ret;
+}
+
+// Write one collapsed fragment to each of its labels
+static int write_fragment(fragment_writer_t *writer, const fragment_t *fragment) {
+    char line[1024];
+    char cb[32];
+    int32_t tid = (int32_t) (fragment->locus >> 32);
+    int64_t start = (int64_t) (fragment->locus & UINT32_MAX);
+    int64_t end = start + fragment->length;
+    bc_unpack(fragment->cb, cb);
+    int len = snprintf(line, sizeof(line), "%s\t%lld\t%lld\t%s\t%u\n",
+                       sam_hdr_tid2name(writer->header, tid), (long long) start,
+                       (long long) end, cb, fragment->count);
+    if (len < 0 || len >= (int) sizeof(line)) {
+        log_msg("Fragment line too long", ERROR);
+        return -1;
+    }
+
+    for (uint32_t l = 0; l < fragment->barcode->n_labels; l++) {
+        fragment_output_t *out = &writer->outputs[fragment->barcode->label_ids[l]];
+        if (bgzf_write(out->fp, line, len) != len ||
+            hts_idx_push(out->idx, tid, start, end, bgzf_tell(out->fp), 1) != 0) {
+            log_msg("Failed to write fragment to %s", ERROR, out->path);
+            return -1;
+        }
+    }
+    if (writer->qc) {
+        qc_counts_t *counts = &writer->qc->barcodes[fragment->barcode->id];
+        counts->unique_umis++;
+        counts->duplicates += fragment->count - 1;
+    }
+    return 0;
+}
+
+// Collapse and write the fragments starting before bound (tid << 32 | shifted
+// start). No later read pair can start there, so they are final; the rest
+// stay buffered. Flushes are spaced so each re-sorts at most half the buffer.
+static int flush_fragments(fragment_set_t *set, fragment_writer_t *writer, uint64_t bound) {
+    if (set->count > 0) {
+        qsort(set->fragments, set->count, sizeof(fragment_t), compare_by_locus);
+    }
+    uint64_t n = 0;
+    while (n < set->count && set->fragments[n].locus < bound) n++;
+
+    int ret = 0;
+    for (uint64_t i = 0; i < n && ret == 0;) {
+        fragment_t fragment = set->fragments[i];
+        uint64_t j = i + 1;
+        while (j < n && compare_by_locus(&set->fragments[j], &fragment) == 0) j++;
+        fragment.count = (uint32_t) (j - i);
+        ret = write_fragment(writer, &fragment);
+        set->unique++;
+        i = j;
+    }
+
+    memmove(set->fragments, set->fragments + n, (set->count - n) * sizeof(fragment_t));
+    set->count -= n;
+    set->flush_at = set->count * 2 > FRAGMENT_FLUSH_MIN ? set->count * 2 : FRAGMENT_FLUSH_MIN;
+    return ret;
+}
+
+// Stream the input once, turning each properly paired read pair of a
+// metadata barcode into a fragment and writing fragments once final
+static int stream_fragments(samFile *fp, sam_hdr_t *header, barcode_index_t *index,
+                            tag_reader_t *reader, int64_t mapq_thres, fragment_set_t *set,
+                            fragment_writer_t *writer) {
+    read_batch_t *batch = create_read_batch();
+    if (!batch) return -1;
+
+    mate_pairing_t pairing = {NULL, NULL, 0};
+    qc_stats_t *qc = index->qc;
+    enum location cb_loc = reader->cb_meta->location;
+    char this_CB[CB_LENGTH];
+    int32_t last_tid = -1;
+    int64_t last_pos = -1;
+    uint64_t barcodes_checked = 0;
+    uint64_t barcodes_rejected = 0;
+    int read_stat = -1;
+    int ret = 0;
+
+    while (ret == 0 && fill_read_batch(fp, header, batch, &read_stat) > 0) {
+        for (int i = 0; i < batch->count && ret == 0; i++) {
+            bam1_t *read = batch->reads[i];
+            const bam1_core_t *c = &read->core;
+
+            if (c->tid >= 0) {
+                if (c->tid < last_tid || (c->tid == last_tid && c->pos < last_pos)) {
+                    log_msg("Fragment mode needs coordinate-sorted input", ERROR);
+                    ret = -1;
+                    break;
+                }
+                if (c->tid != last_tid || c->pos != last_pos) {
+                    evict_stale_mates(&pairing, c->tid, c->pos);
+                    // Held mates start at most one window back, so earlier
+                    // fragments are final
+                    if (set->count >= set->flush_at) {
+                        int64_t first = c->pos - FRAGMENT_PAIR_WINDOW + TN5_SHIFT_START;
+                        if (first < 0) first = 0;
+                        uint64_t bound = (uint64_t) c->tid << 32 | (uint64_t) first;
+                        if (flush_fragments(set, writer, bound) != 0) {
+                            ret = -1;
+                            break;
+                        }
+                    }
+                }
+                last_tid = c->tid;
+                last_pos = c->pos;
+            }
+
+            // QC counts every read of a barcode, so it still looks up the skipped ones
+            bool skip = (c->flag & FRAGMENT_SKIP_FLAGS) || !(c->flag & BAM_FPROPER_PAIR) ||
+                        c->tid != c->mtid;
+            bool low_mapq = c->qual < mapq_thres;
+            if ((skip || low_mapq) && !qc) continue;
+
+            bc_key_t cb;
+            if (extract_CB_key(read, reader, this_CB, cb_loc, &cb) != 0) continue;
+            uint64_t hash = bc_hash(cb);
+            barcodes_checked++;
+            if (index->prefilter && !bc_bloom_test(index->prefilter, hash)) {
+                barcodes_rejected++;
+                continue;
+            }
+            cb2fp *entry = find_barcode_hashed(index->direct_map, cb, (unsigned) hash);
+            if (!entry && index->neighbors) {
+                entry = correct_barcode(index->neighbors, cb, read);
+            }
+            if (!entry) continue;
+            if (qc) {
+                qc_count_read(qc, entry, low_mapq, (c->flag & BAM_FSECONDARY) != 0);
+                if (skip || low_mapq) continue;
+            }
+
+            uint64_t name = read_name_key(read);
+            pending_mate_t *mate;
+            HASH_FIND_BYHASHVALUE(hh, pairing.table, &name, sizeof(uint64_t), (unsigned) name, mate);
+            if (mate) {
+                // The held mate is the leftmost; the fragment ends where either mate does
+                int64_t end = bam_endpos(read);
+                if (mate->end > end) end = mate->end;
+                ret = add_fragment(set, mate->barcode, mate->tid, mate->pos, end);
+                release_mate(&pairing, mate);
+            } else if (c->pos <= c->mpos) {
+                ret = hold_mate(&pairing, name, read, entry);
+            }
+        }
+    }
+    if (ret == 0 && read_stat < -1) {
+        log_msg("Failed to read input BAM", ERROR);
+        ret = -1;
+    }
+    if (ret == 0) ret = flush_fragments(set, writer, UINT64_MAX);
+
+    pairing.orphans += HASH_COUNT(pairing.table);
+    log_msg("Paired %llu fragments; %llu mates had no partner within %d bp", INFO,
+            (unsigned long long) set->paired, (unsigned long long) pairing.orphans,
+            FRAGMENT_PAIR_WINDOW);
+    log_msg("Deduplicated %llu fragments to %llu", INFO,
+            (unsigned long long) set->paired, (unsigned long long) set->unique);
+    log_prefilter_stats(barcodes_checked, barcodes_rejected);
+
+    destroy_mate_pairing(&pairing);
+    destroy_read_batch(batch);
+    return ret;
+}
+
+int split_fragments(samFile *fp, sam_hdr_t *header, barcode_index_t *index,
+                    tag_meta_t *cb_meta, tag_meta_t *ub_meta, int64_t mapq_thres) {
+    tag_reader_t reader;
+    init_tag_reader(&reader, cb_meta, ub_meta);
+    reader.neighbors = index->neighbors;
+    fragment_set_t set = {NULL, 0, 0, FRAGMENT_FLUSH_MIN, 0, 0};
+    fragment_writer_t writer = {NULL, 0, NULL, NULL};
+
+    log_msg("Fragment mode: pairing mates", INFO);
+    int ret = open_fragment_writer(&writer, header, index->registry, index->qc);
+    if (ret == 0) {
+        ret = stream_fragments(fp, header, index, &reader, mapq_thres, &set, &writer);
+    }
+    if (close_fragment_writer(&writer, ret == 0) != 0) ret = -1;
+    free(set.fragments);
+    return ret;
+}
@@ -0,0 +1,63 @@
+//
+// scATAC fragment mode
+//
+// Properly paired reads are paired by name as they stream past, which needs
+// coordinate-sorted input: a mate waits in a table until its partner
+// arrives or the input has moved more than FRAGMENT_PAIR_WINDOW past it.
+// Each pair becomes one Tn5-shifted fragment keyed by cell barcode and a
+// packed locus. A fragment starting more than the pairing window behind
+// the input can gain no more pairs, so such fragments are sorted, collapsed
+// (keeping the number of read pairs behind each one) and written in
+// coordinate order as the input streams, to a bgzipped
+// <label>.fragments.tsv.gz per label with the tabix index built alongside.
+// Only about one window of fragments is held in memory.
+
+#ifndef SCBAMSPLIT_FRAGMENTS_H
+#define SCBAMSPLIT_FRAGMENTS_H
+
+// Standard library includes
+#include <stdint.h>
+
+// External library includes
+#include "htslib/sam.h"
+
+// Project includes
+#include "hash.h"
+#include "sort.h"
+
+// Mates further apart than this are not paired
+#define FRAGMENT_PAIR_WINDOW 5000
+
+// Tn5 insertion offsets, as in Cell Ranger ATAC
+#define TN5_SHIFT_START 4
+#define TN5_SHIFT_END 5
+
+// Reads that never contribute to a fragment
+#define FRAGMENT_SKIP_FLAGS (BAM_FUNMAP | BAM_FMUNMAP | BAM_FSECONDARY | \
+                             BAM_FSUPPLEMENTARY | BAM_FQCFAIL)
+
+typedef struct {
+    bc_key_t cb;            // Cell barcode (corrected, 2-bit packed)
+    uint64_t locus;         // tid << 32 | shifted start
+    const cb2fp *barcode;   // Metadata entry (output labels)
+    uint32_t length;        // Shifted end - start
+    uint32_t count;         // Read pairs behind the fragment, set when deduplicating
+} fragment_t;
+
+// Fragments buffered before a flush, at least
+#define FRAGMENT_FLUSH_MIN (1 << 16)
+
+typedef struct {
+    fragment_t *fragments;  // Paired but not yet written
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t flush_at;      // Buffered count that triggers the next flush
+    uint64_t paired;        // Fragments paired so far
+    uint64_t unique;        // Collapsed fragments written
+} fragment_set_t;
+
+// Pair, deduplicate and write fragments for every label in the index
+int split_fragments(samFile *fp, sam_hdr_t *header, barcode_index_t *index,
+                    tag_meta_t *cb_meta, tag_meta_t *ub_meta, int64_t mapq_thres);
+
+#endif //SCBAMSPLIT_FRAGMENTS_H
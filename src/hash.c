@@ -64,17 +64,419 @@ uint32_t count_unique_labels(const char *path) {
     return unique_count;
 }
 
-cb2fp* hash_readtag_direct(char *path, const char *prefix, sam_hdr_t *header) {
+// Create an empty label registry
+label_registry_t *create_label_registry(uint32_t initial_capacity) {
+    label_registry_t *registry = calloc(1, sizeof(label_registry_t));
+    if (!registry) {
+        log_msg("Failed to allocate label registry", ERROR);
+        return NULL;
+    }
+
+    if (initial_capacity == 0) initial_capacity = 16;
+    registry->entries = calloc(initial_capacity, sizeof(label_entry_t));
+    if (!registry->entries) {
+        log_msg("Failed to allocate label registry entries", ERROR);
+        free(registry);
+        return NULL;
+    }
+    registry->capacity = initial_capacity;
+    registry->count = 0;
+
+    return registry;
+}
+
+// Register a label with its output prefix and file, returning the new label id (-1 on error)
+int32_t add_label(label_registry_t *registry, const char *label, const char *prefix,
+                  samFile *fp) {
+    if (registry->count >= registry->capacity) {
+        if (registry->capacity > INT32_MAX / 2) {
+            log_msg("Cannot expand label registry: too many labels", ERROR);
+            return -1;
+        }
+        uint32_t new_capacity = registry->capacity * 2;
+        label_entry_t *new_entries = realloc(registry->entries,
+                                             new_capacity * sizeof(label_entry_t));
+        if (!new_entries) {
+            log_msg("Failed to expand label registry", ERROR);
+            return -1;
+        }
+        registry->entries = new_entries;
+        registry->capacity = new_capacity;
+    }
+
+    label_entry_t *entry = &registry->entries[registry->count];
+    strncpy(entry->label, label, sizeof(entry->label) - 1);
+    entry->label[sizeof(entry->label) - 1] = '\0';
+    entry->prefix = NULL;
+    if (prefix) {
+        entry->prefix = strdup(prefix);
+        if (!entry->prefix) {
+            log_msg("Failed to allocate label output prefix", ERROR);
+            return -1;
+        }
+    }
+    entry->fp = fp;
+    entry->coverage = NULL;
+
+    return (int32_t) registry->count++;
+}
+
+// Create <prefix><label>.bam with the input header and register it.
+// Returns the new label id, or -1 on error.
+int32_t open_label_output(label_registry_t *registry, const char *label, const char *prefix,
+                          sam_hdr_t *header) {
+    char output_path[512];
+    size_t prefix_len = strlen(prefix);
+    size_t label_len = strlen(label);
+    
+    // Check if the combined path would exceed buffer size
+    if (prefix_len + label_len + 5 >= sizeof(output_path)) {  // 5 = ".bam" + null terminator
+        log_msg("Output path too long for label: %s", ERROR, label);
+        return -1;
+    }
+    
+    snprintf(output_path, sizeof(output_path), "%s%s.bam", prefix, label);
+    
+    samFile *output_fp = sam_open(output_path, "wb");
+    if (!output_fp) {
+        log_msg("Failed to create output file: %s", ERROR, output_path);
+        return -1;
+    }
+    
+    // Write header to the new file
+    if (sam_hdr_write(output_fp, header) < 0) {
+        log_msg("Failed to write header to: %s", ERROR, output_path);
+        sam_close(output_fp);
+        return -1;
+    }
+    
+    // Hand the file over to the registry, which owns it from here on
+    int32_t label_id = add_label(registry, label, prefix, output_fp);
+    if (label_id < 0) {
+        sam_close(output_fp);
+        return -1;
+    }
+    
+    log_msg("Created output file: %s", INFO, output_path);
+    return label_id;
+}
+
+// Make a label safe to use as a file name: path separators, "~", leading
+// dots, ".." and anything outside [A-Za-z0-9_. -] become underscores.
+// Returns true if the label was changed.
+bool sanitize_label(char *label) {
+    bool modified = false;
+    
+    // Replace path traversal sequences and invalid characters
+    for (char *p = label; *p; p++) {
+        if (*p == '/' || *p == '\\' || *p == '~') {
+            *p = '_';
+            modified = true;
+        } else if (!isalnum((unsigned char) *p) && *p != '_' && *p != '-' && *p != ' ' && *p != '.') {
+            *p = '_';
+            modified = true;
+        }
+    }
+    
+    // Handle leading dots (hidden files)
+    if (label[0] == '.') {
+        label[0] = '_';
+        modified = true;
+    }
+    
+    // Handle ".." sequences
+    char *dot_dot = strstr(label, "..");
+    while (dot_dot) {
+        dot_dot[0] = '_';
+        dot_dot[1] = '_';
+        modified = true;
+        dot_dot = strstr(dot_dot + 2, "..");
+    }
+    return modified;
+}
+
+// Close every registered output file and free the registry
+void destroy_label_registry(label_registry_t *registry) {
+    if (!registry) return;
+
+    for (uint32_t i = 0; i < registry->count; i++) {
+        if (registry->entries[i].fp) {
+            sam_close(registry->entries[i].fp);
+        }
+        free(registry->entries[i].prefix);
+        close_coverage_track(registry->entries[i].coverage);
+    }
+    if (registry->tagged) {
+        sam_close(registry->tagged);
+    }
+    free(registry->entries);
+    ks_free(&registry->scratch);
+    free(registry);
+}
+
+// Start a <prefix><label>.bedGraph coverage track for every label with outputs
+int open_coverage_tracks(label_registry_t *registry, const sam_hdr_t *header) {
+    for (uint32_t i = 0; i < registry->count; i++) {
+        label_entry_t *entry = &registry->entries[i];
+        if (!entry->prefix) continue;
+
+        char path[4096];
+        if (snprintf(path, sizeof(path), "%s%s.bedGraph", entry->prefix, entry->label)
+            >= (int) sizeof(path)) {
+            log_msg("Output path too long for label: %s", ERROR, entry->label);
+            return -1;
+        }
+        entry->coverage = create_coverage_track(path, header);
+        if (!entry->coverage) return -1;
+    }
+    registry->coverage = true;
+    return 0;
+}
+
+// Flush and close every coverage track, reporting any write failure
+int close_coverage_tracks(label_registry_t *registry) {
+    int ret = 0;
+    for (uint32_t i = 0; i < registry->count; i++) {
+        if (close_coverage_track(registry->entries[i].coverage) != 0) {
+            log_msg("Failed to write coverage track for %s", ERROR, registry->entries[i].label);
+            ret = -1;
+        }
+        registry->entries[i].coverage = NULL;
+    }
+    registry->coverage = false;
+    return ret;
+}
+
+// Build a Bloom prefilter so reads from barcodes outside the metadata
+// (empty droplets) are rejected before any further tag work or lookup
+bc_bloom_t *build_barcode_prefilter(cb2fp *direct_map) {
+    bc_bloom_t *bloom = bc_bloom_create(HASH_COUNT(direct_map));
+    if (!bloom) {
+        log_msg("Failed to allocate barcode prefilter", ERROR);
+        return NULL;
+    }
+
+    cb2fp *entry, *tmp;
+    HASH_ITER(hh, direct_map, entry, tmp) {
+        bc_bloom_add(bloom, bc_hash(entry->cb));
+    }
+    return bloom;
+}
+
+// Find the slot holding key, or the empty slot where it would go
+static bc_neighbor_t *neighbor_slot(neighbor_index_t *neighbors, bc_key_t key) {
+    uint64_t i = bc_hash(key) & neighbors->mask;
+    while (neighbors->slots[i].key != 0 && neighbors->slots[i].key != key) {
+        i = (i + 1) & neighbors->mask;
+    }
+    return &neighbors->slots[i];
+}
+
+// True if two barcodes route to exactly the same labels
+static bool same_labels(const cb2fp *a, const cb2fp *b) {
+    if (a->n_labels != b->n_labels) return false;
+    return memcmp(a->label_ids, b->label_ids, a->n_labels * sizeof(uint32_t)) == 0;
+}
+
+// True if the slot maps a barcode to itself rather than to a neighbor
+static inline bool neighbor_is_exact(const bc_neighbor_t *slot) {
+    return slot->parent && BC_STRIP_SUFFIX(slot->parent->cb) == slot->key;
+}
+
+neighbor_index_t *build_neighbor_index(cb2fp *direct_map) {
+    // Each barcode contributes itself plus 3 variants per base
+    uint64_t n_keys = 0;
+    cb2fp *entry, *tmp;
+    HASH_ITER(hh, direct_map, entry, tmp) {
+        if (BC_IS_SEQUENCE(entry->cb)) n_keys += 1 + 3 * (uint64_t) BC_LENGTH(entry->cb);
+    }
+
+    // Keep the load factor at or below 1/2
+    uint64_t n_slots = 1;
+    while (n_slots < n_keys * 2) n_slots <<= 1;
+
+    neighbor_index_t *neighbors = malloc(sizeof(neighbor_index_t));
+    if (!neighbors) {
+        log_msg("Failed to allocate barcode neighbor index", ERROR);
+        return NULL;
+    }
+    neighbors->slots = calloc(n_slots, sizeof(bc_neighbor_t));
+    if (!neighbors->slots) {
+        log_msg("Failed to allocate %llu barcode neighbor slots (%.1f MB)", ERROR,
+                (unsigned long long) n_slots, n_slots * sizeof(bc_neighbor_t) / (1024.0 * 1024.0));
+        free(neighbors);
+        return NULL;
+    }
+    neighbors->mask = n_slots - 1;
+
+    // Exact barcodes first so they always win over neighbors. Other cell ids
+    // (spot ids, interned ids) have no bases to mismatch and only match exactly.
+    HASH_ITER(hh, direct_map, entry, tmp) {
+        if (!BC_IS_SEQUENCE(entry->cb)) continue;
+        bc_key_t key = BC_STRIP_SUFFIX(entry->cb);
+        bc_neighbor_t *slot = neighbor_slot(neighbors, key);
+        if (slot->key == 0) {
+            slot->key = key;
+            slot->parent = entry;
+        } else if (slot->parent && !same_labels(slot->parent, entry)) {
+            // Same bases under different suffixes with different labels
+            slot->parent = NULL;
+        }
+    }
+
+    uint64_t n_ambiguous = 0;
+    HASH_ITER(hh, direct_map, entry, tmp) {
+        if (!BC_IS_SEQUENCE(entry->cb)) continue;
+        bc_key_t key = BC_STRIP_SUFFIX(entry->cb);
+        uint32_t len = BC_LENGTH(key);
+        for (uint32_t i = 0; i < len; i++) {
+            uint64_t code = (key >> (2 * i)) & 3;
+            for (uint64_t alt = 0; alt < 4; alt++) {
+                if (alt == code) continue;
+                bc_key_t variant = key ^ ((code ^ alt) << (2 * i));
+                bc_neighbor_t *slot = neighbor_slot(neighbors, variant);
+                if (slot->key == 0) {
+                    slot->key = variant;
+                    slot->parent = entry;
+                } else if (slot->parent && BC_STRIP_SUFFIX(slot->parent->cb) != key &&
+                           !neighbor_is_exact(slot)) {
+                    // One mismatch away from two metadata barcodes
+                    slot->parent = NULL;
+                    n_ambiguous++;
+                }
+            }
+        }
+    }
+
+    log_msg("Built barcode neighbor index: %llu keys, %llu ambiguous neighbors", INFO,
+            (unsigned long long) n_keys, (unsigned long long) n_ambiguous);
+    return neighbors;
+}
+
+void destroy_neighbor_index(neighbor_index_t *neighbors) {
+    if (neighbors) {
+        free(neighbors->slots);
+        free(neighbors);
+    }
+}
+
+// Resolve an ambiguous neighbor using base qualities: among metadata
+// barcodes one mismatch away, pick the one whose mismatch falls on the
+// single lowest-quality base of the observed barcode
+static cb2fp *resolve_ambiguous(neighbor_index_t *neighbors, bc_key_t key, const bam1_t *read) {
+    const uint8_t *cy = bam_aux_get(read, "CY");
+    if (!cy || *cy != 'Z') return NULL;
+    const char *qual = (const char *) cy + 1;
+    uint32_t len = BC_LENGTH(key);
+    if (strlen(qual) < len) return NULL;
+
+    cb2fp *best = NULL;
+    int best_qual = 256;
+    bool tie = false;
+    for (uint32_t i = 0; i < len; i++) {
+        uint64_t code = (key >> (2 * i)) & 3;
+        for (uint64_t alt = 0; alt < 4; alt++) {
+            if (alt == code) continue;
+            bc_neighbor_t *slot = neighbor_slot(neighbors, key ^ ((code ^ alt) << (2 * i)));
+            if (slot->key == 0 || !neighbor_is_exact(slot)) continue;
+
+            int q = (uint8_t) qual[i];
+            if (q < best_qual) {
+                best = slot->parent;
+                best_qual = q;
+                tie = false;
+            } else if (q == best_qual) {
+                tie = true;
+            }
+        }
+    }
+    return tie ? NULL : best;
+}
+
+// Map a barcode that missed the exact lookup onto a metadata barcode at
+// Hamming distance <= 1 (ignoring any "-N" suffix). Returns NULL if none.
+cb2fp *correct_barcode(neighbor_index_t *neighbors, bc_key_t key, const bam1_t *read) {
+    bc_key_t stripped = BC_STRIP_SUFFIX(key);
+    bc_neighbor_t *slot = neighbor_slot(neighbors, stripped);
+    if (slot->key == 0) return NULL;
+    if (slot->parent) return slot->parent;
+    return resolve_ambiguous(neighbors, stripped, read);
+}
+
+// Recover a barcode with one N (no-call) by trying A, C, G and T at that base.
+// The result must match exactly one metadata barcode; another invalid byte,
+// a second N or several hits leave it unresolved, even if the hits share
+// their labels, since the read's cell would still be ambiguous.
+int8_t resolve_n_barcode(neighbor_index_t *neighbors, const char *cb, bc_key_t *key) {
+    static const char bases[4] = {'A', 'C', 'G', 'T'};
+    char seq[BC_MAX_BASES + 4];
+    size_t len = strlen(cb);
+    if (len >= sizeof(seq)) return -1;
+    memcpy(seq, cb, len + 1);
+
+    char *n = NULL;
+    for (char *p = seq; *p && *p != '-'; p++) {
+        if (*p != 'N') continue;
+        if (n) return -1;
+        n = p;
+    }
+    if (!n) return -1;
+
+    cb2fp *found = NULL;
+    for (int b = 0; b < 4; b++) {
+        bc_key_t candidate;
+        *n = bases[b];
+        if (bc_pack(seq, len, &candidate) != 0) return -1;
+        bc_neighbor_t *slot = neighbor_slot(neighbors, BC_STRIP_SUFFIX(candidate));
+        // Neighbors of metadata barcodes do not count: that would be two edits
+        if (slot->key == 0 || !neighbor_is_exact(slot)) continue;
+        if (found) return -1;
+        found = slot->parent;
+    }
+    if (!found) return -1;
+    *key = found->cb;
+    return 0;
+}
+
+// Append a label id to a barcode's label list
+static int append_label(cb2fp *entry, uint32_t label_id) {
+    uint32_t *label_ids = realloc(entry->label_ids, (entry->n_labels + 1) * sizeof(uint32_t));
+    if (!label_ids) {
+        log_msg("Failed to allocate memory for barcode labels", ERROR);
+        return -1;
+    }
+    label_ids[entry->n_labels++] = label_id;
+    entry->label_ids = label_ids;
+    return 0;
+}
+
+void destroy_barcode_map(cb2fp *direct_map) {
+    cb2fp *entry, *tmp;
+    HASH_ITER(hh, direct_map, entry, tmp) {
+        HASH_DEL(direct_map, entry);
+        free(entry->label_ids);
+        free(entry);
+    }
+}
+
+// Load one metadata file into direct_map, creating one output file per
+// label under prefix (or none if prefix is NULL, for tag mode, or header is
+// NULL, for outputs other than BAM). A barcode listed under several labels (here or in an
+// earlier metadata file) keeps all of them, so a single lookup routes a read
+// to every output. On error the entries added so far stay in direct_map for
+// the caller to free.
+int hash_readtag_direct(const char *path, const char *prefix, sam_hdr_t *header,
+                        label_registry_t *registry, cb2fp **direct_map) {
     // Initialize all resources to NULL for cleanup
     FILE* meta_fp = NULL;
-    cb2fp *direct_map = NULL;
     cb2fp *direct_entry = NULL;
     int ret = 0;  // 0 for success, -1 for error
     
-    // Temporary hash table to track unique labels and their file pointers
+    
+    // Temporary hash table to track unique labels and their registry ids
     typedef struct {
         char label[64];                   /* consistent with cb2fp label size */
-        samFile* fp;
+        uint32_t label_id;
         UT_hash_handle hh;
     } label_to_fp_t;
     label_to_fp_t *label_fps = NULL;
@@ -91,7 +493,7 @@ cb2fp* hash_readtag_direct(char *path, const char *prefix, sam_hdr_t *header) {
     if (meta_fp == NULL) {
         // Exit and print error message if the file does not exist
         log_msg("Cannot open file (%s)", ERROR, path);
-        return NULL;
+        return -1;
     }
     
     // Pre-count unique labels for better memory allocation
@@ -105,6 +507,7 @@ cb2fp* hash_readtag_direct(char *path, const char *prefix, sam_hdr_t *header) {
     uint32_t field_num = 0; // Counting numbers to examine if expected field numbers are present
     char trt[MAX_LINE_LENGTH]; // Temporary variable for read tag content
     char tlabel[MAX_LINE_LENGTH]; // Temporary variable for corresponding label content
+    uint64_t unpackable = 0; // Rows skipped for barcodes bc_pack rejects
 
     while (fgets(meta_line, MAX_LINE_LENGTH, meta_fp) != NULL) {
         // Assuming header and skip it
@@ -152,37 +555,23 @@ cb2fp* hash_readtag_direct(char *path, const char *prefix, sam_hdr_t *header) {
             goto cleanup;
         }
 
+        // Other cell ids (read groups, well names) are interned; ids that
+        // cannot be keyed either can never match a read: skip the row
+        bc_key_t cb;
+        if (bc_pack_id(trt, strlen(trt), &cb) != 0 && bc_intern(trt, strlen(trt), &cb) != 0) {
+            if (unpackable++ == 0) {
+                log_msg("Skipping metadata barcode %s: cell ids must be A/C/G/T (max %d bases, "
+                        "optional -1 to -7 suffix) or at most %d characters", WARNING, trt,
+                        BC_MAX_BASES, BC_INTERNED_MAX_LEN);
+            }
+            continue;
+        }
+
         // Sanitize label by replacing invalid characters with underscores
         char original_label[MAX_LINE_LENGTH];
         strncpy(original_label, tlabel, MAX_LINE_LENGTH - 1);
         original_label[MAX_LINE_LENGTH - 1] = '\0';
-        int label_modified = 0;
-        
-        // Replace path traversal sequences and invalid characters
-        for (char *p = tlabel; *p; p++) {
-            if (*p == '/' || *p == '\\' || *p == '~') {
-                *p = '_';
-                label_modified = 1;
-            } else if (!isalnum(*p) && *p != '_' && *p != '-' && *p != ' ' && *p != '.') {
-                *p = '_';
-                label_modified = 1;
-            }
-        }
-        
-        // Handle leading dots (hidden files)
-        if (tlabel[0] == '.') {
-            tlabel[0] = '_';
-            label_modified = 1;
-        }
-        
-        // Handle ".." sequences
-        char *dot_dot = strstr(tlabel, "..");
-        while (dot_dot) {
-            dot_dot[0] = '_';
-            dot_dot[1] = '_';
-            label_modified = 1;
-            dot_dot = strstr(dot_dot + 2, "..");
-        }
+        bool label_modified = sanitize_label(tlabel);
         
         // Log if label was sanitized (only once per unique original label)
         if (label_modified) {
@@ -207,93 +596,101 @@ cb2fp* hash_readtag_direct(char *path, const char *prefix, sam_hdr_t *header) {
         label_to_fp_t *existing_label;
         HASH_FIND_STR(label_fps, tlabel, existing_label);
         
-        samFile* output_fp = NULL;
+        uint32_t label_id = 0;
         
-        if (existing_label == NULL) {
-            // Create new output file for this label
-            char output_path[512];
-            size_t prefix_len = strlen(prefix);
-            size_t label_len = strlen(tlabel);
-            
-            // Check if the combined path would exceed buffer size
-            if (prefix_len + label_len + 5 >= sizeof(output_path)) {  // 5 = ".bam" + null terminator
-                log_msg("Output path too long for label: %s", ERROR, tlabel);
+        if (strlen(tlabel) >= sizeof(registry->entries[0].label)) {
+            log_msg("Label too long (max %zu chars): %s", ERROR,
+                    sizeof(registry->entries[0].label) - 1, tlabel);
+            ret = -1;
+            goto cleanup;
+        }
+        
+        if (existing_label == NULL && (prefix == NULL || header == NULL)) {
+            // Tag mode: the label only needs an id, reads go to one output.
+            // Fragment mode keeps the prefix for its own per-label files.
+            int32_t new_id = add_label(registry, tlabel, header ? NULL : prefix, NULL);
+            if (new_id < 0) {
                 ret = -1;
                 goto cleanup;
             }
+            label_id = (uint32_t) new_id;
             
-            snprintf(output_path, sizeof(output_path), "%s%s.bam", prefix, tlabel);
-            
-            output_fp = sam_open(output_path, "wb");
-            if (!output_fp) {
-                log_msg("Failed to create output file: %s", ERROR, output_path);
+            label_to_fp_t *new_label = calloc(1, sizeof(label_to_fp_t));
+            if (!new_label) {
+                log_msg("Failed to allocate memory for label tracking", ERROR);
                 ret = -1;
                 goto cleanup;
             }
-            
-            // Write header to the new file
-            if (sam_hdr_write(output_fp, header) < 0) {
-                log_msg("Failed to write header to: %s", ERROR, output_path);
-                sam_close(output_fp);
+            strncpy(new_label->label, tlabel, sizeof(new_label->label) - 1);
+            new_label->label[sizeof(new_label->label) - 1] = '\0';
+            new_label->label_id = label_id;
+            HASH_ADD_STR(label_fps, label, new_label);
+        } else if (existing_label == NULL) {
+            // Create new output file for this label
+            int32_t new_id = open_label_output(registry, tlabel, prefix, header);
+            if (new_id < 0) {
                 ret = -1;
                 goto cleanup;
             }
+            label_id = (uint32_t) new_id;
             
             // Add to label tracking hash table
             label_to_fp_t *new_label = calloc(1, sizeof(label_to_fp_t));
             if (!new_label) {
                 log_msg("Failed to allocate memory for label tracking", ERROR);
-                sam_close(output_fp);
                 ret = -1;
                 goto cleanup;
             }
             
             strncpy(new_label->label, tlabel, sizeof(new_label->label) - 1);
             new_label->label[sizeof(new_label->label) - 1] = '\0';
-            new_label->fp = output_fp;
+            new_label->label_id = label_id;
             HASH_ADD_STR(label_fps, label, new_label);
-            
-            log_msg("Created output file: %s", INFO, output_path);
         } else {
-            // Use existing file pointer
-            output_fp = existing_label->fp;
+            // Use existing label
+            label_id = existing_label->label_id;
         }
 
-        // Create direct mapping entry: cell_barcode -> file_pointer
+        unsigned hashv = (unsigned) bc_hash(cb);
+
+        // Barcode already listed (overlapping groupings): add the label to it
+        cb2fp *existing_entry = find_barcode_hashed(*direct_map, cb, hashv);
+        if (existing_entry) {
+            bool listed = false;
+            for (uint32_t i = 0; i < existing_entry->n_labels; i++) {
+                listed = listed || existing_entry->label_ids[i] == label_id;
+            }
+            if (!listed && append_label(existing_entry, label_id) != 0) {
+                ret = -1;
+                goto cleanup;
+            }
+            continue;
+        }
+
+        // Create direct mapping entry: cell_barcode -> label ids
         direct_entry = calloc(1, sizeof(cb2fp));
         if (!direct_entry) {
             log_msg("Failed to allocate memory for direct mapping entry", ERROR);
             ret = -1;
             goto cleanup;
         }
-
-        // Assign the cell barcode, label, and file pointer with bounds checking
-        if (strlen(trt) >= sizeof(direct_entry->cb)) {
-            log_msg("Cell barcode too long (max %zu chars): %s", ERROR, sizeof(direct_entry->cb) - 1, trt);
-            free(direct_entry);
-            direct_entry = NULL;
+        direct_entry->cb = cb;
+        direct_entry->id = HASH_COUNT(*direct_map);
+        if (append_label(direct_entry, label_id) != 0) {
             ret = -1;
             goto cleanup;
         }
-        if (strlen(tlabel) >= sizeof(direct_entry->label)) {
-            log_msg("Label too long (max %zu chars): %s", ERROR, sizeof(direct_entry->label) - 1, tlabel);
-            free(direct_entry);
-            direct_entry = NULL;
-            ret = -1;
-            goto cleanup;
-        }
-        
-        strncpy(direct_entry->cb, trt, sizeof(direct_entry->cb) - 1);
-        direct_entry->cb[sizeof(direct_entry->cb) - 1] = '\0';
-        strncpy(direct_entry->label, tlabel, sizeof(direct_entry->label) - 1);
-        direct_entry->label[sizeof(direct_entry->label) - 1] = '\0';
-        direct_entry->fp = output_fp;
 
-        HASH_ADD_STR(direct_map, cb, direct_entry);
+        HASH_ADD_BYHASHVALUE(hh, *direct_map, cb, sizeof(bc_key_t), hashv, direct_entry);
         direct_entry = NULL;  // Successfully added, don't free in cleanup
     }
     
 cleanup:
+    if (unpackable > 0) {
+        log_msg("Skipped %llu metadata rows with barcodes that cannot be packed in %s", WARNING,
+                (unsigned long long) unpackable, path);
+    }
+
     // Always close metadata file
     if (meta_fp) {
         fclose(meta_fp);
@@ -301,18 +698,15 @@ cleanup:
     
     // Free any unadded direct_entry
     if (direct_entry) {
+        free(direct_entry->label_ids);
         free(direct_entry);
     }
     
-    // Clean up label_fps hash table
+    // Clean up label_fps hash table (file handles are owned by the registry)
     if (label_fps) {
         label_to_fp_t *current_label, *tmp_label;
         HASH_ITER(hh, label_fps, current_label, tmp_label) {
             HASH_DEL(label_fps, current_label);
-            if (ret != 0 && current_label->fp) {
-                // On error, close all file handles
-                sam_close(current_label->fp);
-            }
             free(current_label);
         }
     }
@@ -326,17 +720,5 @@ cleanup:
         }
     }
     
-    // On error, clean up partial direct_map
-    if (ret != 0 && direct_map) {
-        cb2fp *entry, *tmp;
-        HASH_ITER(hh, direct_map, entry, tmp) {
-            HASH_DEL(direct_map, entry);
-            // Note: Don't close file pointers here as they're shared with label_fps
-            // and already closed above
-            free(entry);
-        }
-        direct_map = NULL;
-    }
-    
-    return direct_map;
+    return ret;
 }
@@ -7,22 +7,121 @@
 #ifndef SCBAMSPLIT_HASH_H
 #define SCBAMSPLIT_HASH_H
 
+// Standard library includes
+#include <stdbool.h>
+
 // External library includes
 #include "htslib/sam.h"
+#include "htslib/kstring.h"
 #include "uthash.h"
 
 // Project includes
 #include "shared_const.h"
+#include "barcode.h"
+#include "coverage.h"
 
-// Direct mapping: cell_barcode -> file_pointer
+// Direct mapping: cell_barcode -> label ids (every label the barcode is assigned to)
 typedef struct {
-    char cb[32];                          /* key: cell barcode (sufficient for all platforms) */
-    char label[64];                       /* cluster label (reasonable for most labels) */
-    samFile* fp;                          /* direct file pointer */
+    bc_key_t cb;                          /* key: 2-bit packed cell barcode */
+    uint32_t *label_ids;                  /* indices into the label registry */
+    uint32_t n_labels;                    /* number of labels this barcode routes to */
+    uint32_t id;                          /* dense barcode index, in metadata order */
     UT_hash_handle hh;                    /* makes this structure hashable */
 } cb2fp;
 
-cb2fp* hash_readtag_direct(char *path, const char *prefix, sam_hdr_t *header);
+// Label registry: dense label id -> output file pointer
+typedef struct {
+    char label[64];                       /* sanitized cluster label */
+    char *prefix;                         /* output path prefix; NULL in tag mode */
+    samFile* fp;                          /* output file owned by the registry */
+    coverage_track_t *coverage;           /* optional bedGraph of what fp receives */
+} label_entry_t;
+
+typedef struct {
+    label_entry_t *entries;               /* indexed by label id */
+    uint32_t count;                       /* number of registered labels */
+    uint32_t capacity;                    /* allocated entries */
+    samFile *tagged;                      /* tag mode: single output, labels in an aux tag */
+    char label_tag[3];                    /* tag mode: aux tag holding the label(s) */
+    char dedup_tag[3];                    /* tag mode: aux tag flagging duplicates */
+    bool keep_unassigned;                 /* tag mode: also write reads with no label */
+    bool coverage;                        /* labels have coverage tracks */
+    struct downsampler *sampler;          /* optional per-label downsampling, not owned */
+    struct cb_sorter *sorter;             /* optional CB-sorted outputs, not owned */
+    kstring_t scratch;                    /* serialized read (split) or joined labels (tag) */
+} label_registry_t;
+
+label_registry_t *create_label_registry(uint32_t initial_capacity);
+int32_t add_label(label_registry_t *registry, const char *label, const char *prefix,
+                  samFile *fp);
+int32_t open_label_output(label_registry_t *registry, const char *label, const char *prefix,
+                          sam_hdr_t *header);
+bool sanitize_label(char *label);
+void destroy_label_registry(label_registry_t *registry);
+int open_coverage_tracks(label_registry_t *registry, const sam_hdr_t *header);
+int close_coverage_tracks(label_registry_t *registry);
+
+// Hamming-1 neighbor index for barcode correction: every metadata barcode
+// and each of its single-substitution variants, keyed without the "-N"
+// suffix so raw barcodes (e.g. CR) match corrected metadata barcodes
+typedef struct {
+    bc_key_t key;                         /* suffix-stripped packed barcode, 0 = empty slot */
+    cb2fp *parent;                        /* metadata entry; NULL if ambiguous */
+} bc_neighbor_t;
+
+typedef struct {
+    bc_neighbor_t *slots;                 /* open addressing, linear probing */
+    uint64_t mask;                        /* number of slots - 1 */
+} neighbor_index_t;
+
+neighbor_index_t *build_neighbor_index(cb2fp *direct_map);
+void destroy_neighbor_index(neighbor_index_t *neighbors);
+cb2fp *correct_barcode(neighbor_index_t *neighbors, bc_key_t key, const bam1_t *read);
+int8_t resolve_n_barcode(neighbor_index_t *neighbors, const char *cb, bc_key_t *key);
+
+// Everything needed to route a read by its cell barcode
+typedef struct {
+    cb2fp *direct_map;                    /* packed barcode -> label */
+    bc_bloom_t *prefilter;                /* membership prefilter over direct_map keys */
+    neighbor_index_t *neighbors;          /* optional barcode correction index */
+    label_registry_t *registry;           /* label id -> output file */
+    struct qc_stats *qc;                  /* optional per-barcode QC counters */
+} barcode_index_t;
+
+bc_bloom_t *build_barcode_prefilter(cb2fp *direct_map);
+
+// Look up a packed barcode whose hash has already been computed
+static inline cb2fp *find_barcode_hashed(cb2fp *direct_map, bc_key_t key, unsigned hashv) {
+    cb2fp *entry;
+    HASH_FIND_BYHASHVALUE(hh, direct_map, &key, sizeof(bc_key_t), hashv, entry);
+    return entry;
+}
+
+// Look up a packed barcode, hashing the key as an integer
+static inline cb2fp *find_barcode(cb2fp *direct_map, bc_key_t key) {
+    return find_barcode_hashed(direct_map, key, (unsigned) bc_hash(key));
+}
+
+// Batched lookups hide memory latency in two prefetch stages: first the
+// bucket slot, then (once that has arrived) the first entry in its chain
+static inline void prefetch_barcode_bucket(cb2fp *direct_map, unsigned hashv) {
+    if (!direct_map) return;
+    unsigned bkt;
+    HASH_TO_BKT(hashv, direct_map->hh.tbl->num_buckets, bkt);
+    __builtin_prefetch(&direct_map->hh.tbl->buckets[bkt]);
+}
+
+static inline void prefetch_barcode_entry(cb2fp *direct_map, unsigned hashv) {
+    if (!direct_map) return;
+    unsigned bkt;
+    HASH_TO_BKT(hashv, direct_map->hh.tbl->num_buckets, bkt);
+    UT_hash_handle *head = direct_map->hh.tbl->buckets[bkt].hh_head;
+    if (head) __builtin_prefetch(head->key);
+}
+
+int hash_readtag_direct(const char *path, const char *prefix, sam_hdr_t *header,
+                        label_registry_t *registry, cb2fp **direct_map);
+void destroy_barcode_map(cb2fp *direct_map);
 
 
 #endif //SCBAMSPLIT_HASH_H
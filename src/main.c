@@ -12,11 +12,18 @@
 #define PATH_MAX 4096
 #endif
 #include <htslib/sam.h>
+#include <htslib/bgzf.h>
 #include "uthash.h"
 #include "hash.h"
 #include "utils.h"
 #include "sort.h"
 #include "dedup_3pass.h"
+#include "qc.h"
+#include "downsample.h"
+#include "cb_sort.h"
+#include "fragments.h"
+#include "tag_split.h"
+#include "spatial.h"
 
 // Global variables
 char *OUT_PATH = "";
@@ -25,15 +32,339 @@ log_level_t OUT_LEVEL = WARNING;
 int64_t CB_LENGTH = 21;
 int64_t UB_LENGTH = 21;
 
+// Long-only options
+enum {
+    OPT_DOWNSAMPLE_READS = 256,
+    OPT_DOWNSAMPLE_UMIS,
+    OPT_DOWNSAMPLE_SEED,
+    OPT_SORT_MEMORY,
+    OPT_UNANNOTATED,
+    OPT_BY_TAG,
+    OPT_MAX_LABELS,
+    OPT_SPATIAL,
+    OPT_BIN_SIZE,
+    OPT_CALL_CELLS,
+    OPT_PER_CELL
+};
 
-// Command function for split subcommand
-int cmd_split(int argc, char *argv[]) {
+// Split loop body. Each variant below passes constant barcode locations and
+// MAPQ filtering so the compiler drops the untaken branches and inlines the
+// matching fetcher into the loop.
+//
+// Reads are processed READ_BATCH_SIZE at a time: all barcodes in a batch
+// are extracted and hashed first, their buckets prefetched, and only then
+// resolved and written (in input order), so table misses overlap. Barcodes
+// rejected by the prefilter never reach the UMI or the table.
+static inline __attribute__((always_inline))
+int split_reads_impl(samFile *fp, sam_hdr_t *header, barcode_index_t *index,
+                     tag_reader_t *reader, int64_t mapq_thres,
+                     const enum location cb_loc, const enum location ub_loc,
+                     const bool filter_mapq) {
+    read_batch_t *batch = create_read_batch();
+    if (!batch) return -1;
+
+    char this_CB[CB_LENGTH];
+    char this_UB[UB_LENGTH];
+    bc_key_t cb_keys[READ_BATCH_SIZE];
+    unsigned hashes[READ_BATCH_SIZE];
+    int pending[READ_BATCH_SIZE];
+    bool low_mapq[READ_BATCH_SIZE];
+    bool count_only[READ_BATCH_SIZE];
+    qc_stats_t *qc = index->qc;
+    bool keep_unassigned = index->registry->keep_unassigned;
+    uint64_t barcodes_checked = 0;
+    uint64_t barcodes_rejected = 0;
+    uint64_t barcodes_corrected = 0;
+    int read_stat = -1;
+    int ret = 0;
+
+    while (ret == 0 && fill_read_batch(fp, header, batch, &read_stat) > 0) {
+        // Stage 1: filter, extract and hash barcodes; prefetch their buckets
+        int n_pending = 0;
+        for (int i = 0; i < batch->count; i++) {
+            bam1_t *read = batch->reads[i];
+            // QC still counts low-MAPQ reads per barcode, so they go on to the lookup
+            low_mapq[i] = filter_mapq && read->core.qual < mapq_thres;
+            if (low_mapq[i] && !qc) {
+                continue;
+            }
+
+            // Missing barcodes and invalid bases cannot match any metadata barcode
+            int8_t ub_stat = 0;
+            if (UMI_WITH_CB(cb_loc, ub_loc)) {
+                ub_stat = extract_CB_key_UB(read, reader, this_CB, this_UB, cb_loc, ub_loc,
+                                            &cb_keys[i]);
+                if (ub_stat < 0) continue;
+            } else if (extract_CB_key(read, reader, this_CB, cb_loc, &cb_keys[i]) != 0) {
+                continue;
+            }
+
+            uint64_t hash = bc_hash(cb_keys[i]);
+            barcodes_checked++;
+            if (index->prefilter && !bc_bloom_test(index->prefilter, hash)) {
+                barcodes_rejected++;
+                continue;
+            }
+
+            count_only[i] = low_mapq[i];
+            if (!low_mapq[i] && (ub_stat != 0 || (!UMI_WITH_CB(cb_loc, ub_loc) &&
+                                  extract_UB(read, reader, this_UB, ub_loc) != 0))) {
+                // Still looked up: QC counts it, and a labelled read is not unassigned
+                if (!qc && !keep_unassigned) continue;
+                count_only[i] = true;
+            }
+
+            hashes[i] = (unsigned) hash;
+            prefetch_barcode_bucket(index->direct_map, hashes[i]);
+            pending[n_pending++] = i;
+        }
+
+        // Stage 2: buckets are in cache now; prefetch the entries they point to
+        for (int j = 0; j < n_pending; j++) {
+            prefetch_barcode_entry(index->direct_map, hashes[pending[j]]);
+        }
+
+        // Stage 3: resolve and write. Tag mode may keep unassigned reads, so
+        // then every read passing the MAPQ filter is visited in input order.
+        int n_visit = keep_unassigned ? batch->count : n_pending;
+        for (int j = 0, next = 0; j < n_visit; j++) {
+            int i = keep_unassigned ? j : pending[j];
+            cb2fp *entry = NULL;
+            if (next < n_pending && pending[next] == i) {
+                next++;
+                entry = find_barcode_hashed(index->direct_map, cb_keys[i], hashes[i]);
+                if (!entry && index->neighbors) {
+                    // One extra lookup recovers barcodes with a single mismatch
+                    entry = correct_barcode(index->neighbors, cb_keys[i], batch->reads[i]);
+                    if (entry) barcodes_corrected++;
+                }
+            }
+            if (!entry) {
+                // Cell barcode not found in metadata: skip unless it is kept untagged
+                if (keep_unassigned && !(filter_mapq && batch->reads[i]->core.qual < mapq_thres) &&
+                    unassigned_dump(index->registry, header, batch->reads[i]) != 0) {
+                    ret = -1;
+                    break;
+                }
+                continue;
+            }
+            if (qc) {
+                qc_count_read(qc, entry, low_mapq[i], false);
+            }
+            // Low-MAPQ and UMI-less reads of a labelled barcode are not written
+            if (count_only[i]) continue;
+            if (barcode_dump(index->registry, entry, header, batch->reads[i]) != 0) {
+                log_msg("Failed to write read", ERROR);
+                ret = -1;
+                break;
+            }
+        }
+    }
+
+    if (ret == 0 && read_stat < -1) {
+        log_msg("Failed to read input BAM", ERROR);
+        ret = -1;
+    }
+
+    log_prefilter_stats(barcodes_checked, barcodes_rejected);
+    if (index->neighbors) {
+        log_msg("Corrected %llu reads with one barcode mismatch, %llu with one N", INFO,
+                (unsigned long long) barcodes_corrected, (unsigned long long) reader->n_resolved);
+    }
+
+    destroy_read_batch(batch);
+    return ret;
+}
+
+typedef int (*split_loop_t)(samFile *fp, sam_hdr_t *header, barcode_index_t *index,
+                            tag_reader_t *reader, int64_t mapq_thres);
+
+#define DEFINE_SPLIT_LOOP(name, CB_LOC, UB_LOC, FILTER_MAPQ)                      \
+    static int name(samFile *fp, sam_hdr_t *header, barcode_index_t *index,     \
+                    tag_reader_t *reader, int64_t mapq_thres) {                 \
+        return split_reads_impl(fp, header, index, reader, mapq_thres,          \
+                                CB_LOC, UB_LOC, FILTER_MAPQ);                   \
+    }
+
+DEFINE_SPLIT_LOOP(split_tag_tag, READ_TAG, READ_TAG, false)
+DEFINE_SPLIT_LOOP(split_tag_tag_mapq, READ_TAG, READ_TAG, true)
+DEFINE_SPLIT_LOOP(split_tag_name, READ_TAG, READ_NAME, false)
+DEFINE_SPLIT_LOOP(split_tag_name_mapq, READ_TAG, READ_NAME, true)
+DEFINE_SPLIT_LOOP(split_name_tag, READ_NAME, READ_TAG, false)
+DEFINE_SPLIT_LOOP(split_name_tag_mapq, READ_NAME, READ_TAG, true)
+DEFINE_SPLIT_LOOP(split_name_name, READ_NAME, READ_NAME, false)
+DEFINE_SPLIT_LOOP(split_name_name_mapq, READ_NAME, READ_NAME, true)
+
+// Indexed by READ_LOOP_VARIANT()
+static const split_loop_t split_loops[N_READ_LOOP_VARIANTS] = {
+    split_tag_tag, split_tag_tag_mapq, split_tag_name, split_tag_name_mapq,
+    split_name_tag, split_name_tag_mapq, split_name_name, split_name_name_mapq
+};
+
+// Without deduplication nothing tells how many reads each label will get,
+// so downsampling reads the input twice: this first pass only offers every
+// read to its labels' reservoirs, then rewinds for the pass that writes
+static int sample_split_reads(samFile *fp, sam_hdr_t *header, barcode_index_t *index,
+                              tag_reader_t *reader, int64_t mapq_thres,
+                              split_loop_t split_loop) {
+    BGZF *bgzf = hts_get_bgzfp(fp);
+    int64_t data_start = bgzf ? bgzf_tell(bgzf) : -1;
+    // Seeking to where we are fails up front on a pipe rather than after a full pass
+    if (data_start < 0 || bgzf_seek(bgzf, data_start, SEEK_SET) < 0) {
+        log_msg("--downsample-reads reads the input twice and needs a BGZF-compressed BAM file, "
+                "not stdin or a pipe", ERROR);
+        return -1;
+    }
+
+    // QC counts the writing pass only
+    qc_stats_t *qc = index->qc;
+    index->qc = NULL;
+    log_msg("Downsampling: counting reads per label", INFO);
+    int ret = split_loop(fp, header, index, reader, mapq_thres);
+    index->qc = qc;
+    if (ret != 0) return -1;
+
+    finish_sampling(index->registry->sampler, index->registry);
+    if (bgzf_seek(bgzf, data_start, SEEK_SET) < 0) {
+        log_msg("Failed to rewind input for writing", ERROR);
+        return -1;
+    }
+    return 0;
+}
+
+// Output directory name for a metadata file: its file name without extension
+static void metadata_stem(const char *path, char *stem, size_t size) {
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    snprintf(stem, size, "%s", name);
+    char *ext = strrchr(stem, '.');
+    if (ext && ext != stem) *ext = '\0';
+}
+
+// Options taking part in the compatibility rules below, one bit each
+enum {
+    GIVEN_METADATA = 1 << 0,              /* -m */
+    GIVEN_DEDUP = 1 << 1,
+    GIVEN_CORRECT = 1 << 2,
+    GIVEN_QC = 1 << 3,
+    GIVEN_COUNT_MATRIX = 1 << 4,
+    GIVEN_COVERAGE = 1 << 5,
+    GIVEN_SORT_CB = 1 << 6,
+    GIVEN_FRAGMENTS = 1 << 7,
+    GIVEN_DOWNSAMPLE_READS = 1 << 8,
+    GIVEN_DOWNSAMPLE_UMIS = 1 << 9,
+    GIVEN_MARK_DUPLICATES = 1 << 10,
+    GIVEN_DEDUP_KEY = 1 << 11,            /* any key but position */
+    GIVEN_KEY_ENDS = 1 << 12,
+    GIVEN_DIRECTIONAL = 1 << 13,
+    GIVEN_BY_TAG = 1 << 14,
+    GIVEN_SPATIAL = 1 << 15,
+    GIVEN_BIN_SIZE = 1 << 16,
+    GIVEN_CALL_CELLS = 1 << 17,
+    GIVEN_PER_CELL = 1 << 18
+};
+#define GIVEN_DOWNSAMPLE (GIVEN_DOWNSAMPLE_READS | GIVEN_DOWNSAMPLE_UMIS)
+
+// When any of the option bits is given, every required bit must be too and
+// no excluded bit may be
+typedef struct {
+    uint32_t option;
+    uint32_t requires;
+    uint32_t excludes;
+    const char *message;
+} option_rule_t;
+
+static const option_rule_t option_rules[] = {
+    {GIVEN_MARK_DUPLICATES | GIVEN_COUNT_MATRIX | GIVEN_DEDUP_KEY, GIVEN_DEDUP, 0,
+     "--mark-duplicates, --count-matrix and --dedup-key require --dedup"},
+    // Without UMIs there is nothing for directional clustering to merge
+    {GIVEN_KEY_ENDS, 0, GIVEN_DIRECTIONAL,
+     "--umi-method directional needs UMIs, so cannot be used with --dedup-key ends"},
+    // Without -d every written read counts; with -d each written read is one molecule
+    {GIVEN_DOWNSAMPLE_READS, 0, GIVEN_DEDUP,
+     "--downsample-reads applies without --dedup, --downsample-umis with --dedup "
+     "(and not --mark-duplicates)"},
+    {GIVEN_DOWNSAMPLE_UMIS, GIVEN_DEDUP, GIVEN_MARK_DUPLICATES,
+     "--downsample-reads applies without --dedup, --downsample-umis with --dedup "
+     "(and not --mark-duplicates)"},
+    // QC tables and count matrices are tallied before reads are selected, so
+    // they would describe the full input rather than the written sample
+    {GIVEN_DOWNSAMPLE, 0, GIVEN_QC | GIVEN_COUNT_MATRIX,
+     "--qc and --count-matrix cannot be combined with downsampling"},
+    // Splitting by tag value needs no barcodes, so nothing keyed on them applies
+    {GIVEN_BY_TAG, 0,
+     GIVEN_METADATA | GIVEN_DEDUP | GIVEN_CORRECT | GIVEN_QC | GIVEN_COVERAGE | GIVEN_SORT_CB |
+     GIVEN_FRAGMENTS | GIVEN_DOWNSAMPLE,
+     "--by-tag replaces -m and cannot be combined with --dedup, --correct, --qc, "
+     "--coverage, --sort-cb, --fragments or downsampling"},
+    // Spatial tiles replace metadata labels in the same way
+    {GIVEN_SPATIAL, 0,
+     GIVEN_BY_TAG | GIVEN_METADATA | GIVEN_DEDUP | GIVEN_CORRECT | GIVEN_QC | GIVEN_COVERAGE |
+     GIVEN_SORT_CB | GIVEN_FRAGMENTS | GIVEN_DOWNSAMPLE,
+     "--spatial replaces -m and cannot be combined with --by-tag, --dedup, --correct, "
+     "--qc, --coverage, --sort-cb, --fragments or downsampling"},
+    {GIVEN_SPATIAL, GIVEN_BIN_SIZE, 0, "--spatial and --bin-size go together"},
+    {GIVEN_BIN_SIZE, GIVEN_SPATIAL, 0, "--spatial and --bin-size go together"},
+    // Called cells replace metadata labels; pass 2 counts their UMIs
+    {GIVEN_CALL_CELLS, GIVEN_DEDUP,
+     GIVEN_METADATA | GIVEN_BY_TAG | GIVEN_SPATIAL | GIVEN_CORRECT | GIVEN_QC |
+     GIVEN_COUNT_MATRIX | GIVEN_COVERAGE | GIVEN_SORT_CB | GIVEN_FRAGMENTS | GIVEN_DOWNSAMPLE |
+     GIVEN_KEY_ENDS,
+     "--call-cells replaces -m, requires --dedup with UMIs and cannot be combined "
+     "with --by-tag, --spatial, --correct, --qc, --count-matrix, --coverage, "
+     "--sort-cb, --fragments or downsampling"},
+    {GIVEN_PER_CELL, GIVEN_CALL_CELLS, 0, "--per-cell requires --call-cells"},
+    // Fragment mode writes its own deduplicated, coordinate-sorted text files
+    {GIVEN_FRAGMENTS, 0, GIVEN_DEDUP | GIVEN_COVERAGE | GIVEN_SORT_CB | GIVEN_DOWNSAMPLE,
+     "--fragments cannot be combined with --dedup, --coverage, --sort-cb "
+     "or downsampling"}
+};
+
+// Check the given options against option_rules; 0 if they all hold
+static int validate_options(uint32_t given) {
+    for (size_t i = 0; i < sizeof(option_rules) / sizeof(option_rules[0]); i++) {
+        const option_rule_t *rule = &option_rules[i];
+        if (!(given & rule->option)) continue;
+        if ((given & rule->requires) != rule->requires || (given & rule->excludes)) {
+            log_msg("%s", ERROR, rule->message);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Shared by the split and tag subcommands. Tag mode writes a single output
+// (a file or stdout) with each read's label in an aux tag instead of one
+// file per label.
+static int run_split(int argc, char *argv[], bool tag_mode) {
     int32_t opt;
     int64_t mapq_thres = 0;
     int64_t out_level_raw = 0;
-    bool dedup = false, dryrun = false, verbose = false;
+    bool dedup = false, dryrun = false, verbose = false, correct = false;
+    umi_method_t umi_method = UMI_EXACT;
+    dedup_key_t dedup_key = DEDUP_BY_POSITION;
+    bool unannotated_by_position = false;
+    bool keep_unassigned = false;
+    bool mark_duplicates = false;
+    bool count_matrix = false;
+    bool coverage = false;
+    char *qc_prefix = NULL;
+    bool sort_cb = false;
+    bool fragments = false;
+    char by_tag[3] = "";
+    uint32_t max_labels = BY_TAG_DEFAULT_MAX_LABELS;
+    char *spatial_path = NULL;
+    double bin_size = 0;
+    bool cb_length_set = false;
+    bool call_cells = false;
+    uint32_t min_cell_umis = CELLS_AT_KNEE;
+    bool per_cell = false;
+    uint64_t sort_memory = CB_SORT_DEFAULT_MEMORY;
+    uint64_t downsample_reads = 0, downsample_umis = 0, downsample_seed = 0;
+    char label_tag[3] = "XL";
     char *bampath = NULL;
-    char *metapath = NULL;
+    char *metapaths[MAX_METADATA_FILES];
+    int n_meta = 0;
     char *oprefix = NULL;
     tag_meta_t *cb_meta = initialize_tag_meta();
     tag_meta_t *ub_meta = initialize_tag_meta();
@@ -58,22 +389,52 @@ int cmd_split(int argc, char *argv[]) {
         {"mapq", required_argument, NULL, 'q'},
         {"platform", required_argument, NULL, 'p'},
         {"dedup", no_argument, NULL, 'd'},
+        {"correct", no_argument, NULL, 'c'},
+        {"umi-method", required_argument, NULL, 'U'},
+        {"dedup-key", required_argument, NULL, 'K'},
+        {"unannotated", required_argument, NULL, OPT_UNANNOTATED},
+        {"mark-duplicates", no_argument, NULL, 'M'},
+        {"count-matrix", no_argument, NULL, 'x'},
+        {"coverage", no_argument, NULL, 'C'},
+        {"qc", required_argument, NULL, 'Q'},
         {"cbc-location", required_argument, NULL, 'b'},
         {"cbc-length", required_argument, NULL, 'L'},
         {"umi-location", required_argument, NULL, 'u'},
         {"umi-length", required_argument, NULL, 'l'},
         {"dry-run", no_argument, NULL, 'n'},
         {"verbose", optional_argument, NULL, 'v'},
-        {"help", no_argument, NULL, 'h'}
+        {"label-tag", required_argument, NULL, 't'},
+        {"keep-unassigned", no_argument, NULL, 'k'},
+        {"sort-cb", no_argument, NULL, 'S'},
+        {"fragments", no_argument, NULL, 'F'},
+        {"by-tag", required_argument, NULL, OPT_BY_TAG},
+        {"max-labels", required_argument, NULL, OPT_MAX_LABELS},
+        {"spatial", required_argument, NULL, OPT_SPATIAL},
+        {"bin-size", required_argument, NULL, OPT_BIN_SIZE},
+        {"call-cells", required_argument, NULL, OPT_CALL_CELLS},
+        {"per-cell", no_argument, NULL, OPT_PER_CELL},
+        {"sort-memory", required_argument, NULL, OPT_SORT_MEMORY},
+        {"downsample-reads", required_argument, NULL, OPT_DOWNSAMPLE_READS},
+        {"downsample-umis", required_argument, NULL, OPT_DOWNSAMPLE_UMIS},
+        {"downsample-seed", required_argument, NULL, OPT_DOWNSAMPLE_SEED},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
     };
 
-    while ((opt = getopt_long(argc, argv, ":f:m:o:q:p:db:L:u:l:nv::h", cl_opts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, ":f:m:o:q:p:dcU:K:MxCSFQ:b:L:u:l:t:knv::h", cl_opts, NULL)) != -1) {
         switch (opt) {
             case 'f':
                 bampath = optarg;
                 break;
             case 'm':
-                metapath = optarg;
+                // Several metadata files: repeat -m or separate with commas
+                for (char *path = strtok(optarg, ","); path; path = strtok(NULL, ",")) {
+                    if (n_meta >= MAX_METADATA_FILES) {
+                        log_msg("Too many metadata files (max %d)", ERROR, MAX_METADATA_FILES);
+                        goto error_out_and_free;
+                    }
+                    metapaths[n_meta++] = path;
+                }
                 break;
             case 'o':
                 oprefix = optarg;
@@ -94,15 +455,79 @@ int cmd_split(int argc, char *argv[]) {
                 set_UB(ub_meta, optarg);
                 CB_LENGTH = cb_meta->length;
                 UB_LENGTH = ub_meta->length;
-                if (CB_LENGTH >= 32 || UB_LENGTH >= 32) {
-                    log_msg("Platform barcode/UMI lengths exceed maximum supported size (32)", ERROR);
+                if (CB_LENGTH - 1 > BC_MAX_BASES || UB_LENGTH - 1 > BC_MAX_BASES) {
+                    log_msg("Platform barcode/UMI lengths exceed the packable maximum (%d bases)",
+                            ERROR, BC_MAX_BASES);
                     goto error_out_and_free;
                 }
                 break;
             case 'd':
                 dedup = true;
                 break;
+            case 'c':
+                correct = true;
+                break;
+            case 'U':
+                if (strcmp(optarg, "exact") == 0) {
+                    umi_method = UMI_EXACT;
+                } else if (strcmp(optarg, "directional") == 0) {
+                    umi_method = UMI_DIRECTIONAL;
+                } else {
+                    log_msg("Invalid UMI method (expected exact or directional): %s", ERROR, optarg);
+                    goto error_out_and_free;
+                }
+                break;
+            case 'K':
+                if (strcmp(optarg, "position") == 0) {
+                    dedup_key = DEDUP_BY_POSITION;
+                } else if (strcmp(optarg, "gene") == 0) {
+                    dedup_key = DEDUP_BY_GENE;
+                } else if (strcmp(optarg, "ends") == 0) {
+                    dedup_key = DEDUP_BY_ENDS;
+                } else {
+                    log_msg("Invalid dedup key (expected position, gene or ends): %s", ERROR, optarg);
+                    goto error_out_and_free;
+                }
+                break;
+            case OPT_UNANNOTATED:
+                if (strcmp(optarg, "drop") == 0) {
+                    unannotated_by_position = false;
+                } else if (strcmp(optarg, "position") == 0) {
+                    unannotated_by_position = true;
+                } else {
+                    log_msg("Invalid unannotated read policy (expected drop or position): %s",
+                            ERROR, optarg);
+                    goto error_out_and_free;
+                }
+                break;
+            case 'M':
+                mark_duplicates = true;
+                break;
+            case 'x':
+                if (tag_mode) {
+                    log_msg("--count-matrix is only valid for split", ERROR);
+                    goto error_out_and_free;
+                }
+                count_matrix = true;
+                break;
+            case 'Q':
+                qc_prefix = optarg;
+                break;
+            case 'C':
+                if (tag_mode) {
+                    log_msg("--coverage is only valid for split", ERROR);
+                    goto error_out_and_free;
+                }
+                coverage = true;
+                break;
             case 'b':
+                if (strchr(optarg, '+')) {
+                    // Composite barcode, segments packed in order
+                    if (set_barcode_sources(cb_meta, optarg) != 0) {
+                        goto error_out_and_free;
+                    }
+                    break;
+                }
                 {
                     char *endptr;
                     errno = 0;
@@ -141,11 +566,13 @@ int cmd_split(int argc, char *argv[]) {
                         goto error_out_and_free;
                     }
                     CB_LENGTH = tmp + 1;
+                    cb_length_set = true;
                 }
-                if (CB_LENGTH > 0 && CB_LENGTH < 32) {
+                if (CB_LENGTH > 0 && CB_LENGTH - 1 <= BC_INTERNED_MAX_LEN) {
                     cb_meta->length = CB_LENGTH;
-                } else if (CB_LENGTH >= 32) {
-                    log_msg("Cell barcode length must be less than 32", ERROR);
+                } else if (CB_LENGTH - 1 > BC_INTERNED_MAX_LEN) {
+                    log_msg("Cell barcode length must be at most %d (the longest cell id kept)",
+                            ERROR, BC_INTERNED_MAX_LEN);
                     goto error_out_and_free;
                 } else {
                     log_msg("Cell barcode length must be larger than 0", ERROR);
@@ -192,16 +619,151 @@ int cmd_split(int argc, char *argv[]) {
                     }
                     UB_LENGTH = tmp + 1;
                 }
-                if (UB_LENGTH > 0 && UB_LENGTH < 32) {
+                if (UB_LENGTH > 0 && UB_LENGTH - 1 <= BC_MAX_BASES) {
                     ub_meta->length = UB_LENGTH;
-                } else if (UB_LENGTH >= 32) {
-                    log_msg("UMI length must be less than 32", ERROR);
+                } else if (UB_LENGTH - 1 > BC_MAX_BASES) {
+                    log_msg("UMI length must be at most %d (the packable maximum)", ERROR,
+                            BC_MAX_BASES);
                     goto error_out_and_free;
                 } else {
                     log_msg("UMI length must be larger than 0", ERROR);
                     goto error_out_and_free;
                 }
                 break;
+            case 't':
+                if (!tag_mode || strlen(optarg) != 2) {
+                    log_msg("--label-tag takes a two-character tag and is only valid for tag", ERROR);
+                    goto error_out_and_free;
+                }
+                if (strcmp(optarg, DEDUP_FLAG_TAG) == 0 || strcmp(optarg, MOLECULE_SIZE_TAG) == 0) {
+                    log_msg("--label-tag %s is taken by deduplication", ERROR, optarg);
+                    goto error_out_and_free;
+                }
+                strcpy(label_tag, optarg);
+                break;
+            case 'k':
+                if (!tag_mode) {
+                    log_msg("--keep-unassigned is only valid for tag", ERROR);
+                    goto error_out_and_free;
+                }
+                keep_unassigned = true;
+                break;
+            case 'S':
+                if (tag_mode) {
+                    log_msg("--sort-cb is only valid for split", ERROR);
+                    goto error_out_and_free;
+                }
+                sort_cb = true;
+                break;
+            case 'F':
+                if (tag_mode) {
+                    log_msg("--fragments is only valid for split", ERROR);
+                    goto error_out_and_free;
+                }
+                fragments = true;
+                break;
+            case OPT_BY_TAG:
+                if (tag_mode || strlen(optarg) != 2) {
+                    log_msg("--by-tag takes a two-character tag and is only valid for split", ERROR);
+                    goto error_out_and_free;
+                }
+                strcpy(by_tag, optarg);
+                break;
+            case OPT_MAX_LABELS:
+                {
+                    char *endptr;
+                    errno = 0;
+                    long tmp = strtol(optarg, &endptr, 10);
+                    if (errno == ERANGE || *endptr != '\0' || tmp < 1 || tmp > 65536) {
+                        log_msg("Invalid label cap (1-65536): %s", ERROR, optarg);
+                        goto error_out_and_free;
+                    }
+                    max_labels = (uint32_t) tmp;
+                }
+                break;
+            case OPT_SPATIAL:
+                if (tag_mode) {
+                    log_msg("--spatial is only valid for split", ERROR);
+                    goto error_out_and_free;
+                }
+                spatial_path = optarg;
+                break;
+            case OPT_BIN_SIZE:
+                {
+                    char *endptr;
+                    errno = 0;
+                    bin_size = strtod(optarg, &endptr);
+                    if (errno == ERANGE || *endptr != '\0' || !(bin_size > 0)) {
+                        log_msg("Invalid bin size: %s", ERROR, optarg);
+                        goto error_out_and_free;
+                    }
+                }
+                break;
+            case OPT_CALL_CELLS:
+                if (tag_mode) {
+                    log_msg("--call-cells is only valid for split", ERROR);
+                    goto error_out_and_free;
+                }
+                call_cells = true;
+                if (strcmp(optarg, "knee") != 0) {
+                    char *endptr;
+                    errno = 0;
+                    long tmp = strtol(optarg, &endptr, 10);
+                    if (errno == ERANGE || *endptr != '\0' || tmp < 1 || tmp > UINT32_MAX) {
+                        log_msg("Invalid cell calling threshold (knee or a UMI count): %s",
+                                ERROR, optarg);
+                        goto error_out_and_free;
+                    }
+                    min_cell_umis = (uint32_t) tmp;
+                }
+                break;
+            case OPT_PER_CELL:
+                per_cell = true;
+                break;
+            case OPT_SORT_MEMORY:
+                {
+                    // Bytes, or with a K/M/G suffix
+                    char *endptr;
+                    errno = 0;
+                    unsigned long long tmp = strtoull(optarg, &endptr, 10);
+                    int shift = 0;
+                    if (*endptr == 'K' || *endptr == 'k') shift = 10;
+                    else if (*endptr == 'M' || *endptr == 'm') shift = 20;
+                    else if (*endptr == 'G' || *endptr == 'g') shift = 30;
+                    if (shift) endptr++;
+                    if (errno == ERANGE || *endptr != '\0' || optarg[0] == '-' || tmp == 0 ||
+                        tmp > (UINT64_MAX >> shift)) {
+                        log_msg("Invalid sort memory: %s", ERROR, optarg);
+                        goto error_out_and_free;
+                    }
+                    sort_memory = (uint64_t) tmp << shift;
+                }
+                break;
+            case OPT_DOWNSAMPLE_READS:
+            case OPT_DOWNSAMPLE_UMIS:
+            case OPT_DOWNSAMPLE_SEED:
+                {
+                    char *endptr;
+                    errno = 0;
+                    unsigned long long tmp = strtoull(optarg, &endptr, 10);
+                    if (errno == ERANGE || *endptr != '\0' || optarg[0] == '-' ||
+                        (tmp == 0 && opt != OPT_DOWNSAMPLE_SEED)) {
+                        log_msg("Invalid downsampling value: %s", ERROR, optarg);
+                        goto error_out_and_free;
+                    }
+                    if (opt != OPT_DOWNSAMPLE_SEED && tag_mode) {
+                        log_msg("Downsampling is only valid for split", ERROR);
+                        goto error_out_and_free;
+                    }
+                    if (opt == OPT_DOWNSAMPLE_READS) {
+                        downsample_reads = tmp;
+                    } else if (opt == OPT_DOWNSAMPLE_UMIS) {
+                        downsample_umis = tmp;
+                    } else {
+                        downsample_seed = tmp;
+                    }
+                }
+                break;
             case 'n':
                 dryrun = true;
                 break;
@@ -247,8 +809,12 @@ int cmd_split(int argc, char *argv[]) {
                 }
                 break;
             case 'h':
-                show_split_usage();
-                return 0;
+                if (tag_mode) {
+                    show_tag_usage();
+                } else {
+                    show_split_usage();
+                }
+                goto cleanup;
             case ':':
                 log_msg("Option -%c requires an argument", ERROR, optopt);
                 goto error_out_and_free;
@@ -260,22 +826,51 @@ int cmd_split(int argc, char *argv[]) {
     }
 
     // Check required arguments
-    if (bampath == NULL || metapath == NULL) {
+    if (bampath == NULL || (n_meta == 0 && !by_tag[0] && !spatial_path && !call_cells)) {
         log_msg("Error: Missing required arguments (-f and -m)", ERROR);
-        show_split_usage();
+        if (tag_mode) {
+            show_tag_usage();
+        } else {
+            show_split_usage();
+        }
+        return_val = 1;
+        goto cleanup;
+    }
+
+    uint32_t given = (n_meta > 0 ? GIVEN_METADATA : 0) | (dedup ? GIVEN_DEDUP : 0) |
+                     (correct ? GIVEN_CORRECT : 0) | (qc_prefix ? GIVEN_QC : 0) |
+                     (count_matrix ? GIVEN_COUNT_MATRIX : 0) | (coverage ? GIVEN_COVERAGE : 0) |
+                     (sort_cb ? GIVEN_SORT_CB : 0) | (fragments ? GIVEN_FRAGMENTS : 0) |
+                     (downsample_reads ? GIVEN_DOWNSAMPLE_READS : 0) |
+                     (downsample_umis ? GIVEN_DOWNSAMPLE_UMIS : 0) |
+                     (mark_duplicates ? GIVEN_MARK_DUPLICATES : 0) |
+                     (dedup_key != DEDUP_BY_POSITION ? GIVEN_DEDUP_KEY : 0) |
+                     (dedup_key == DEDUP_BY_ENDS ? GIVEN_KEY_ENDS : 0) |
+                     (umi_method == UMI_DIRECTIONAL ? GIVEN_DIRECTIONAL : 0) |
+                     (by_tag[0] ? GIVEN_BY_TAG : 0) | (spatial_path ? GIVEN_SPATIAL : 0) |
+                     (bin_size > 0 ? GIVEN_BIN_SIZE : 0) | (call_cells ? GIVEN_CALL_CELLS : 0) |
+                     (per_cell ? GIVEN_PER_CELL : 0);
+    if (validate_options(given) != 0) {
         return_val = 1;
         goto cleanup;
     }
+    uint64_t downsample_target = dedup ? downsample_umis : downsample_reads;
+
+    // Visium HD spot ids (s_002um_00123_00456-1) run past the default barcode length
+    if (spatial_path && !cb_length_set) {
+        CB_LENGTH = BC_INTERNED_MAX_LEN + 1;
+        cb_meta->length = (uint8_t) CB_LENGTH;
+    }
 
-    // Set default output prefix
+    // Set default output prefix (tag mode: output file, stdout by default)
     if (oprefix == NULL) {
-        oprefix = "./";
+        oprefix = tag_mode ? "-" : "./";
     }
 
     // Add trailing slash if needed (using stack allocation)
     char oprefix_buffer[PATH_MAX];
     size_t oplen = strlen(oprefix);
-    if (oplen > 0 && oprefix[oplen - 1] != '/') {
+    if (!tag_mode && oplen > 0 && oprefix[oplen - 1] != '/') {
         if (oplen + 2 >= sizeof(oprefix_buffer)) {
             log_msg("Output prefix path too long (max %zu chars)", ERROR, sizeof(oprefix_buffer) - 2);
             goto cleanup;
@@ -288,12 +883,57 @@ int cmd_split(int argc, char *argv[]) {
     if (verbose || dryrun) {
         fprintf(stderr, "- Run configuration:\n");
         fprintf(stderr, "\tInput BAM: %s\n", bampath);
-        fprintf(stderr, "\tMetadata: %s\n", metapath);
+        for (int m = 0; m < n_meta; m++) {
+            fprintf(stderr, "\tMetadata: %s\n", metapaths[m]);
+        }
         fprintf(stderr, "\tMAPQ threshold: %lld\n", (long long)mapq_thres);
-        fprintf(stderr, "\tOutput prefix: %s\n", oprefix);
+        fprintf(stderr, "\t%s: %s\n", tag_mode ? "Output file" : "Output prefix", oprefix);
+        if (tag_mode) {
+            fprintf(stderr, "\tLabel tag: %s\n", label_tag);
+            fprintf(stderr, "\tUnassigned reads: %s\n", keep_unassigned ? "kept" : "dropped");
+        }
         print_tag_meta(cb_meta, "Cell barcode");
         print_tag_meta(ub_meta, "UMI");
-        fprintf(stderr, "\tDeduplication: %s\n\n", dedup ? "enabled" : "disabled");
+        fprintf(stderr, "\tBarcode kernel: %s\n", bc_kernel_name());
+        fprintf(stderr, "\tBarcode correction: %s\n", correct ? "enabled" : "disabled");
+        fprintf(stderr, "\tDeduplication: %s\n", !dedup ? "disabled" :
+                mark_duplicates ? "mark duplicates" : "remove duplicates");
+        if (dedup) {
+            fprintf(stderr, "\tMolecule key: %s\n", dedup_key == DEDUP_BY_GENE
+                    ? (unannotated_by_position ? "CB, UMI, gene (unannotated reads by position)"
+                                               : "CB, UMI, gene (unannotated reads dropped)")
+                    : dedup_key == DEDUP_BY_ENDS
+                    ? "CB, unclipped 5' end, strand, mate end (no UMI)"
+                    : "CB, UMI, position, strand");
+        }
+        fprintf(stderr, "\tCount matrix: %s\n", count_matrix ? "enabled" : "disabled");
+        fprintf(stderr, "\tCoverage tracks: %s\n", coverage ? "enabled" : "disabled");
+        fprintf(stderr, "\tQC output: %s\n", qc_prefix ? qc_prefix : "disabled");
+        fprintf(stderr, "\tOutput order: %s\n", sort_cb ? "cell barcode, then coordinate" : "input");
+        fprintf(stderr, "\tOutput format: %s\n", fragments ? "fragments (tabix-indexed)" : "BAM");
+        if (call_cells) {
+            if (min_cell_umis == CELLS_AT_KNEE) {
+                fprintf(stderr, "\tCell calling: knee of the UMI rank curve");
+            } else {
+                fprintf(stderr, "\tCell calling: %u or more UMIs", min_cell_umis);
+            }
+            fprintf(stderr, ", %s\n", per_cell ? "one output per cell" : "one output for all cells");
+        }
+        if (spatial_path) {
+            fprintf(stderr, "\tSpot coordinates: %s (tiles of %g)\n", spatial_path, bin_size);
+        }
+        if (by_tag[0]) {
+            fprintf(stderr, "\tSplit by tag: %s (up to %u labels, then %d overflow outputs)\n",
+                    by_tag, max_labels, BY_TAG_OVERFLOW_BUCKETS);
+        }
+        if (downsample_target) {
+            fprintf(stderr, "\tDownsampling: %llu %s per label (seed %llu)\n",
+                    (unsigned long long) downsample_target, dedup ? "molecules" : "reads",
+                    (unsigned long long) downsample_seed);
+        } else {
+            fprintf(stderr, "\tDownsampling: disabled\n");
+        }
+        fprintf(stderr, "\tUMI method: %s\n\n", umi_method == UMI_DIRECTIONAL ? "directional" : "exact");
     }
 
     if (access(bampath, F_OK) != 0) {
@@ -301,14 +941,29 @@ int cmd_split(int argc, char *argv[]) {
         goto cleanup;
     }
 
-    if (access(metapath, F_OK) != 0) {
-        log_msg("Metadata file not found: %s", ERROR, metapath);
-        goto cleanup;
+    for (int m = 0; m < n_meta; m++) {
+        if (access(metapaths[m], F_OK) != 0) {
+            log_msg("Metadata file not found: %s", ERROR, metapaths[m]);
+            goto cleanup;
+        }
+
+        if (access(metapaths[m], R_OK) != 0) {
+            log_msg("Metadata file not readable: %s", ERROR, metapaths[m]);
+            goto cleanup;
+        }
     }
 
-    if (access(metapath, R_OK) != 0) {
-        log_msg("Metadata file not readable: %s", ERROR, metapath);
-        goto cleanup;
+    // With several metadata files, each writes into its own subdirectory
+    char meta_stems[MAX_METADATA_FILES][256];
+    for (int m = 0; m < n_meta; m++) {
+        metadata_stem(metapaths[m], meta_stems[m], sizeof(meta_stems[m]));
+        for (int k = 0; k < m && n_meta > 1; k++) {
+            if (strcmp(meta_stems[k], meta_stems[m]) == 0) {
+                log_msg("Metadata files %s and %s would share output directory %s", ERROR,
+                        metapaths[k], metapaths[m], meta_stems[m]);
+                goto cleanup;
+            }
+        }
     }
 
     if (dryrun) {
@@ -317,6 +972,7 @@ int cmd_split(int argc, char *argv[]) {
     }
 
     // Check output directory write permissions (using stack allocation)
+    if (tag_mode) goto open_input;
     char output_parent[PATH_MAX];
     size_t oprefix_len = strlen(oprefix);
     if (oprefix_len >= sizeof(output_parent)) {
@@ -365,6 +1021,7 @@ int cmd_split(int argc, char *argv[]) {
         goto cleanup;
     }
 
+open_input:
     // Open BAM file
     samFile *fp = sam_open(bampath, "r");
     if (!fp) {
@@ -383,92 +1040,229 @@ int cmd_split(int argc, char *argv[]) {
     if (dedup) {
         sam_hdr_change_HD(header, "SO", "scbamsplit");
     }
+    if (sort_cb) {
+        sam_hdr_change_HD(header, "SO", "unsorted");
+        sam_hdr_change_HD(header, "SS", "unsorted:CB");
+    }
 
-    // Load metadata and create direct mapping
-    cb2fp *direct_map = hash_readtag_direct(metapath, oprefix, header);
-    if (!direct_map) {
-        log_msg("Failed to load metadata and create output files from: %s", ERROR, metapath);
+    // Label registry owns one output file per label, or in tag mode the
+    // single tagged output
+    label_registry_t *registry = create_label_registry(16);
+    if (!registry) {
         sam_hdr_destroy(header);
         sam_close(fp);
         goto cleanup;
     }
+    if (tag_mode) {
+        registry->tagged = sam_open(oprefix, "wb");
+        if (!registry->tagged || sam_hdr_write(registry->tagged, header) < 0) {
+            log_msg("Failed to create output file: %s", ERROR, oprefix);
+            destroy_label_registry(registry);
+            sam_hdr_destroy(header);
+            sam_close(fp);
+            goto cleanup;
+        }
+        strcpy(registry->label_tag, label_tag);
+        strcpy(registry->dedup_tag, DEDUP_FLAG_TAG);
+        registry->keep_unassigned = keep_unassigned;
+    }
 
-    // Process reads
-    if (!dedup) {
-        // Simple splitting without deduplication
-        bam1_t *read = bam_init1();
-        char this_CB[CB_LENGTH];
-        char this_UB[UB_LENGTH];
-        int read_stat;
-
-        while ((read_stat = sam_read1(fp, header, read)) >= 0) {
-            int8_t cb_stat = get_CB(read, cb_meta, this_CB);
-            int8_t ub_stat = get_UB(read, ub_meta, this_UB);
-            int16_t mapq = read->core.qual;
-
-            if (cb_stat != 0 || ub_stat != 0 || mapq < mapq_thres) {
-                continue;
+    // Load every metadata file into one direct mapping, so each read is
+    // decoded and looked up once however many groupings are requested
+    cb2fp *direct_map = NULL;
+    for (int m = 0; m < n_meta; m++) {
+        char meta_prefix[PATH_MAX];
+        const char *prefix = tag_mode ? NULL : oprefix;
+        if (!tag_mode && n_meta > 1) {
+            if (snprintf(meta_prefix, sizeof(meta_prefix), "%s%s/",
+                         oprefix, meta_stems[m]) >= (int) sizeof(meta_prefix)) {
+                log_msg("Output path too long for metadata file: %s", ERROR, metapaths[m]);
+                destroy_barcode_map(direct_map);
+                direct_map = NULL;
+                break;
             }
-
-            if (read_dump(direct_map, this_CB, header, read) != 0) {
-                log_msg("Failed to write read", ERROR);
+            if (create_directory(meta_prefix) != 0) {
+                destroy_barcode_map(direct_map);
+                direct_map = NULL;
                 break;
             }
+            prefix = meta_prefix;
+        }
+        // Fragment mode registers the labels but opens no BAM outputs
+        if (hash_readtag_direct(metapaths[m], prefix, fragments ? NULL : header,
+                                registry, &direct_map) != 0) {
+            log_msg("Failed to load metadata and create output files from: %s", ERROR, metapaths[m]);
+            destroy_barcode_map(direct_map);
+            direct_map = NULL;
+            break;
+        }
+    }
+    // Spot barcodes are kept in a compact table rather than one cb2fp each
+    spatial_map_t *spatial = NULL;
+    if (spatial_path) {
+        spatial = load_spatial_map(spatial_path, bin_size);
+        if (!spatial) {
+            log_msg("Failed to load spot coordinates from: %s", ERROR, spatial_path);
+            destroy_label_registry(registry);
+            sam_hdr_destroy(header);
+            sam_close(fp);
+            goto cleanup;
         }
+    } else if (!direct_map && !by_tag[0] && !call_cells) {
+        log_msg("No cell barcodes loaded from metadata", ERROR);
+        destroy_label_registry(registry);
+        sam_hdr_destroy(header);
+        sam_close(fp);
+        goto cleanup;
+    }
 
-        bam_destroy1(read);
+    // Prefilter rejects barcodes absent from the metadata before any lookup.
+    // Correction needs to see those misses, so it uses the neighbor index instead.
+    barcode_index_t index = {
+        .direct_map = direct_map,
+        .prefilter = NULL,
+        .neighbors = NULL,
+        .registry = registry,
+        .qc = NULL
+    };
+    downsampler_t *sampler = NULL;
+    cb_sorter_t *sorter = NULL;
+    if (qc_prefix) {
+        index.qc = create_qc_stats(HASH_COUNT(direct_map), dedup || fragments);
+        if (!index.qc) {
+            return_val = 1;
+            goto close_outputs;
+        }
+    }
+    if (correct) {
+        index.neighbors = build_neighbor_index(direct_map);
+        if (!index.neighbors) {
+            return_val = 1;
+            goto close_outputs;
+        }
+    } else if (direct_map) {
+        index.prefilter = build_barcode_prefilter(direct_map);
+    }
+
+    // Per-label coverage is accumulated as reads are written
+    if (coverage && open_coverage_tracks(registry, header) != 0) {
+        return_val = 1;
+        goto close_outputs;
+    }
+
+    // CB-sorted outputs are buffered and written when the input is done
+    if (sort_cb) {
+        sorter = create_cb_sorter(registry, sort_memory);
+        if (!sorter) {
+            return_val = 1;
+            goto close_outputs;
+        }
+        registry->sorter = sorter;
+    }
+
+    // Downsampling selects per label before anything is written
+    if (downsample_target) {
+        sampler = create_downsampler(registry->count, downsample_target, downsample_seed);
+        if (!sampler) {
+            return_val = 1;
+            goto close_outputs;
+        }
+        registry->sampler = sampler;
+    }
+
+    // Process reads
+    if (by_tag[0]) {
+        if (split_by_tag(fp, header, registry, by_tag, oprefix, max_labels, mapq_thres) != 0) {
+            log_msg("Splitting by %s failed", ERROR, by_tag);
+            return_val = 1;
+        }
+    } else if (spatial) {
+        tag_reader_t reader;
+        init_tag_reader(&reader, cb_meta, ub_meta);
+        if (split_spatial(fp, header, registry, spatial, &reader, oprefix, mapq_thres) != 0) {
+            log_msg("Spatial binning failed", ERROR);
+            return_val = 1;
+        }
+    } else if (fragments) {
+        if (split_fragments(fp, header, &index, cb_meta, ub_meta, mapq_thres) != 0) {
+            log_msg("Fragment mode failed", ERROR);
+            return_val = 1;
+        }
+    } else if (!dedup) {
+        // Simple splitting without deduplication, using the loop variant
+        // specialised for this run's barcode locations and MAPQ filter
+        tag_reader_t reader;
+        init_tag_reader(&reader, cb_meta, ub_meta);
+        reader.neighbors = index.neighbors;
+        split_loop_t split_loop = split_loops[READ_LOOP_VARIANT(cb_meta->location,
+                                                                ub_meta->location,
+                                                                mapq_thres > 0)];
+        if (sampler && sample_split_reads(fp, header, &index, &reader, mapq_thres,
+                                          split_loop) != 0) {
+            log_msg("Downsampling failed", ERROR);
+            return_val = 1;
+        } else if (split_loop(fp, header, &index, &reader, mapq_thres) != 0) {
+            log_msg("Splitting failed", ERROR);
+            return_val = 1;
+        }
     } else {
         // Use 3-pass deduplication
         log_msg("Using 3-pass deduplication algorithm", INFO);
         
-        int dedup_result = dedup_3pass(bampath, header, direct_map, cb_meta, ub_meta, mapq_thres);
+        dedup_options_t dedup_options = {
+            .mapq_threshold = mapq_thres,
+            .umi_method = umi_method,
+            .dedup_key = dedup_key,
+            .unannotated_by_position = unannotated_by_position,
+            .mark_duplicates = mark_duplicates,
+            .count_matrix = count_matrix,
+            .call_cells = call_cells,
+            .min_cell_umis = min_cell_umis,
+            .per_cell_outputs = per_cell,
+            .output_prefix = oprefix
+        };
+        int dedup_result = dedup_3pass(bampath, header, &index,
+                                       cb_meta, ub_meta, &dedup_options);
         if (dedup_result != 0) {
             log_msg("3-pass deduplication failed", ERROR);
             return_val = 1;
         }
     }
 
+close_outputs:
+    if (sorter) {
+        if (return_val == 0 && write_cb_sorted_outputs(sorter, registry) != 0) {
+            return_val = 1;
+        }
+        registry->sorter = NULL;
+        destroy_cb_sorter(sorter);
+    }
+    // Flush coverage tracks while the header naming their contigs is alive
+    if (close_coverage_tracks(registry) != 0) {
+        return_val = 1;
+    }
+    if (index.qc && return_val == 0 &&
+        write_qc_stats(index.qc, direct_map, registry, qc_prefix) != 0) {
+        return_val = 1;
+    }
+    destroy_qc_stats(index.qc);
+    registry->sampler = NULL;
+    destroy_downsampler(sampler);
+    destroy_spatial_map(spatial);
+
     // Cleanup
     sam_close(fp);
     sam_hdr_destroy(header);
 
-    // Close output files and free direct mapping hash table
-    // First, collect unique file pointers to avoid double-closing
-    samFile **unique_fps = NULL;
-    int n_fps = 0;
-    int fps_capacity = 10;
-    unique_fps = malloc(fps_capacity * sizeof(samFile*));
+    // Free direct mapping hash table
+    destroy_barcode_map(direct_map);
     
-    cb2fp *entry, *tmp;
-    HASH_ITER(hh, direct_map, entry, tmp) {
-        if (entry->fp) {
-            // Check if we've already seen this file pointer
-            int found = 0;
-            for (int i = 0; i < n_fps; i++) {
-                if (unique_fps[i] == entry->fp) {
-                    found = 1;
-                    break;
-                }
-            }
-            
-            // If not found, add to unique list
-            if (!found) {
-                if (n_fps >= fps_capacity) {
-                    fps_capacity *= 2;
-                    unique_fps = realloc(unique_fps, fps_capacity * sizeof(samFile*));
-                }
-                unique_fps[n_fps++] = entry->fp;
-            }
-        }
-        HASH_DEL(direct_map, entry);
-        free(entry);
-    }
+    bc_bloom_destroy(index.prefilter);
+    destroy_neighbor_index(index.neighbors);
     
-    // Now close each unique file pointer once
-    for (int i = 0; i < n_fps; i++) {
-        sam_close(unique_fps[i]);
-    }
-    free(unique_fps);
+    // Close each output file once through the registry that owns them
+    destroy_label_registry(registry);
+    bc_clear_interned();
 
 cleanup:
     destroy_tag_meta(cb_meta);
@@ -476,6 +1270,16 @@ cleanup:
     return return_val;
 }
 
+// Command function for split subcommand
+int cmd_split(int argc, char *argv[]) {
+    return run_split(argc, argv, false);
+}
+
+// Command function for tag subcommand
+int cmd_tag(int argc, char *argv[]) {
+    return run_split(argc, argv, true);
+}
+
 // Main function with subcommand parsing
 int main(int argc, char *argv[]) {
     if (argc < 2) {
@@ -491,10 +1295,15 @@ int main(int argc, char *argv[]) {
         return 0;
     }
     
+    // Select SIMD barcode kernels once for the whole run
+    bc_init_kernels();
+    
     // Handle subcommands
     if (strcmp(subcommand, "split") == 0) {
         // Remove subcommand from argv and pass to cmd_split
         return cmd_split(argc - 1, &argv[1]);
+    } else if (strcmp(subcommand, "tag") == 0) {
+        return cmd_tag(argc - 1, &argv[1]);
     } else {
         fprintf(stderr, "Error: Unknown command '%s'\n", subcommand);
         fprintf(stderr, "\n");
@@ -0,0 +1,144 @@
+//
+// Per-barcode QC counters
+//
+
+#include "qc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "utils.h"
+
+qc_stats_t *create_qc_stats(uint32_t n_barcodes, bool dedup) {
+    qc_stats_t *qc = calloc(1, sizeof(qc_stats_t));
+    if (!qc) {
+        log_msg("Failed to allocate QC statistics", ERROR);
+        return NULL;
+    }
+    qc->barcodes = calloc(n_barcodes ? n_barcodes : 1, sizeof(qc_counts_t));
+    if (!qc->barcodes) {
+        log_msg("Failed to allocate QC counters for %u barcodes", ERROR, n_barcodes);
+        free(qc);
+        return NULL;
+    }
+    qc->n_barcodes = n_barcodes;
+    qc->dedup = dedup;
+    return qc;
+}
+
+void destroy_qc_stats(qc_stats_t *qc) {
+    if (!qc) return;
+    free(qc->barcodes);
+    free(qc);
+}
+
+// Per-label sums of the barcode counters
+typedef struct {
+    uint64_t barcodes;
+    uint64_t barcodes_seen;
+    uint64_t total_reads;
+    uint64_t mapq_pass;
+    uint64_t secondary_dropped;
+    uint64_t duplicates;
+    uint64_t unique_umis;
+} qc_rollup_t;
+
+static FILE *open_qc_file(const char *prefix, const char *suffix) {
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s%s", prefix, suffix) >= (int) sizeof(path)) {
+        log_msg("QC output path too long: %s", ERROR, prefix);
+        return NULL;
+    }
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        log_msg("Failed to create QC output: %s", ERROR, path);
+    }
+    return fp;
+}
+
+// Closes a QC file, reporting a failed write or close
+static int close_qc_file(FILE *fp, int failed, const char *prefix, const char *suffix) {
+    if (fclose(fp) != 0 || failed) {
+        log_msg("Failed to write QC output: %s%s", ERROR, prefix, suffix);
+        return -1;
+    }
+    return 0;
+}
+
+// Dedup-only columns read NA when deduplication did not run
+static int print_dedup_counts(FILE *fp, bool dedup, uint64_t secondary,
+                              uint64_t duplicates, uint64_t umis) {
+    if (dedup) {
+        return fprintf(fp, "\t%llu\t%llu\t%llu\n", (unsigned long long) secondary,
+                       (unsigned long long) duplicates, (unsigned long long) umis);
+    }
+    return fprintf(fp, "\tNA\tNA\tNA\n");
+}
+
+int write_qc_stats(const qc_stats_t *qc, cb2fp *direct_map,
+                   const label_registry_t *registry, const char *prefix) {
+    qc_rollup_t *rollups = calloc(registry->count ? registry->count : 1, sizeof(qc_rollup_t));
+    if (!rollups) {
+        log_msg("Failed to allocate QC label rollups", ERROR);
+        return -1;
+    }
+
+    FILE *fp = open_qc_file(prefix, ".barcodes.tsv");
+    if (!fp) {
+        free(rollups);
+        return -1;
+    }
+    int failed = fprintf(fp, "barcode\tlabels\ttotal_reads\tmapq_pass\tsecondary_dropped\t"
+                             "duplicates\tunique_umis\n") < 0;
+
+    char cb[32];
+    cb2fp *entry, *tmp;
+    HASH_ITER(hh, direct_map, entry, tmp) {
+        const qc_counts_t *c = &qc->barcodes[entry->id];
+        bc_unpack(entry->cb, cb);
+        failed |= fprintf(fp, "%s\t", cb) < 0;
+        for (uint32_t i = 0; i < entry->n_labels; i++) {
+            uint32_t label_id = entry->label_ids[i];
+            failed |= fprintf(fp, "%s%s", i ? "," : "", registry->entries[label_id].label) < 0;
+
+            qc_rollup_t *r = &rollups[label_id];
+            r->barcodes++;
+            r->barcodes_seen += c->total_reads > 0;
+            r->total_reads += c->total_reads;
+            r->mapq_pass += c->mapq_pass;
+            r->secondary_dropped += c->secondary_dropped;
+            r->duplicates += c->duplicates;
+            r->unique_umis += c->unique_umis;
+        }
+        failed |= fprintf(fp, "\t%u\t%u", c->total_reads, c->mapq_pass) < 0;
+        failed |= print_dedup_counts(fp, qc->dedup, c->secondary_dropped, c->duplicates,
+                                     c->unique_umis) < 0;
+        if (failed) break;
+    }
+    int ret = close_qc_file(fp, failed, prefix, ".barcodes.tsv");
+
+    fp = ret == 0 ? open_qc_file(prefix, ".labels.tsv") : NULL;
+    if (fp) {
+        failed = fprintf(fp, "label\toutput\tbarcodes\tbarcodes_seen\ttotal_reads\tmapq_pass\t"
+                             "secondary_dropped\tduplicates\tunique_umis\n") < 0;
+        for (uint32_t i = 0; i < registry->count && !failed; i++) {
+            const label_entry_t *label = &registry->entries[i];
+            const qc_rollup_t *r = &rollups[i];
+            failed = fprintf(fp, "%s\t%s%s\t%llu\t%llu\t%llu\t%llu", label->label,
+                             label->prefix ? label->prefix : "", label->prefix ? label->label : "-",
+                             (unsigned long long) r->barcodes,
+                             (unsigned long long) r->barcodes_seen,
+                             (unsigned long long) r->total_reads,
+                             (unsigned long long) r->mapq_pass) < 0 ||
+                     print_dedup_counts(fp, qc->dedup, r->secondary_dropped, r->duplicates,
+                                        r->unique_umis) < 0;
+        }
+        ret = close_qc_file(fp, failed, prefix, ".labels.tsv");
+    } else {
+        ret = -1;
+    }
+
+    free(rollups);
+    if (ret == 0) {
+        log_msg("Wrote QC statistics to %s.barcodes.tsv and %s.labels.tsv", INFO, prefix, prefix);
+    }
+    return ret;
+}
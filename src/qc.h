@@ -0,0 +1,50 @@
+//
+// Per-barcode QC counters
+//
+// One dense counter block per metadata barcode (indexed by cb2fp.id), bumped
+// in the read loops and by dedup pass 2, then written as TSV with per-label
+// rollups at the end of the run.
+
+#ifndef SCBAMSPLIT_QC_H
+#define SCBAMSPLIT_QC_H
+
+// Standard library includes
+#include <stdbool.h>
+#include <stdint.h>
+
+// Project includes
+#include "hash.h"
+
+typedef struct {
+    uint32_t total_reads;                 /* reads carrying the barcode */
+    uint32_t mapq_pass;                   /* ... at or above the MAPQ threshold */
+    uint32_t secondary_dropped;           /* secondary alignments dropped by dedup */
+    uint32_t duplicates;                  /* reads removed as UMI duplicates */
+    uint32_t unique_umis;                 /* molecules kept by dedup */
+} qc_counts_t;
+
+typedef struct qc_stats {
+    qc_counts_t *barcodes;                /* indexed by barcode id */
+    uint32_t n_barcodes;
+    bool dedup;                           /* duplicate/UMI columns are meaningful */
+} qc_stats_t;
+
+qc_stats_t *create_qc_stats(uint32_t n_barcodes, bool dedup);
+void destroy_qc_stats(qc_stats_t *qc);
+
+// Count one read of a metadata barcode
+static inline void qc_count_read(qc_stats_t *qc, const cb2fp *barcode,
+                                 bool low_mapq, bool secondary) {
+    qc_counts_t *counts = &qc->barcodes[barcode->id];
+    counts->total_reads++;
+    if (!low_mapq) {
+        counts->mapq_pass++;
+        if (secondary) counts->secondary_dropped++;
+    }
+}
+
+// Write <prefix>.barcodes.tsv and <prefix>.labels.tsv
+int write_qc_stats(const qc_stats_t *qc, cb2fp *direct_map,
+                   const label_registry_t *registry, const char *prefix);
+
+#endif //SCBAMSPLIT_QC_H
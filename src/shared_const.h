@@ -9,6 +9,7 @@
 
 // Application constants
 #define MAX_LINE_LENGTH 256
+#define MAX_METADATA_FILES 32
 #define APP_NAME "scbamsplit"
 #define VERSION "v0.31"
 
@@ -6,54 +6,254 @@
 #include <string.h>
 #include <stdlib.h>
 
+// Copy a Z-typed aux value (s points at the type byte) into tag_ptr
+static int8_t copy_aux_string(const uint8_t *s, const uint8_t *end,
+                              char *tag_ptr, tag_meta_t *info) {
+    if (s >= end || *s != 'Z') {
+        // Missing or not a string (e.g. an integer-typed barcode tag)
+        return -1;
+    }
+    s++;
+
+    size_t max_len = info->length - 1;
+    if ((size_t)(end - s) < max_len) max_len = end - s;
+    const uint8_t *nul = memchr(s, '\0', max_len);
+    size_t len = nul ? (size_t)(nul - s) : max_len;
+
+    memcpy(tag_ptr, s, len);
+    tag_ptr[len] = '\0';
+    return 0;
+}
+
+// Skip one aux value (s points at the type byte); NULL if the record is malformed
+static const uint8_t *skip_aux_value(const uint8_t *s, const uint8_t *end) {
+    if (s >= end) return NULL;
+    uint8_t type = *s++;
+    size_t size;
+
+    switch (type) {
+        case 'A': case 'c': case 'C':
+            size = 1;
+            break;
+        case 's': case 'S':
+            size = 2;
+            break;
+        case 'i': case 'I': case 'f':
+            size = 4;
+            break;
+        case 'd':
+            size = 8;
+            break;
+        case 'Z': case 'H':
+            {
+                const uint8_t *nul = memchr(s, '\0', end - s);
+                return nul ? nul + 1 : NULL;
+            }
+        case 'B':
+            {
+                if (end - s < 5) return NULL;
+                uint8_t sub_type = s[0];
+                uint32_t count;
+                memcpy(&count, s + 1, sizeof(count));
+                s += 5;
+                switch (sub_type) {
+                    case 'c': case 'C': size = 1; break;
+                    case 's': case 'S': size = 2; break;
+                    case 'i': case 'I': case 'f': size = 4; break;
+                    default: return NULL;
+                }
+                if ((uint64_t) count * size > (uint64_t)(end - s)) return NULL;
+                return s + (size_t) count * size;
+            }
+        default:
+            return NULL;
+    }
+
+    return ((size_t)(end - s) >= size) ? s + size : NULL;
+}
+
+// Check whether the predicted offset still holds the expected tag
+static const uint8_t *try_aux_hint(const uint8_t *aux, const uint8_t *end,
+                                   const aux_hint_t *hint, const char *tag) {
+    if (hint->offset < 0) return NULL;
+    const uint8_t *s = aux + hint->offset;
+    // Tag (2) + type (1) + value + NUL must fit; the NUL check guards against
+    // the same bytes appearing inside another tag's value
+    if (end - s < 4 + hint->value_len) return NULL;
+    if (s[0] != tag[0] || s[1] != tag[1] || s[2] != 'Z') return NULL;
+    if (s[3 + hint->value_len] != '\0') return NULL;
+    return s + 2;
+}
+
+// Remember where a tag was found so the next read can try there first
+static void learn_aux_hint(aux_hint_t *hint, const uint8_t *aux, const uint8_t *s,
+                           const uint8_t *end) {
+    hint->offset = (int32_t)(s - aux);
+    const uint8_t *nul = memchr(s + 3, '\0', end - (s + 3));
+    hint->value_len = nul ? (int32_t)(nul - (s + 3)) : -1;
+    if (hint->value_len < 0) hint->offset = -1;
+}
+
+// Locate CB and UMI tags in one walk of the aux block, trying learned
+// offsets first. Either output may be NULL when that tag is not wanted.
+// Returns -1 when the CB is missing, 1 when only the UMI is.
+int8_t fetch_tags(bam1_t *read, tag_reader_t *reader,
+                  char *cb_ptr, char *ub_ptr) {
+    const uint8_t *aux = bam_get_aux(read);
+    const uint8_t *end = aux + bam_get_l_aux(read);
+    const char *cb_tag = reader->cb_meta->tag_name;
+    const char *ub_tag = reader->ub_meta->tag_name;
+
+    const uint8_t *cb_val = cb_ptr ? try_aux_hint(aux, end, &reader->cb_hint, cb_tag) : NULL;
+    const uint8_t *ub_val = ub_ptr ? try_aux_hint(aux, end, &reader->ub_hint, ub_tag) : NULL;
+
+    // Fall back to a full sweep for whatever the hints did not resolve
+    if ((cb_ptr && !cb_val) || (ub_ptr && !ub_val)) {
+        const uint8_t *s = aux;
+        while (end - s >= 3) {
+            if (cb_ptr && !cb_val && s[0] == cb_tag[0] && s[1] == cb_tag[1]) {
+                cb_val = s + 2;
+                learn_aux_hint(&reader->cb_hint, aux, s, end);
+            } else if (ub_ptr && !ub_val && s[0] == ub_tag[0] && s[1] == ub_tag[1]) {
+                ub_val = s + 2;
+                learn_aux_hint(&reader->ub_hint, aux, s, end);
+            }
+            if ((!cb_ptr || cb_val) && (!ub_ptr || ub_val)) break;
+
+            s = skip_aux_value(s + 2, end);
+            if (!s) break;
+        }
+    }
+
+    if (cb_ptr && (!cb_val || copy_aux_string(cb_val, end, cb_ptr, reader->cb_meta) != 0)) {
+        return -1;
+    }
+    if (ub_ptr && (!ub_val || copy_aux_string(ub_val, end, ub_ptr, reader->ub_meta) != 0)) {
+        return 1;
+    }
+    return 0;
+}
+
 // Helper function to fetch tag from BAM record
 static int8_t fetch_tag2(bam1_t *read, char* tag_ptr, tag_meta_t *info) {
-    char* tag_content = (char *) bam_aux_get(read, info->tag_name);
+    const uint8_t *tag_content = bam_aux_get(read, info->tag_name);
     if (NULL == tag_content) {
         // Tag not found
         return -1;
     }
-    strncpy(tag_ptr, tag_content + 1, info->length - 1);
-    tag_ptr[info->length - 1] = '\0';
-    return 0;
+    const uint8_t *end = bam_get_aux(read) + bam_get_l_aux(read);
+    return copy_aux_string(tag_content, end, tag_ptr, info);
 }
 
-// Helper function to fetch tag from read name
-static int8_t fetch_name(bam1_t *read, char* tag_ptr, tag_meta_t *info) {
-    char* rn = bam_get_qname(read);
-
-    if (rn[0] == info->sep[0]) return -1;
+// A field of the read name, referenced in place
+typedef struct {
+    const char *start;
+    size_t len;
+} name_field_t;
 
-    // Use static buffer to avoid malloc/free for every read
-    // Note: Static variables are NOT thread-safe, but we'll keep simple for now
-    static char rncpy[512];
-    size_t rn_len = strlen(rn);
-    
-    // Check if read name fits in our buffer
-    if (rn_len >= sizeof(rncpy)) {
-        return -1; // Read name too long
-    }
-    
-    strncpy(rncpy, rn, sizeof(rncpy) - 1);
-    rncpy[sizeof(rncpy) - 1] = '\0';
-    char *token;
+// Locate fields a and b (1-based; 0 means unused) of a read name in one
+// pass without copying. Runs of separators count as one, as with strtok.
+// Returns 0 when every requested field was found.
+static int8_t locate_name_fields(const char *rn, size_t rn_len, char sep,
+                                 uint8_t field_a, name_field_t *out_a,
+                                 uint8_t field_b, name_field_t *out_b) {
+    if (rn_len == 0 || rn[0] == sep) return -1;
 
+    uint8_t last_field = field_a > field_b ? field_a : field_b;
+    const char *p = rn;
+    const char *end = rn + rn_len;
     uint8_t field_num = 0;
-    int8_t return_val = 1;
-    token = strtok(rncpy, info->sep);
-    while (token != NULL) {
+
+    while (p < end) {
+        // Skip separator runs between tokens
+        while (p < end && *p == sep) p++;
+        if (p == end) break;
+
+        const char *next = memchr(p, sep, end - p);
+        if (!next) next = end;
         field_num++;
-        if (field_num == info->field) {
-            strncpy(tag_ptr, token, info->length - 1);
-            tag_ptr[info->length - 1] = '\0';
-            return_val = 0;
-            break;
+
+        if (field_num == field_a) {
+            out_a->start = p;
+            out_a->len = next - p;
+        }
+        if (field_num == field_b) {
+            out_b->start = p;
+            out_b->len = next - p;
         }
-        token = strtok(NULL, info->sep);
+        if (field_num == last_field) return 0;
+
+        p = next;
+    }
+    return 1;
+}
+
+// Copy a located name field into tag_ptr, truncated to the configured length
+static void copy_name_field(const name_field_t *field, char *tag_ptr, tag_meta_t *info) {
+    size_t len = field->len;
+    if (len > (size_t)(info->length - 1)) len = info->length - 1;
+    memcpy(tag_ptr, field->start, len);
+    tag_ptr[len] = '\0';
+}
+
+// Length of the read name without its NUL padding
+static inline size_t read_name_length(const bam1_t *read) {
+    return read->core.l_qname - read->core.l_extranul - 1;
+}
+
+// Helper function to fetch tag from read name
+int8_t fetch_name(bam1_t *read, char* tag_ptr, tag_meta_t *info) {
+    name_field_t field;
+    int8_t return_val = locate_name_fields(bam_get_qname(read), read_name_length(read),
+                                           info->sep[0], info->field, &field, 0, NULL);
+    if (return_val == 0) {
+        copy_name_field(&field, tag_ptr, info);
     }
     return return_val;
 }
 
+// Pack every segment of a composite barcode where it lies in the record
+// and concatenate them, the first segment in the lowest bases. Only the
+// last segment may carry a "-N" suffix.
+int8_t fetch_composite(bam1_t *read, const tag_meta_t *info, bc_key_t *key) {
+    const uint8_t *aux_end = bam_get_aux(read) + bam_get_l_aux(read);
+    bc_key_t bases = 0;
+    uint32_t n_bases = 0;
+    uint32_t suffix = 0;
+
+    for (uint8_t i = 0; i < info->n_sources; i++) {
+        const barcode_source_t *source = &info->sources[i];
+        const char *value;
+        size_t len;
+        if (source->location == READ_TAG) {
+            const uint8_t *s = bam_aux_get(read, source->tag_name);
+            if (!s || *s != 'Z') return -1;
+            const uint8_t *nul = memchr(s + 1, '\0', aux_end - (s + 1));
+            if (!nul) return -1;
+            value = (const char *) (s + 1);
+            len = nul - (s + 1);
+        } else {
+            name_field_t field;
+            if (locate_name_fields(bam_get_qname(read), read_name_length(read), info->sep[0],
+                                   source->field, &field, 0, NULL) != 0) {
+                return -1;
+            }
+            value = field.start;
+            len = field.len;
+        }
+
+        bc_key_t segment;
+        if (suffix || bc_pack(value, len, &segment) != 0) return -1;
+        uint32_t segment_len = BC_LENGTH(segment);
+        if (n_bases + segment_len > BC_MAX_BASES) return -1;
+        bases |= BC_BASES(segment) << (2 * n_bases);
+        n_bases += segment_len;
+        suffix = BC_SUFFIX(segment);
+    }
+    *key = bases | (bc_key_t) n_bases << BC_BASE_BITS | (bc_key_t) suffix << BC_SUFFIX_SHIFT;
+    return 0;
+}
+
 int8_t get_CB(bam1_t *read, tag_meta_t* info, char* tag_ptr) {
     int8_t exit_code = 0;
     switch (info->location) {
@@ -84,4 +284,83 @@ int8_t get_UB(bam1_t *read, tag_meta_t* info, char* tag_ptr) {
             exit_code = 1;
     }
     return exit_code;
+}
+
+void init_tag_reader(tag_reader_t *reader, tag_meta_t *cb_meta, tag_meta_t *ub_meta) {
+    reader->cb_meta = cb_meta;
+    reader->ub_meta = ub_meta;
+    reader->cb_hint.offset = -1;
+    reader->cb_hint.value_len = -1;
+    reader->ub_hint.offset = -1;
+    reader->ub_hint.value_len = -1;
+    reader->neighbors = NULL;
+    reader->n_resolved = 0;
+}
+
+// Fetch CB and UMI from the read name, splitting it once when both share a separator.
+// Returns 1 when only the UMI is missing, -1 when the fields cannot be told apart.
+int8_t fetch_name_pair(bam1_t *read, tag_reader_t *reader, char *cb_ptr, char *ub_ptr) {
+    if (reader->cb_meta->sep[0] != reader->ub_meta->sep[0]) {
+        int8_t cb_stat = fetch_name(read, cb_ptr, reader->cb_meta);
+        if (cb_stat != 0) return -1;
+        return fetch_name(read, ub_ptr, reader->ub_meta) != 0 ? 1 : 0;
+    }
+
+    name_field_t cb_field, ub_field;
+    int8_t name_stat = locate_name_fields(bam_get_qname(read), read_name_length(read),
+                                          reader->cb_meta->sep[0],
+                                          reader->cb_meta->field, &cb_field,
+                                          reader->ub_meta->field, &ub_field);
+    if (name_stat != 0) return -1;
+    copy_name_field(&cb_field, cb_ptr, reader->cb_meta);
+    copy_name_field(&ub_field, ub_ptr, reader->ub_meta);
+    return 0;
+}
+
+// Generic entry point; hot loops call extract_CB_UB with constant locations instead
+int8_t get_CB_UB(bam1_t *read, tag_reader_t *reader, char *cb_ptr, char *ub_ptr) {
+    return extract_CB_UB(read, reader, cb_ptr, ub_ptr,
+                         reader->cb_meta->location, reader->ub_meta->location);
+}
+
+
+read_batch_t *create_read_batch(void) {
+    read_batch_t *batch = calloc(1, sizeof(read_batch_t));
+    if (!batch) {
+        log_msg("Failed to allocate read batch", ERROR);
+        return NULL;
+    }
+    for (int i = 0; i < READ_BATCH_SIZE; i++) {
+        batch->reads[i] = bam_init1();
+        if (!batch->reads[i]) {
+            log_msg("Failed to initialize BAM read for batch", ERROR);
+            destroy_read_batch(batch);
+            return NULL;
+        }
+    }
+    return batch;
+}
+
+void destroy_read_batch(read_batch_t *batch) {
+    if (!batch) return;
+    for (int i = 0; i < READ_BATCH_SIZE; i++) {
+        if (batch->reads[i]) bam_destroy1(batch->reads[i]);
+    }
+    free(batch);
+}
+
+// Decode up to READ_BATCH_SIZE records into the ring, reusing their buffers.
+// Returns the number of records read; *read_stat holds the last sam_read1 status.
+// A read error (< -1) is sticky: the records decoded before it are returned,
+// and the next call returns 0 without reading, so the caller's loop ends with
+// the error still in *read_stat instead of reading past it as if at EOF.
+int fill_read_batch(samFile *fp, sam_hdr_t *header, read_batch_t *batch, int *read_stat) {
+    batch->count = 0;
+    if (*read_stat < -1) return 0;
+    while (batch->count < READ_BATCH_SIZE) {
+        *read_stat = sam_read1(fp, header, batch->reads[batch->count]);
+        if (*read_stat < 0) break;
+        batch->count++;
+    }
+    return batch->count;
 }
\ No newline at end of file
@@ -5,14 +5,144 @@
 #ifndef SCBAMSPLIT_SORT_H
 #define SCBAMSPLIT_SORT_H
 
+// Standard library includes
+#include <string.h>
+
 // External library includes
 #include "htslib/sam.h"
 
 // Project includes
 #include "utils.h"
 
+// Predicted position of one aux tag, learned from earlier reads
+typedef struct {
+    int32_t offset;         // Byte offset of the tag in the aux block (-1 if unknown)
+    int32_t value_len;      // Length of the Z value seen at that offset
+} aux_hint_t;
+
+// Extracts CB and UMI together in a single sweep of the aux block.
+// Owned by one read loop; holds no state shared between loops.
+typedef struct {
+    tag_meta_t *cb_meta;
+    tag_meta_t *ub_meta;
+    aux_hint_t cb_hint;
+    aux_hint_t ub_hint;
+    neighbor_index_t *neighbors;   // Resolves barcodes with one N; NULL without correction
+    uint64_t n_resolved;           // Barcodes recovered that way
+} tag_reader_t;
+
+// Number of records decoded before their barcodes are looked up together
+#define READ_BATCH_SIZE 256
+
+// Reusable ring of BAM records, allocated once per read loop
+typedef struct {
+    bam1_t *reads[READ_BATCH_SIZE];
+    int count;              // Records filled by the last fill_read_batch()
+} read_batch_t;
+
+read_batch_t *create_read_batch(void);
+void destroy_read_batch(read_batch_t *batch);
+int fill_read_batch(samFile *fp, sam_hdr_t *header, read_batch_t *batch, int *read_stat);
+
 // Essential BAM tag extraction functions
 int8_t get_CB(bam1_t *read, tag_meta_t* info, char* tag_ptr);
 int8_t get_UB(bam1_t *read, tag_meta_t* info, char* tag_ptr);
 
-#endif //SCBAMSPLIT_SORT_H
\ No newline at end of file
+void init_tag_reader(tag_reader_t *reader, tag_meta_t *cb_meta, tag_meta_t *ub_meta);
+int8_t get_CB_UB(bam1_t *read, tag_reader_t *reader, char *cb_ptr, char *ub_ptr);
+
+// Low-level fetchers used by the specialised read loops
+int8_t fetch_tags(bam1_t *read, tag_reader_t *reader, char *cb_ptr, char *ub_ptr);
+int8_t fetch_name(bam1_t *read, char *tag_ptr, tag_meta_t *info);
+int8_t fetch_name_pair(bam1_t *read, tag_reader_t *reader, char *cb_ptr, char *ub_ptr);
+int8_t fetch_composite(bam1_t *read, const tag_meta_t *info, bc_key_t *key);
+
+// Extract CB and UMI for a fixed pair of locations. Read loops call this
+// with compile-time constants so the location checks fold away and only
+// the matching fetcher remains in each specialised loop. Returns -1 when
+// the CB is missing and 1 when only the UMI is.
+static inline __attribute__((always_inline))
+int8_t extract_CB_UB(bam1_t *read, tag_reader_t *reader, char *cb_ptr, char *ub_ptr,
+                     const enum location cb_loc, const enum location ub_loc) {
+    if (cb_loc == READ_TAG && ub_loc == READ_TAG) {
+        return fetch_tags(read, reader, cb_ptr, ub_ptr);
+    }
+    if (cb_loc == READ_NAME && ub_loc == READ_NAME) {
+        return fetch_name_pair(read, reader, cb_ptr, ub_ptr);
+    }
+    if (cb_loc == READ_TAG) {
+        if (fetch_tags(read, reader, cb_ptr, NULL) != 0) return -1;
+        return fetch_name(read, ub_ptr, reader->ub_meta) != 0 ? 1 : 0;
+    }
+    if (fetch_name(read, cb_ptr, reader->cb_meta) != 0) return -1;
+    return fetch_tags(read, reader, NULL, ub_ptr) != 0 ? 1 : 0;
+}
+
+// Single-tag variants, so loops can reject a read on its CB before the UMI is touched
+static inline __attribute__((always_inline))
+int8_t extract_CB(bam1_t *read, tag_reader_t *reader, char *cb_ptr,
+                  const enum location cb_loc) {
+    if (cb_loc == READ_TAG) return fetch_tags(read, reader, cb_ptr, NULL);
+    return fetch_name(read, cb_ptr, reader->cb_meta);
+}
+
+static inline __attribute__((always_inline))
+int8_t extract_UB(bam1_t *read, tag_reader_t *reader, char *ub_ptr,
+                  const enum location ub_loc) {
+    if (ub_loc == READ_TAG) return fetch_tags(read, reader, NULL, ub_ptr);
+    return fetch_name(read, ub_ptr, reader->ub_meta);
+}
+
+// Pack a fetched cell barcode. Ids other than sequences and Visium HD spots
+// match only if the metadata interned them; with correction on, one N is
+// resolved against the metadata barcodes instead of rejecting the read.
+static inline __attribute__((always_inline))
+int8_t pack_CB(tag_reader_t *reader, const char *cb_ptr, bc_key_t *key) {
+    size_t len = strlen(cb_ptr);
+    if (bc_pack_id(cb_ptr, len, key) == 0 || bc_find_interned(cb_ptr, len, key) == 0) return 0;
+    if (!reader->neighbors || resolve_n_barcode(reader->neighbors, cb_ptr, key) != 0) return -1;
+    reader->n_resolved++;
+    return 0;
+}
+
+// Cell barcode as its packed key. Composite barcodes are packed segment by
+// segment straight from the record; other locations go through extract_CB.
+// The composite check is the same for every read of a run, so it predicts.
+static inline __attribute__((always_inline))
+int8_t extract_CB_key(bam1_t *read, tag_reader_t *reader, char *cb_ptr,
+                      const enum location cb_loc, bc_key_t *key) {
+    if (reader->cb_meta->location == READ_COMPOSITE) {
+        return fetch_composite(read, reader->cb_meta, key);
+    }
+    if (extract_CB(read, reader, cb_ptr, cb_loc) != 0) return -1;
+    return pack_CB(reader, cb_ptr, key);
+}
+
+// Packed CB key plus the UMI string. Returns -1 when the CB is missing or
+// cannot be packed, 1 when only the UMI is missing (the key is still set).
+// Composite barcodes are packed from the record, then the UMI is fetched.
+static inline __attribute__((always_inline))
+int8_t extract_CB_key_UB(bam1_t *read, tag_reader_t *reader, char *cb_ptr, char *ub_ptr,
+                         const enum location cb_loc, const enum location ub_loc,
+                         bc_key_t *key) {
+    if (reader->cb_meta->location == READ_COMPOSITE) {
+        if (fetch_composite(read, reader->cb_meta, key) != 0) return -1;
+        return extract_UB(read, reader, ub_ptr, ub_loc) != 0 ? 1 : 0;
+    }
+    int8_t stat = extract_CB_UB(read, reader, cb_ptr, ub_ptr, cb_loc, ub_loc);
+    if (stat < 0 || pack_CB(reader, cb_ptr, key) != 0) return -1;
+    return stat;
+}
+
+// When both fields sit in the same place, one aux sweep or one name split
+// yields both, so the UMI is fetched with the CB; otherwise it is fetched
+// only after the CB passes the prefilter
+#define UMI_WITH_CB(cb_loc, ub_loc) ((cb_loc) == (ub_loc))
+
+// Index of a specialised loop variant: [CB location][UMI location][MAPQ filter].
+// Composite barcodes take the tag variants and branch in extract_CB_key.
+#define READ_LOOP_VARIANT(cb_loc, ub_loc, filter_mapq) \
+    ((((cb_loc) == READ_NAME) << 2) | (((ub_loc) == READ_NAME) << 1) | ((filter_mapq) ? 1 : 0))
+#define N_READ_LOOP_VARIANTS 8
+
+#endif //SCBAMSPLIT_SORT_H
@@ -0,0 +1,282 @@
+//
+// Spatial binning: split reads into tiles of a spot coordinate map
+//
+
+#include "spatial.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+
+// One table row while loading; bucket holds the top 32 bits of the hash
+typedef struct {
+    bc_key_t key;
+    uint32_t tile;
+    uint32_t bucket;
+} spot_t;
+
+static int compare_spots(const void *a, const void *b) {
+    const spot_t *sa = a;
+    const spot_t *sb = b;
+    if (sa->bucket != sb->bucket) return sa->bucket < sb->bucket ? -1 : 1;
+    return (sa->key > sb->key) - (sa->key < sb->key);
+}
+
+// Parse "barcode,x,y[,...]" into a spot; tab separators work too. Barcodes
+// are sequences or Visium HD spot ids, which pack without interning.
+static int parse_spot(char *line, double bin_size, spot_t *spot) {
+    size_t bc_len = strcspn(line, ",\t");
+    if (line[bc_len] == '\0') return -1;
+
+    char *end;
+    char *field = line + bc_len + 1;
+    double x = strtod(field, &end);
+    if (end == field || (*end != ',' && *end != '\t')) return -1;
+    field = end + 1;
+    double y = strtod(field, &end);
+    if (end == field || (*end != '\0' && *end != ',' && *end != '\t')) return -1;
+    if (!(x >= 0) || !(y >= 0)) return -1;
+
+    // Non-negative, so truncation is the floor
+    double tile_x = x / bin_size;
+    double tile_y = y / bin_size;
+    if (tile_x >= SPATIAL_MAX_TILES || tile_y >= SPATIAL_MAX_TILES) return -1;
+    if (bc_pack_id(line, bc_len, &spot->key) != 0) return -1;
+    spot->tile = (uint32_t) tile_x << 16 | (uint32_t) tile_y;
+    spot->bucket = (uint32_t) (bc_hash(spot->key) >> 32);
+    return 0;
+}
+
+void destroy_spatial_map(spatial_map_t *map) {
+    if (map) {
+        spatial_tile_t *tile, *tmp;
+        HASH_ITER(hh, map->occupied, tile, tmp) {
+            HASH_DEL(map->occupied, tile);
+            free(tile);
+        }
+        free(map->keys);
+        free(map->tiles);
+        free(map->offsets);
+        free(map);
+    }
+}
+
+spatial_map_t *load_spatial_map(const char *path, double bin_size) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        log_msg("Cannot open file (%s)", ERROR, path);
+        return NULL;
+    }
+
+    spot_t *spots = NULL;
+    uint64_t n_spots = 0;
+    uint64_t capacity = 0;
+    uint64_t line_num = 0;
+    char line[MAX_LINE_LENGTH];
+    int ret = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        // Assuming header and skip it
+        if (line_num++ == 0) continue;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') continue;
+
+        if (n_spots == capacity) {
+            uint64_t new_capacity = capacity ? capacity * 2 : 1 << 20;
+            spot_t *new_spots = realloc(spots, new_capacity * sizeof(spot_t));
+            if (!new_spots || n_spots >= UINT32_MAX) {
+                log_msg("Failed to expand spot table at line %llu", ERROR,
+                        (unsigned long long) line_num);
+                ret = -1;
+                break;
+            }
+            spots = new_spots;
+            capacity = new_capacity;
+        }
+        if (parse_spot(line, bin_size, &spots[n_spots]) != 0) {
+            log_msg("Line %llu of %s: expected barcode,x,y with an A/C/G/T or Visium HD "
+                    "barcode and non-negative coordinates under %d bins per axis", ERROR,
+                    (unsigned long long) line_num, path, SPATIAL_MAX_TILES);
+            ret = -1;
+            break;
+        }
+        n_spots++;
+    }
+    fclose(fp);
+    if (ret == 0 && n_spots == 0) {
+        log_msg("No spots loaded from %s", ERROR, path);
+        ret = -1;
+    }
+    if (ret != 0) {
+        free(spots);
+        return NULL;
+    }
+
+    // Group by bucket; a barcode listed twice must agree with itself
+    qsort(spots, n_spots, sizeof(spot_t), compare_spots);
+    uint64_t n_unique = 0;
+    for (uint64_t i = 0; i < n_spots; i++) {
+        if (n_unique > 0 && spots[n_unique - 1].key == spots[i].key) {
+            if (spots[n_unique - 1].tile != spots[i].tile) {
+                char barcode[32];
+                bc_unpack(spots[i].key, barcode);
+                log_msg("Spot %s is listed in two different tiles", ERROR, barcode);
+                free(spots);
+                return NULL;
+            }
+            continue;
+        }
+        spots[n_unique++] = spots[i];
+    }
+
+    spatial_map_t *map = calloc(1, sizeof(spatial_map_t));
+    if (!map) {
+        log_msg("Failed to allocate spatial map", ERROR);
+        free(spots);
+        return NULL;
+    }
+    map->n_spots = (uint32_t) n_unique;
+
+    // About two spots per bucket
+    map->bucket_bits = 1;
+    while (map->bucket_bits < 31 && (UINT64_C(1) << map->bucket_bits) < n_unique / 2) {
+        map->bucket_bits++;
+    }
+    uint64_t n_buckets = UINT64_C(1) << map->bucket_bits;
+    map->offsets = calloc(n_buckets + 1, sizeof(uint32_t));
+    map->tiles = malloc(n_unique * sizeof(uint32_t));
+    if (!map->offsets || !map->tiles) {
+        log_msg("Failed to allocate spatial map", ERROR);
+        free(spots);
+        destroy_spatial_map(map);
+        return NULL;
+    }
+
+    // Every occupied tile may get an output, so they must fit under ulimit -n
+    uint64_t open_limit = output_file_limit();
+    uint32_t max_x = 0, max_y = 0;
+    for (uint64_t i = 0; i < n_unique; i++) {
+        map->offsets[(spots[i].bucket >> (32 - map->bucket_bits)) + 1]++;
+        map->tiles[i] = spots[i].tile;
+        if (spots[i].tile >> 16 > max_x) max_x = spots[i].tile >> 16;
+        if ((spots[i].tile & 0xFFFF) > max_y) max_y = spots[i].tile & 0xFFFF;
+
+        spatial_tile_t *tile;
+        HASH_FIND(hh, map->occupied, &spots[i].tile, sizeof(uint32_t), tile);
+        if (tile) continue;
+        if (map->n_occupied >= open_limit) {
+            log_msg("Spots occupy more than %llu tiles, more outputs than the open-file limit "
+                    "(ulimit -n) allows; raise --bin-size or ulimit -n", ERROR,
+                    (unsigned long long) open_limit);
+            free(spots);
+            destroy_spatial_map(map);
+            return NULL;
+        }
+        tile = malloc(sizeof(spatial_tile_t));
+        if (!tile) {
+            log_msg("Failed to allocate spatial map", ERROR);
+            free(spots);
+            destroy_spatial_map(map);
+            return NULL;
+        }
+        tile->tile = spots[i].tile;
+        tile->label_id = -1;
+        HASH_ADD(hh, map->occupied, tile, sizeof(uint32_t), tile);
+        map->n_occupied++;
+    }
+    for (uint64_t b = 0; b < n_buckets; b++) {
+        map->offsets[b + 1] += map->offsets[b];
+    }
+    map->n_tiles_x = max_x + 1;
+    map->n_tiles_y = max_y + 1;
+
+    // Compact the keys in place: key i moves from byte 16i to 8i, which
+    // only overwrites rows already copied
+    bc_key_t *keys = (bc_key_t *) spots;
+    for (uint64_t i = 0; i < n_unique; i++) {
+        keys[i] = spots[i].key;
+    }
+    map->keys = realloc(keys, n_unique * sizeof(bc_key_t));
+    if (!map->keys) map->keys = keys;
+
+    log_msg("Loaded %u spots in %u occupied tiles of %u x %u (%.1f MB)", INFO, map->n_spots,
+            map->n_occupied, map->n_tiles_x, map->n_tiles_y,
+            (n_unique * (sizeof(bc_key_t) + sizeof(uint32_t)) +
+             (n_buckets + 1) * sizeof(uint32_t)) / (1024.0 * 1024.0));
+    return map;
+}
+
+int split_spatial(samFile *fp, sam_hdr_t *header, label_registry_t *registry,
+                  const spatial_map_t *map, tag_reader_t *reader, const char *prefix,
+                  int64_t mapq_thres) {
+    read_batch_t *batch = create_read_batch();
+    if (!batch) return -1;
+
+    enum location cb_loc = reader->cb_meta->location;
+    char this_CB[CB_LENGTH];
+    bc_key_t keys[READ_BATCH_SIZE];
+    uint32_t buckets[READ_BATCH_SIZE];
+    int pending[READ_BATCH_SIZE];
+    uint64_t written = 0;
+    uint64_t outside = 0;
+    int read_stat = -1;
+    int ret = 0;
+
+    while (ret == 0 && fill_read_batch(fp, header, batch, &read_stat) > 0) {
+        // Stage 1: extract barcodes and prefetch their bucket offsets
+        int n_pending = 0;
+        for (int i = 0; i < batch->count; i++) {
+            bam1_t *read = batch->reads[i];
+            if (read->core.qual < mapq_thres) continue;
+            if (extract_CB_key(read, reader, this_CB, cb_loc, &keys[i]) != 0) continue;
+            buckets[i] = spot_bucket(map, keys[i]);
+            __builtin_prefetch(&map->offsets[buckets[i]]);
+            pending[n_pending++] = i;
+        }
+
+        // Stage 2: prefetch the first key of each bucket
+        for (int j = 0; j < n_pending; j++) {
+            __builtin_prefetch(&map->keys[map->offsets[buckets[pending[j]]]]);
+        }
+
+        // Stage 3: resolve tiles and write in input order
+        for (int j = 0; j < n_pending; j++) {
+            int i = pending[j];
+            int64_t tile = find_spot_tile(map, keys[i], buckets[i]);
+            if (tile < 0) {
+                outside++;
+                continue;
+            }
+
+            // Loading registered every occupied tile; outputs are created
+            // when their first read arrives
+            uint32_t tile_key = (uint32_t) tile;
+            spatial_tile_t *occupied;
+            HASH_FIND(hh, map->occupied, &tile_key, sizeof(uint32_t), occupied);
+            if (occupied->label_id < 0) {
+                char label[64];
+                snprintf(label, sizeof(label), "tile_%u_%u", tile_key >> 16, tile_key & 0xFFFF);
+                occupied->label_id = open_label_output(registry, label, prefix, header);
+                if (occupied->label_id < 0) {
+                    ret = -1;
+                    break;
+                }
+            }
+            if (label_dump(registry, (uint32_t) occupied->label_id, header,
+                           batch->reads[i]) != 0) {
+                ret = -1;
+                break;
+            }
+            written++;
+        }
+    }
+    if (ret == 0 && read_stat < -1) {
+        log_msg("Failed to read input BAM", ERROR);
+        ret = -1;
+    }
+
+    log_msg("Wrote %llu reads into %u tiles; %llu reads had barcodes outside the map", INFO,
+            (unsigned long long) written, registry->count, (unsigned long long) outside);
+
+    destroy_read_batch(batch);
+    return ret;
+}
@@ -0,0 +1,72 @@
+//
+// Spatial binning: split reads into tiles of a spot coordinate map
+//
+// Spatial arrays have tens of millions of spot barcodes, too many for a
+// cb2fp per barcode. The barcode -> (x, y) table is instead loaded into
+// flat arrays: packed barcodes grouped by the top bits of their hash, the
+// tile each falls in, and one offset per hash bucket (about 2 spots per
+// bucket), about 14 bytes per spot in all. A lookup reads the bucket's
+// offsets and scans its few keys. The tile is computed once at load from
+// the coordinates and the bin size. Only occupied tiles are kept, in a hash
+// checked against the open-file limit at load, and each tile's output is
+// created the first time a read lands in it.
+
+#ifndef SCBAMSPLIT_SPATIAL_H
+#define SCBAMSPLIT_SPATIAL_H
+
+// Standard library includes
+#include <stdint.h>
+
+// External library includes
+#include "htslib/sam.h"
+#include "uthash.h"
+
+// Project includes
+#include "hash.h"
+#include "sort.h"
+
+// Tiles per axis are packed into 16 bits each
+#define SPATIAL_MAX_TILES 65536
+
+// A tile holding at least one spot
+typedef struct {
+    uint32_t tile;                        /* key: x << 16 | y */
+    int32_t label_id;                     /* -1 until its first read arrives */
+    UT_hash_handle hh;
+} spatial_tile_t;
+
+typedef struct {
+    bc_key_t *keys;                       /* spot barcodes, grouped by hash bucket */
+    uint32_t *tiles;                      /* tile of each spot, x << 16 | y */
+    uint32_t *offsets;                    /* first spot of each bucket, one extra at the end */
+    uint32_t n_spots;
+    uint32_t bucket_bits;                 /* buckets are the top bits of bc_hash() */
+    uint32_t n_tiles_x;                   /* grid extent */
+    uint32_t n_tiles_y;
+    spatial_tile_t *occupied;             /* tile -> output */
+    uint32_t n_occupied;
+} spatial_map_t;
+
+// Load a "barcode,x,y" table (comma or tab separated, header line first).
+// Fails if the spots occupy more tiles than outputs fit under ulimit -n.
+spatial_map_t *load_spatial_map(const char *path, double bin_size);
+void destroy_spatial_map(spatial_map_t *map);
+
+static inline uint32_t spot_bucket(const spatial_map_t *map, bc_key_t key) {
+    return (uint32_t) (bc_hash(key) >> (64 - map->bucket_bits));
+}
+
+// Tile of a packed barcode, or -1 if it is not in the map
+static inline int64_t find_spot_tile(const spatial_map_t *map, bc_key_t key, uint32_t bucket) {
+    for (uint32_t i = map->offsets[bucket]; i < map->offsets[bucket + 1]; i++) {
+        if (map->keys[i] == key) return map->tiles[i];
+    }
+    return -1;
+}
+
+// Stream the input once, writing each read to <prefix>tile_X_Y.bam
+int split_spatial(samFile *fp, sam_hdr_t *header, label_registry_t *registry,
+                  const spatial_map_t *map, tag_reader_t *reader, const char *prefix,
+                  int64_t mapq_thres);
+
+#endif //SCBAMSPLIT_SPATIAL_H
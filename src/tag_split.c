@@ -0,0 +1,213 @@
+//
+// Metadata-free splitting by the value of an aux tag
+//
+
+#include "tag_split.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+#include "sort.h"
+
+// The value as text: Z values in place, characters and integers formatted
+// into buf. NULL for types that make no sense as a label.
+static const char *tag_value_text(const uint8_t *s, const uint8_t *end,
+                                  char *buf, size_t size, size_t *len) {
+    switch (*s) {
+        case 'Z':
+            {
+                const uint8_t *nul = memchr(s + 1, '\0', end - (s + 1));
+                if (!nul) return NULL;
+                *len = nul - (s + 1);
+                return (const char *) (s + 1);
+            }
+        case 'A':
+            buf[0] = (char) s[1];
+            buf[1] = '\0';
+            *len = 1;
+            return buf;
+        case 'c': case 'C': case 's': case 'S': case 'i': case 'I':
+            *len = (size_t) snprintf(buf, size, "%lld", (long long) bam_aux2i(s));
+            return buf;
+        default:
+            return NULL;
+    }
+}
+
+static uint64_t value_hash(const char *value, size_t len) {
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) value[i]) * UINT64_C(0x100000001b3);
+    }
+    return bc_hash(h);
+}
+
+// Output of a sanitized label, opened the first time it is asked for.
+// Values that sanitize alike, or to an overflow bucket's name, share a file.
+static int32_t label_output(tag_splitter_t *splitter, const char *label, bool *created) {
+    tag_label_t *entry;
+    HASH_FIND_STR(splitter->labels, label, entry);
+    *created = !entry;
+    if (entry) return (int32_t) entry->label_id;
+
+    entry = calloc(1, sizeof(tag_label_t));
+    if (!entry || !(entry->label = strdup(label))) {
+        log_msg("Failed to allocate tag label", ERROR);
+        free(entry);
+        return -1;
+    }
+    int32_t label_id = open_label_output(splitter->registry, label, splitter->prefix,
+                                         splitter->header);
+    if (label_id < 0) {
+        free(entry->label);
+        free(entry);
+        return -1;
+    }
+    entry->label_id = (uint32_t) label_id;
+    HASH_ADD_KEYPTR(hh, splitter->labels, entry->label, strlen(entry->label), entry);
+    return label_id;
+}
+
+// Output for a value seen for the first time: its own until the cap is
+// reached, then the overflow bucket its hash falls in
+static int32_t label_for_new_value(tag_splitter_t *splitter, const char *value, size_t len) {
+    char label[sizeof(splitter->registry->entries[0].label)];
+    bool created;
+
+    if (splitter->n_values < splitter->max_labels) {
+        size_t n = len < sizeof(label) - 1 ? len : sizeof(label) - 1;
+        memcpy(label, value, n);
+        label[n] = '\0';
+        if (n == 0) strcpy(label, "_empty");
+        if (sanitize_label(label) || n < len) {
+            log_msg("Tag value '%.*s' written as label '%s'", WARNING, (int) len, value, label);
+        }
+        int32_t label_id = label_output(splitter, label, &created);
+        if (created) splitter->n_values++;
+        return label_id;
+    }
+
+    uint32_t bucket = (uint32_t) (value_hash(value, len) % BY_TAG_OVERFLOW_BUCKETS);
+    if (splitter->overflow_values++ == 0) {
+        log_msg("More than %u values of %s; further values go to %d overflow outputs",
+                WARNING, splitter->max_labels, splitter->tag, BY_TAG_OVERFLOW_BUCKETS);
+    }
+    if (splitter->buckets[bucket] < 0) {
+        snprintf(label, sizeof(label), "_overflow_%02u", bucket);
+        splitter->buckets[bucket] = label_output(splitter, label, &created);
+    }
+    return splitter->buckets[bucket];
+}
+
+// Label id for a read's tag value, registering the value when it is new
+static int32_t lookup_value(tag_splitter_t *splitter, const char *value, size_t len) {
+    tag_value_t *entry;
+    HASH_FIND(hh, splitter->values, value, len, entry);
+    if (entry) return (int32_t) entry->label_id;
+
+    int32_t label_id = label_for_new_value(splitter, value, len);
+    if (label_id < 0) return -1;
+
+    entry = calloc(1, sizeof(tag_value_t));
+    if (!entry || !(entry->value = malloc(len + 1))) {
+        log_msg("Failed to allocate tag value", ERROR);
+        free(entry);
+        return -1;
+    }
+    memcpy(entry->value, value, len);
+    entry->value[len] = '\0';
+    entry->label_id = (uint32_t) label_id;
+    HASH_ADD_KEYPTR(hh, splitter->values, entry->value, len, entry);
+    return label_id;
+}
+
+static void destroy_tag_values(tag_splitter_t *splitter) {
+    tag_value_t *entry, *tmp;
+    HASH_ITER(hh, splitter->values, entry, tmp) {
+        HASH_DEL(splitter->values, entry);
+        free(entry->value);
+        free(entry);
+    }
+    tag_label_t *label, *next;
+    HASH_ITER(hh, splitter->labels, label, next) {
+        HASH_DEL(splitter->labels, label);
+        free(label->label);
+        free(label);
+    }
+}
+
+int split_by_tag(samFile *fp, sam_hdr_t *header, label_registry_t *registry,
+                 const char *tag, const char *prefix, uint32_t max_labels,
+                 int64_t mapq_thres) {
+    // Every label and overflow bucket may end up with an open output
+    uint64_t open_limit = output_file_limit();
+    if (open_limit <= BY_TAG_OVERFLOW_BUCKETS) {
+        log_msg("The open-file limit (ulimit -n) leaves room for %llu outputs; --by-tag needs "
+                "more than %d", ERROR, (unsigned long long) open_limit, BY_TAG_OVERFLOW_BUCKETS);
+        return -1;
+    }
+    if ((uint64_t) max_labels + BY_TAG_OVERFLOW_BUCKETS > open_limit) {
+        max_labels = (uint32_t) (open_limit - BY_TAG_OVERFLOW_BUCKETS);
+        log_msg("Lowering --max-labels to %u to stay under the open-file limit (ulimit -n)",
+                WARNING, max_labels);
+    }
+
+    read_batch_t *batch = create_read_batch();
+    if (!batch) return -1;
+
+    tag_splitter_t splitter = {
+        .prefix = prefix,
+        .header = header,
+        .registry = registry,
+        .values = NULL,
+        .labels = NULL,
+        .max_labels = max_labels,
+        .n_values = 0,
+        .overflow_values = 0
+    };
+    memcpy(splitter.tag, tag, 2);
+    splitter.tag[2] = '\0';
+    for (int b = 0; b < BY_TAG_OVERFLOW_BUCKETS; b++) splitter.buckets[b] = -1;
+
+    char buf[32];
+    uint64_t untagged = 0;
+    uint64_t written = 0;
+    int read_stat = -1;
+    int ret = 0;
+
+    log_msg("Splitting by %s values", INFO, splitter.tag);
+    while (ret == 0 && fill_read_batch(fp, header, batch, &read_stat) > 0) {
+        for (int i = 0; i < batch->count; i++) {
+            bam1_t *read = batch->reads[i];
+            if (read->core.qual < mapq_thres) continue;
+
+            const uint8_t *s = bam_aux_get(read, splitter.tag);
+            size_t len = 0;
+            const char *value = s ? tag_value_text(s, bam_get_aux(read) + bam_get_l_aux(read),
+                                                   buf, sizeof(buf), &len) : NULL;
+            if (!value) {
+                untagged++;
+                continue;
+            }
+            int32_t label_id = lookup_value(&splitter, value, len);
+            if (label_id < 0 || label_dump(registry, (uint32_t) label_id, header, read) != 0) {
+                ret = -1;
+                break;
+            }
+            written++;
+        }
+    }
+    if (ret == 0 && read_stat < -1) {
+        log_msg("Failed to read input BAM", ERROR);
+        ret = -1;
+    }
+
+    log_msg("Wrote %llu reads for %u values of %s (%llu more values bucketed); "
+            "%llu reads without it", INFO, (unsigned long long) written, splitter.n_values,
+            splitter.tag, (unsigned long long) splitter.overflow_values,
+            (unsigned long long) untagged);
+
+    destroy_tag_values(&splitter);
+    destroy_read_batch(batch);
+    return ret;
+}
@@ -0,0 +1,60 @@
+//
+// Metadata-free splitting by the value of an aux tag
+//
+// Every distinct value of the tag (a read group, hashtag call, gene...)
+// becomes a label with its own output, created the first time the value is
+// seen, so no metadata file and no discovery pass are needed. Past a cap on
+// the number of labels, further values are hashed into a fixed set of
+// overflow buckets so the number of open files stays bounded.
+
+#ifndef SCBAMSPLIT_TAG_SPLIT_H
+#define SCBAMSPLIT_TAG_SPLIT_H
+
+// Standard library includes
+#include <stdint.h>
+
+// External library includes
+#include "htslib/sam.h"
+#include "uthash.h"
+
+// Project includes
+#include "hash.h"
+
+#define BY_TAG_DEFAULT_MAX_LABELS 256
+#define BY_TAG_OVERFLOW_BUCKETS 16
+
+// A tag value seen so far and the label it writes to
+typedef struct {
+    char *value;                          /* key: raw tag value */
+    uint32_t label_id;
+    UT_hash_handle hh;
+} tag_value_t;
+
+// A sanitized label with an output; values that sanitize alike share it
+typedef struct {
+    char *label;                          /* key: label as given to the registry */
+    uint32_t label_id;
+    UT_hash_handle hh;
+} tag_label_t;
+
+typedef struct {
+    char tag[3];                          /* aux tag to split on */
+    const char *prefix;                   /* output path prefix */
+    sam_hdr_t *header;                    /* written to each new output */
+    label_registry_t *registry;           /* owns the outputs */
+    tag_value_t *values;                  /* value -> label id */
+    tag_label_t *labels;                  /* sanitized label -> label id */
+    uint32_t max_labels;                  /* values given their own output */
+    uint32_t n_values;                    /* values with their own output */
+    int32_t buckets[BY_TAG_OVERFLOW_BUCKETS]; /* overflow label ids, -1 until used */
+    uint64_t overflow_values;             /* distinct values bucketed */
+} tag_splitter_t;
+
+// Stream the input once, writing each read to the output of its tag value.
+// Reads without the tag are skipped. max_labels is lowered if the outputs
+// would not fit under the open-file limit.
+int split_by_tag(samFile *fp, sam_hdr_t *header, label_registry_t *registry,
+                 const char *tag, const char *prefix, uint32_t max_labels,
+                 int64_t mapq_thres);
+
+#endif //SCBAMSPLIT_TAG_SPLIT_H
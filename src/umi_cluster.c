@@ -0,0 +1,211 @@
+//
+// UMI clustering within a (CB, coordinate, strand) group
+//
+
+#include "umi_cluster.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define UNASSIGNED UINT32_MAX
+
+// One half of a UMI, used to bucket candidate neighbors
+typedef struct {
+    uint64_t half;
+    uint32_t node;
+} half_key_t;
+
+// Directed edge between two nodes of a group
+typedef struct {
+    uint32_t from;
+    uint32_t to;
+} umi_edge_t;
+
+struct umi_workspace {
+    umi_node_t *nodes;
+    uint32_t nodes_cap;
+    umi_edge_t *edges;          // directed edges, unordered
+    uint64_t n_edges;
+    uint64_t edges_cap;
+    uint32_t *adj_offset;       // CSR adjacency built from the edges
+    uint32_t *adj;
+    uint32_t *order;            // nodes by descending count
+    uint32_t *stack;
+    half_key_t *halves;
+    uint32_t scratch_cap;
+};
+
+// Grow *ptr to hold at least n elements of size elem
+static int grow(void **ptr, uint64_t *cap, uint64_t n, size_t elem) {
+    if (n <= *cap) return 0;
+    uint64_t new_cap = *cap ? *cap : 64;
+    while (new_cap < n) new_cap *= 2;
+    void *p = realloc(*ptr, new_cap * elem);
+    if (!p) return -1;
+    *ptr = p;
+    *cap = new_cap;
+    return 0;
+}
+
+umi_workspace_t *create_umi_workspace(void) {
+    return calloc(1, sizeof(umi_workspace_t));
+}
+
+void destroy_umi_workspace(umi_workspace_t *ws) {
+    if (!ws) return;
+    free(ws->nodes);
+    free(ws->edges);
+    free(ws->adj_offset);
+    free(ws->adj);
+    free(ws->order);
+    free(ws->stack);
+    free(ws->halves);
+    free(ws);
+}
+
+umi_node_t *umi_workspace_nodes(umi_workspace_t *ws, uint32_t n) {
+    uint64_t cap = ws->nodes_cap;
+    if (grow((void **) &ws->nodes, &cap, n, sizeof(umi_node_t)) != 0) return NULL;
+    ws->nodes_cap = (uint32_t) cap;
+    return ws->nodes;
+}
+
+// Per-node scratch arrays sized for n nodes
+static int reserve_scratch(umi_workspace_t *ws, uint32_t n) {
+    if (n <= ws->scratch_cap) return 0;
+    uint32_t cap = ws->scratch_cap ? ws->scratch_cap : 64;
+    while (cap < n) cap *= 2;
+
+    uint32_t *adj_offset = realloc(ws->adj_offset, (cap + 1) * sizeof(uint32_t));
+    if (!adj_offset) return -1;
+    ws->adj_offset = adj_offset;
+    uint32_t *order = realloc(ws->order, cap * sizeof(uint32_t));
+    if (!order) return -1;
+    ws->order = order;
+    uint32_t *stack = realloc(ws->stack, cap * sizeof(uint32_t));
+    if (!stack) return -1;
+    ws->stack = stack;
+    half_key_t *halves = realloc(ws->halves, cap * sizeof(half_key_t));
+    if (!halves) return -1;
+    ws->halves = halves;
+
+    ws->scratch_cap = cap;
+    return 0;
+}
+
+static int add_edge(umi_workspace_t *ws, uint32_t from, uint32_t to) {
+    if (grow((void **) &ws->edges, &ws->edges_cap, ws->n_edges + 1, sizeof(umi_edge_t)) != 0) {
+        return -1;
+    }
+    ws->edges[ws->n_edges].from = from;
+    ws->edges[ws->n_edges].to = to;
+    ws->n_edges++;
+    return 0;
+}
+
+// Record directional edges between two candidate nodes
+static int link_pair(umi_workspace_t *ws, umi_node_t *nodes, uint32_t a, uint32_t b) {
+    if (bc_hamming(nodes[a].umi, nodes[b].umi) != 1) return 0;
+    if (nodes[a].count >= 2 * nodes[b].count - 1 && add_edge(ws, a, b) != 0) return -1;
+    if (nodes[b].count >= 2 * nodes[a].count - 1 && add_edge(ws, b, a) != 0) return -1;
+    return 0;
+}
+
+static int compare_half_keys(const void *a, const void *b) {
+    const half_key_t *ka = (const half_key_t *) a;
+    const half_key_t *kb = (const half_key_t *) b;
+    if (ka->half != kb->half) return (ka->half < kb->half) ? -1 : 1;
+    return (ka->node < kb->node) ? -1 : (ka->node > kb->node);
+}
+
+// Two UMIs one mismatch apart agree exactly on at least one half, so only
+// nodes sharing a half need comparing. Each half is keyed with its side
+// and the UMI length so the two passes never mix.
+static int link_bucketed(umi_workspace_t *ws, umi_node_t *nodes, uint32_t n) {
+    for (uint32_t side = 0; side < 2; side++) {
+        for (uint32_t i = 0; i < n; i++) {
+            bc_key_t umi = nodes[i].umi;
+            uint32_t split = 2 * (BC_LENGTH(umi) / 2);
+            uint64_t lo_mask = (UINT64_C(1) << split) - 1;
+            uint64_t half = side == 0 ? (umi & lo_mask) : (BC_BASES(umi) >> split);
+            ws->halves[i].half = (half << 8) | ((uint64_t) BC_LENGTH(umi) << 1) | side;
+            ws->halves[i].node = i;
+        }
+        qsort(ws->halves, n, sizeof(half_key_t), compare_half_keys);
+
+        uint32_t run_start = 0;
+        for (uint32_t i = 1; i <= n; i++) {
+            if (i < n && ws->halves[i].half == ws->halves[run_start].half) continue;
+            for (uint32_t a = run_start; a < i; a++) {
+                for (uint32_t b = a + 1; b < i; b++) {
+                    if (link_pair(ws, nodes, ws->halves[a].node, ws->halves[b].node) != 0) {
+                        return -1;
+                    }
+                }
+            }
+            run_start = i;
+        }
+    }
+    return 0;
+}
+
+int cluster_umis_directional(umi_workspace_t *ws, umi_node_t *nodes, uint32_t n) {
+    if (reserve_scratch(ws, n) != 0) return -1;
+    ws->n_edges = 0;
+
+    // Find every one-mismatch pair and keep the directional edges
+    if (n <= UMI_PAIRWISE_LIMIT) {
+        for (uint32_t a = 0; a < n; a++) {
+            for (uint32_t b = a + 1; b < n; b++) {
+                if (link_pair(ws, nodes, a, b) != 0) return -1;
+            }
+        }
+    } else if (link_bucketed(ws, nodes, n) != 0) {
+        return -1;
+    }
+
+    // Build CSR adjacency
+    uint64_t adj_cap = ws->n_edges;
+    uint32_t *adj = realloc(ws->adj, (adj_cap ? adj_cap : 1) * sizeof(uint32_t));
+    if (!adj) return -1;
+    ws->adj = adj;
+    memset(ws->adj_offset, 0, (n + 1) * sizeof(uint32_t));
+    for (uint64_t e = 0; e < ws->n_edges; e++) ws->adj_offset[ws->edges[e].from + 1]++;
+    for (uint32_t i = 0; i < n; i++) ws->adj_offset[i + 1] += ws->adj_offset[i];
+    // The stack array doubles as per-node insertion cursors here
+    memset(ws->stack, 0, n * sizeof(uint32_t));
+    for (uint64_t e = 0; e < ws->n_edges; e++) {
+        uint32_t from = ws->edges[e].from;
+        ws->adj[ws->adj_offset[from] + ws->stack[from]++] = ws->edges[e].to;
+    }
+
+    // Order nodes by descending count. Nodes arrive sorted by UMI, so the
+    // index tie-break keeps the result deterministic.
+    for (uint32_t i = 0; i < n; i++) {
+        ws->halves[i].half = ((uint64_t)(UINT32_MAX - nodes[i].count) << 32) | i;
+        ws->halves[i].node = i;
+        nodes[i].cluster = UNASSIGNED;
+    }
+    qsort(ws->halves, n, sizeof(half_key_t), compare_half_keys);
+    for (uint32_t i = 0; i < n; i++) ws->order[i] = ws->halves[i].node;
+
+    // Walk components from the most abundant unassigned UMI
+    for (uint32_t k = 0; k < n; k++) {
+        uint32_t root = ws->order[k];
+        if (nodes[root].cluster != UNASSIGNED) continue;
+
+        nodes[root].cluster = root;
+        uint32_t top = 0;
+        ws->stack[top++] = root;
+        while (top > 0) {
+            uint32_t u = ws->stack[--top];
+            for (uint32_t e = ws->adj_offset[u]; e < ws->adj_offset[u + 1]; e++) {
+                uint32_t v = ws->adj[e];
+                if (nodes[v].cluster == UNASSIGNED) {
+                    nodes[v].cluster = root;
+                    ws->stack[top++] = v;
+                }
+            }
+        }
+    }
+    return 0;
+}
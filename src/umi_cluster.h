@@ -0,0 +1,48 @@
+//
+// UMI clustering within a (CB, coordinate, strand) group
+//
+// Collapses UMIs that differ by one base into a single molecule using the
+// directional method of UMI-tools: an edge a -> b exists when the UMIs are
+// one mismatch apart and count(a) >= 2 * count(b) - 1, and each connected
+// component reached from the most abundant UMI is one molecule.
+
+#ifndef SCBAMSPLIT_UMI_CLUSTER_H
+#define SCBAMSPLIT_UMI_CLUSTER_H
+
+// Standard library includes
+#include <stdint.h>
+
+// Project includes
+#include "barcode.h"
+
+// How UMIs within a position group are collapsed
+typedef enum {
+    UMI_EXACT,              // identical UMIs only
+    UMI_DIRECTIONAL         // UMI-tools directional clustering
+} umi_method_t;
+
+// One distinct UMI in a group
+typedef struct {
+    bc_key_t umi;           // 2-bit packed UMI
+    uint32_t count;         // reads carrying this UMI
+    uint32_t cluster;       // set by clustering: index of the node's cluster root
+    uint64_t first_read;    // caller data: position of the best read for this UMI
+} umi_node_t;
+
+// Groups with more distinct UMIs than this find neighbors through half-UMI
+// buckets instead of comparing every pair
+#define UMI_PAIRWISE_LIMIT 32
+
+// Reusable scratch space so clustering does not allocate per group
+typedef struct umi_workspace umi_workspace_t;
+
+umi_workspace_t *create_umi_workspace(void);
+void destroy_umi_workspace(umi_workspace_t *ws);
+
+// Node array with room for n entries (owned by the workspace)
+umi_node_t *umi_workspace_nodes(umi_workspace_t *ws, uint32_t n);
+
+// Cluster n nodes; returns 0 on success, -1 on allocation failure
+int cluster_umis_directional(umi_workspace_t *ws, umi_node_t *nodes, uint32_t n);
+
+#endif //SCBAMSPLIT_UMI_CLUSTER_H
@@ -3,6 +3,9 @@
 //
 
 #include "utils.h"
+#include "downsample.h"
+#include "cb_sort.h"
+#include "bam_encode.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -10,6 +13,7 @@
 #include <errno.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 
 void show_global_usage() {
     fprintf(stderr, "Program: scbamop (Single-cell BAM operations toolkit)\n");
@@ -19,6 +23,7 @@ void show_global_usage() {
     fprintf(stderr, "\n");
     fprintf(stderr, "Commands:\n");
     fprintf(stderr, "  split    Split BAM file by cell barcodes with optional deduplication\n");
+    fprintf(stderr, "  tag      Write one BAM with each read's label in an aux tag\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Use 'scbamop <command> --help' for command-specific help\n");
     fprintf(stderr, "\n");
@@ -31,30 +36,80 @@ void show_split_usage() {
     fprintf(stderr, "\n");
     fprintf(stderr, "Required arguments:\n");
     fprintf(stderr, "  -f, --file FILE        Input BAM file path\n");
-    fprintf(stderr, "  -m, --meta FILE        Metadata file with cell barcode assignments\n");
+    fprintf(stderr, "  -m, --meta FILE        Metadata file with cell barcode assignments; repeat\n");
+    fprintf(stderr, "                         or comma-separate to split by several in one pass\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Optional arguments:\n");
     fprintf(stderr, "  -o, --output DIR       Output directory prefix (default: ./)\n");
     fprintf(stderr, "  -q, --mapq INT         MAPQ threshold (default: 0)\n");
     fprintf(stderr, "  -d, --dedup            Enable UMI-based deduplication\n");
+    fprintf(stderr, "  -U, --umi-method STR   UMI collapsing with -d: exact or directional (default: exact)\n");
+    fprintf(stderr, "  -K, --dedup-key STR    Molecule key with -d: position, gene (GX/GN) or ends (no UMI) (default: position)\n");
+    fprintf(stderr, "  --unannotated STR      With -K gene, reads without a gene: drop or position (default: drop)\n");
+    fprintf(stderr, "  -M, --mark-duplicates  With -d, keep duplicates flagged 0x400; kept reads get DS:i (molecule reads)\n");
+    fprintf(stderr, "  -x, --count-matrix     With -d, write a cell x gene UMI matrix (GX/GN tags) per label\n");
+    fprintf(stderr, "  -C, --coverage         Write a bedGraph coverage track per label (sorted input)\n");
+    fprintf(stderr, "  -S, --sort-cb          Write each label sorted by cell barcode, then coordinate\n");
+    fprintf(stderr, "  --sort-memory SIZE     Buffer budget for -S across labels, K/M/G suffix (default: 1G)\n");
+    fprintf(stderr, "  -F, --fragments        scATAC: write tabix-indexed <label>.fragments.tsv.gz instead of BAMs\n");
+    fprintf(stderr, "  --by-tag XX            Split by the values of tag XX instead of -m metadata\n");
+    fprintf(stderr, "  --max-labels N         With --by-tag, values with their own output (default: 256)\n");
+    fprintf(stderr, "  --spatial FILE         Split by tiles of a barcode,x,y spot table instead of -m\n");
+    fprintf(stderr, "  --bin-size N           With --spatial, tile width in coordinate units\n");
+    fprintf(stderr, "  --call-cells knee|N    With -d, call cells from UMI counts instead of -m\n");
+    fprintf(stderr, "  --per-cell             With --call-cells, one output per cell (default: cells.bam)\n");
+    fprintf(stderr, "  -Q, --qc PREFIX        Write per-barcode and per-label QC tables to PREFIX.*.tsv\n");
+    fprintf(stderr, "  --downsample-reads N   Without -d, write at most N reads per label; reads the\n");
+    fprintf(stderr, "                         input twice, so it must be a BAM file (not stdin or a pipe)\n");
+    fprintf(stderr, "  --downsample-umis N    With -d, write at most N molecules per label\n");
+    fprintf(stderr, "  --downsample-seed INT  Seed of the read-name hash used for downsampling (default: 0)\n");
+    fprintf(stderr, "  -c, --correct          Correct cell barcodes one mismatch from the metadata\n");
     fprintf(stderr, "  -b, --cbc-location STR Cell barcode tag name or field number (default: CB)\n");
+    fprintf(stderr, "                         or segments joined by '+' (e.g. B1+B2+B3), concatenated\n");
     fprintf(stderr, "  -u, --umi-location STR UMI tag name or field number (default: UB)\n");
     fprintf(stderr, "  -v, --verbose [INT]    Verbosity level: -v (INFO), -v 5 or --verbose=5 (DEBUG)\n");
     fprintf(stderr, "  -h, --help             Show this help message\n");
     fprintf(stderr, "\n");
 }
 
-int8_t read_dump(cb2fp *direct_map, char *this_CB, 
-                sam_hdr_t *header, bam1_t *read) {
-    cb2fp *entry;
-    
-    HASH_FIND_STR(direct_map, this_CB, entry);
-    if (entry == NULL) {
-        // Cell barcode not found in metadata, skip
-        return 0;
+void show_tag_usage() {
+    fprintf(stderr, "Usage: scbamop tag -f FILE -m FILE [options]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Write one BAM file with each read's metadata label in an aux tag\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Required arguments:\n");
+    fprintf(stderr, "  -f, --file FILE        Input BAM file path\n");
+    fprintf(stderr, "  -m, --meta FILE        Metadata file with cell barcode assignments; repeat\n");
+    fprintf(stderr, "                         or comma-separate to combine several\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Optional arguments:\n");
+    fprintf(stderr, "  -o, --output FILE      Output BAM file, - for stdout (default: -)\n");
+    fprintf(stderr, "  -t, --label-tag STR    Aux tag for the label (default: XL)\n");
+    fprintf(stderr, "  -k, --keep-unassigned  Also write reads whose barcode has no label\n");
+    fprintf(stderr, "  -q, --mapq INT         MAPQ threshold (default: 0)\n");
+    fprintf(stderr, "  -Q, --qc PREFIX        Write per-barcode and per-label QC tables to PREFIX.*.tsv\n");
+    fprintf(stderr, "  -d, --dedup            Flag UMI duplicates in the XD tag (1 = duplicate)\n");
+    fprintf(stderr, "  -U, --umi-method STR   UMI collapsing with -d: exact or directional (default: exact)\n");
+    fprintf(stderr, "  -K, --dedup-key STR    Molecule key with -d: position, gene (GX/GN) or ends (no UMI) (default: position)\n");
+    fprintf(stderr, "  --unannotated STR      With -K gene, reads without a gene: drop or position (default: drop)\n");
+    fprintf(stderr, "  -M, --mark-duplicates  With -d, also set 0x400 on duplicates and DS:i on kept reads\n");
+    fprintf(stderr, "  -c, --correct          Correct cell barcodes one mismatch from the metadata\n");
+    fprintf(stderr, "  -b, --cbc-location STR Cell barcode tag name or field number (default: CB)\n");
+    fprintf(stderr, "                         or segments joined by '+' (e.g. B1+B2+B3), concatenated\n");
+    fprintf(stderr, "  -u, --umi-location STR UMI tag name or field number (default: UB)\n");
+    fprintf(stderr, "  -v, --verbose [INT]    Verbosity level: -v (INFO), -v 5 or --verbose=5 (DEBUG)\n");
+    fprintf(stderr, "  -h, --help             Show this help message\n");
+    fprintf(stderr, "\n");
+}
+
+int8_t label_dump(label_registry_t *registry, uint32_t label_id,
+                 sam_hdr_t *header, bam1_t *read) {
+    if (label_id >= registry->count) {
+        log_msg("Label id %u out of range", ERROR, label_id);
+        return 1;
     }
     
-    int write_stat = sam_write1(entry->fp, header, read);
+    int write_stat = sam_write1(registry->entries[label_id].fp, header, read);
     if (write_stat < 0) {
         log_msg("Failed to write read to output file", ERROR);
         return 1;
@@ -63,6 +118,164 @@ int8_t read_dump(cb2fp *direct_map, char *this_CB,
     return 0;
 }
 
+// Tag mode: write a read to the single output with its label(s) in an aux
+// tag, comma-separated if the barcode is assigned to several
+static int8_t tagged_dump(label_registry_t *registry, const cb2fp *barcode,
+                          sam_hdr_t *header, bam1_t *read) {
+    const char *labels;
+    if (barcode->n_labels == 1) {
+        labels = registry->entries[barcode->label_ids[0]].label;
+    } else {
+        registry->scratch.l = 0;
+        for (uint32_t i = 0; i < barcode->n_labels; i++) {
+            if (i > 0) kputc(',', &registry->scratch);
+            kputs(registry->entries[barcode->label_ids[i]].label, &registry->scratch);
+        }
+        labels = registry->scratch.s;
+    }
+
+    if (bam_aux_update_str(read, registry->label_tag, strlen(labels) + 1, labels) < 0 ||
+        sam_write1(registry->tagged, header, read) < 0) {
+        log_msg("Failed to write tagged read", ERROR);
+        return 1;
+    }
+    return 0;
+}
+
+// Tag mode with --keep-unassigned: pass a read with no label through untagged
+int8_t unassigned_dump(label_registry_t *registry, sam_hdr_t *header, bam1_t *read) {
+    if (!registry->tagged || !registry->keep_unassigned) return 0;
+    if (sam_write1(registry->tagged, header, read) < 0) {
+        log_msg("Failed to write unassigned read", ERROR);
+        return 1;
+    }
+    return 0;
+}
+
+// Write a read that went through deduplication. Tag mode records the
+// decision (1 = duplicate) in the dedup tag; split mode writes it as is.
+int8_t dedup_dump(label_registry_t *registry, const cb2fp *barcode,
+                  sam_hdr_t *header, bam1_t *read, bool duplicate) {
+    if (!registry->tagged) {
+        return barcode_dump(registry, barcode, header, read);
+    }
+    if (bam_aux_update_int(read, registry->dedup_tag, duplicate ? 1 : 0) < 0) {
+        log_msg("Failed to set deduplication tag", ERROR);
+        return 1;
+    }
+    return tagged_dump(registry, barcode, header, read);
+}
+
+// Write a read to each of the given labels. Reads going to several labels
+// are serialized once and the same bytes appended to each output.
+static int8_t fan_out_dump(label_registry_t *registry, const uint32_t *label_ids,
+                           uint32_t n_labels, sam_hdr_t *header, bam1_t *read) {
+    bool encoded = encode_bam_record(read, &registry->scratch) == 0;
+    for (uint32_t i = 0; i < n_labels; i++) {
+        uint32_t label_id = label_ids[i];
+        int8_t stat = -1;
+        if (encoded && label_id < registry->count) {
+            stat = append_encoded(registry->entries[label_id].fp, &registry->scratch);
+        }
+        if (stat < 0) {
+            // Not a plain BAM stream or record: let htslib encode it
+            stat = label_dump(registry, label_id, header, read);
+        }
+        if (stat != 0) {
+            log_msg("Failed to write read to output file", ERROR);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// CB-sorted outputs: serialize once and buffer the bytes for each label
+static int8_t sorted_dump(label_registry_t *registry, bc_key_t cb, const uint32_t *label_ids,
+                          uint32_t n_labels, bam1_t *read) {
+    if (encode_bam_record(read, &registry->scratch) != 0) {
+        log_msg("Read %s cannot be buffered for CB-sorted output", ERROR, bam_get_qname(read));
+        return 1;
+    }
+    for (uint32_t i = 0; i < n_labels; i++) {
+        if (cb_sorter_add(registry->sorter, label_ids[i], cb, read, &registry->scratch) != 0) {
+            // Buffering or spilling failed; the sorted output would be incomplete
+            log_msg("Failed to buffer read for CB-sorted output of %s", ERROR,
+                    registry->entries[label_ids[i]].label);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int8_t labels_dump(label_registry_t *registry, bc_key_t cb, const uint32_t *label_ids,
+                          uint32_t n_labels, sam_hdr_t *header, bam1_t *read) {
+    int8_t stat;
+    if (registry->sorter) {
+        stat = sorted_dump(registry, cb, label_ids, n_labels, read);
+    } else if (n_labels == 1) {
+        stat = label_dump(registry, label_ids[0], header, read);
+    } else {
+        stat = fan_out_dump(registry, label_ids, n_labels, header, read);
+    }
+
+    // Coverage follows exactly what each label's BAM receives
+    if (stat == 0 && registry->coverage) {
+        for (uint32_t i = 0; i < n_labels; i++) {
+            coverage_track_t *track = registry->entries[label_ids[i]].coverage;
+            if (track && coverage_add_read(track, read) != 0) return 1;
+        }
+    }
+    return stat;
+}
+
+// Downsampling: while collecting, only offer the read's key to its labels;
+// afterwards write it to the labels that selected it
+static int8_t sampled_dump(label_registry_t *registry, const cb2fp *barcode,
+                           sam_hdr_t *header, bam1_t *read) {
+    downsampler_t *sampler = registry->sampler;
+    uint64_t key = read_sample_key(sampler, read);
+    if (sampler->collecting) {
+        return offer_sample(sampler, barcode, key) == 0 ? 0 : 1;
+    }
+
+    uint32_t n_selected = 0;
+    for (uint32_t i = 0; i < barcode->n_labels; i++) {
+        if (sample_selected(sampler, barcode->label_ids[i], key)) {
+            sampler->selected[n_selected++] = barcode->label_ids[i];
+        }
+    }
+    if (n_selected == 0) return 0;
+    return labels_dump(registry, barcode->cb, sampler->selected, n_selected, header, read);
+}
+
+int8_t barcode_dump(label_registry_t *registry, const cb2fp *barcode,
+                    sam_hdr_t *header, bam1_t *read) {
+    if (registry->tagged) {
+        return tagged_dump(registry, barcode, header, read);
+    }
+    if (registry->sampler) {
+        return sampled_dump(registry, barcode, header, read);
+    }
+    return labels_dump(registry, barcode->cb, barcode->label_ids, barcode->n_labels,
+                       header, read);
+}
+
+void log_prefilter_stats(uint64_t checked, uint64_t rejected) {
+    if (checked == 0) return;
+    log_msg("Barcode prefilter rejected %llu of %llu barcodes (%.1f%%) not in metadata",
+            INFO, (unsigned long long) rejected, (unsigned long long) checked,
+            100.0 * rejected / checked);
+}
+
+uint64_t output_file_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) {
+        return UINT64_MAX;
+    }
+    uint64_t open_files = (uint64_t) limit.rlim_cur;
+    return open_files > FD_HEADROOM ? open_files - FD_HEADROOM : 0;
+}
+
 void log_message(char* log_path, log_level_t out_level, char* message, log_level_t level, ...) {
     if (level > out_level) return;
     
@@ -187,8 +400,50 @@ void set_UB(tag_meta_t *tag_meta, char *platform) {
     free(platform_lower);
 }
 
+// Parse a composite barcode: tags and 1-based read name fields joined by
+// '+', e.g. "B1+B2+B3" or "2+3+4", concatenated in the order given
+int8_t set_barcode_sources(tag_meta_t *tag_meta, const char *spec) {
+    uint8_t n_sources = 0;
+    const char *p = spec;
+    while (1) {
+        const char *end = strchr(p, '+');
+        size_t len = end ? (size_t) (end - p) : strlen(p);
+        if (n_sources == MAX_BARCODE_SOURCES) {
+            log_msg("Too many barcode segments (max %d): %s", ERROR, MAX_BARCODE_SOURCES, spec);
+            return -1;
+        }
+        barcode_source_t *source = &tag_meta->sources[n_sources];
+        if (len > 0 && isdigit((unsigned char) p[0])) {
+            char *endptr;
+            long field = strtol(p, &endptr, 10);
+            if (endptr != p + len || field < 1 || field > UINT8_MAX) {
+                log_msg("Invalid read name field in barcode: %s", ERROR, spec);
+                return -1;
+            }
+            source->location = READ_NAME;
+            source->field = (uint8_t) field;
+            source->tag_name[0] = '\0';
+        } else if (len == 2) {
+            source->location = READ_TAG;
+            source->field = 0;
+            memcpy(source->tag_name, p, 2);
+            source->tag_name[2] = '\0';
+        } else {
+            log_msg("Invalid barcode segment (expected a 2-char tag or a field number): %s",
+                    ERROR, spec);
+            return -1;
+        }
+        n_sources++;
+        if (!end) break;
+        p = end + 1;
+    }
+    tag_meta->location = READ_COMPOSITE;
+    tag_meta->n_sources = n_sources;
+    return 0;
+}
+
 void print_tag_meta(tag_meta_t *tag_meta, const char *header) {
-    char* location_names[] = {"Read tag", "Read name"};
+    char* location_names[] = {"Read tag", "Read name", "Composite"};
     
     if (header) {
         fprintf(stderr, "\t%s:\n", header);
@@ -197,6 +452,20 @@ void print_tag_meta(tag_meta_t *tag_meta, const char *header) {
     }
     
     fprintf(stderr, "\t\tLocation: %s\n", location_names[tag_meta->location]);
+    if (tag_meta->location == READ_COMPOSITE) {
+        fprintf(stderr, "\t\tSegments:");
+        for (uint8_t i = 0; i < tag_meta->n_sources; i++) {
+            const barcode_source_t *source = &tag_meta->sources[i];
+            if (source->location == READ_TAG) {
+                fprintf(stderr, " %s", source->tag_name);
+            } else {
+                fprintf(stderr, " name field %d", source->field);
+            }
+        }
+        fprintf(stderr, "\n");
+        fprintf(stderr, "\t\tSeparator: %s\n\n", tag_meta->sep);
+        return;
+    }
     if (tag_meta->location == READ_NAME) {
         fprintf(stderr, "\t\tSeparator: %s\n", tag_meta->sep);
         fprintf(stderr, "\t\tField number: %d\n", tag_meta->field);
@@ -18,15 +18,27 @@
 // Tag metadata structure
 enum location {
     READ_TAG,
-    READ_NAME
+    READ_NAME,
+    READ_COMPOSITE
 };
 
+// Composite barcodes: up to this many segments, each from a tag or a name field
+#define MAX_BARCODE_SOURCES 4
+
+typedef struct {
+    enum location location;
+    char tag_name[3];
+    uint8_t field;
+} barcode_source_t;
+
 typedef struct {
     enum location location;
     char *tag_name;
     char *sep;
     uint8_t field;
     uint8_t length;
+    uint8_t n_sources;
+    barcode_source_t sources[MAX_BARCODE_SOURCES];
 } tag_meta_t;
 
 // Logging utilities
@@ -43,14 +55,28 @@ void log_message(char* log_path, log_level_t out_level, char* message, log_level
 // Essential functions
 void show_global_usage();
 void show_split_usage();
+void show_tag_usage();
 int create_directory(char* pathname);
 tag_meta_t *initialize_tag_meta();
 void destroy_tag_meta(tag_meta_t *tag_meta);
 void set_CB(tag_meta_t *tag_meta, char *platform);
 void set_UB(tag_meta_t *tag_meta, char *platform);
+int8_t set_barcode_sources(tag_meta_t *tag_meta, const char *spec);
 void print_tag_meta(tag_meta_t *tag_meta, const char *header);
-int8_t read_dump(cb2fp *direct_map, char *this_CB, 
-                sam_hdr_t *header, bam1_t *read);
+void log_prefilter_stats(uint64_t checked, uint64_t rejected);
+
+// Descriptors kept back for the input, its index, logs and temporary files
+#define FD_HEADROOM 32
+
+// Outputs that may be open at once: the open-file limit (ulimit -n) less FD_HEADROOM
+uint64_t output_file_limit(void);
+int8_t label_dump(label_registry_t *registry, uint32_t label_id,
+                 sam_hdr_t *header, bam1_t *read);
+int8_t barcode_dump(label_registry_t *registry, const cb2fp *barcode,
+                    sam_hdr_t *header, bam1_t *read);
+int8_t dedup_dump(label_registry_t *registry, const cb2fp *barcode,
+                  sam_hdr_t *header, bam1_t *read, bool duplicate);
+int8_t unassigned_dump(label_registry_t *registry, sam_hdr_t *header, bam1_t *read);
 
 // Global variables
 extern log_level_t OUT_LEVEL;
@@ -0,0 +1,217 @@
+//
+// BAM record serialization: encoded bytes must match bam_write1()
+//
+// Records with and without CIGARs, qualities, aux data and name padding are
+// appended to one BAM with append_encoded() and written to another with
+// sam_write1(). The two files must hold the same bytes, and every field
+// read back with sam_read1() must equal the original. Records
+// bam_write1() encodes specially must be refused, as must SAM outputs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "htslib/bgzf.h"
+#include "bam_encode.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                                                    \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);            \
+            fprintf(stderr, __VA_ARGS__);                                   \
+            fputc('\n', stderr);                                            \
+            failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+#define N_RECORDS 4
+
+static const char HEADER[] = "@HD\tVN:1.6\tSO:coordinate\n"
+                             "@SQ\tSN:chr1\tLN:248956422\n"
+                             "@SQ\tSN:chr2\tLN:242193529\n";
+
+static void temp_path(char *path, size_t size, const char *name) {
+    const char *dir = getenv("TMPDIR");
+    snprintf(path, size, "%s/test_bam_encode_%d_%s", dir ? dir : "/tmp", (int) getpid(), name);
+}
+
+// Mapped and unmapped reads; names of every length modulo 4 so the
+// in-memory NUL padding (l_extranul) takes each value
+static bam1_t *make_record(int i) {
+    static const char *names[N_RECORDS] = {"r1", "read2", "rd01", "abc"};
+    static const uint32_t cigar[3] = {5 << BAM_CIGAR_SHIFT | BAM_CSOFT_CLIP,
+                                      40 << BAM_CIGAR_SHIFT | BAM_CMATCH,
+                                      100 << BAM_CIGAR_SHIFT | BAM_CREF_SKIP};
+    char seq[46], qual[46];
+    for (int j = 0; j < 45; j++) {
+        seq[j] = "ACGTN"[(i + j) % 5];
+        qual[j] = (char) ((i * 7 + j) % 41);
+    }
+    bam1_t *read = bam_init1();
+    int ret;
+    if (i == 1) {
+        // Unmapped, no CIGAR, no base qualities
+        ret = bam_set1(read, strlen(names[i]), names[i], BAM_FUNMAP, -1, -1, 0, 0, NULL,
+                       -1, -1, 0, 45, seq, NULL, 32);
+    } else {
+        ret = bam_set1(read, strlen(names[i]), names[i],
+                       BAM_FPAIRED | BAM_FREAD1 | (i == 2 ? BAM_FREVERSE : 0), i == 3, 1000 * i,
+                       (uint8_t) (60 - i), 2 + (i == 3), cigar, 1, 5000, i == 2 ? -4200 : 4200,
+                       45, seq, qual, 32);
+    }
+    CHECK(ret >= 0, "bam_set1 failed for %s", names[i]);
+    bam_aux_append(read, "CB", 'Z', 19, (const uint8_t *) "AAACCCAAGAAACACT-1");
+    bam_aux_append(read, "UB", 'Z', 13, (const uint8_t *) "GCTAGCTAGCTA");
+    int32_t nm = i;
+    if (i != 1) bam_aux_append(read, "NM", 'i', 4, (const uint8_t *) &nm);
+    return read;
+}
+
+// Decompressed contents of a BGZF file
+static char *read_all(const char *path, size_t *length) {
+    BGZF *fp = bgzf_open(path, "r");
+    if (!fp) return NULL;
+    size_t capacity = 1 << 16;
+    char *data = malloc(capacity);
+    *length = 0;
+    ssize_t n;
+    while (data && (n = bgzf_read(fp, data + *length, capacity - *length)) > 0) {
+        *length += (size_t) n;
+        if (*length == capacity) data = realloc(data, capacity *= 2);
+    }
+    bgzf_close(fp);
+    return data;
+}
+
+static void check_same_record(const bam1_t *a, const bam1_t *b) {
+    const bam1_core_t *x = &a->core, *y = &b->core;
+    const char *name = bam_get_qname(a);
+    CHECK(strcmp(name, bam_get_qname(b)) == 0, "name %s read back as %s", name,
+          bam_get_qname(b));
+    CHECK(x->tid == y->tid && x->pos == y->pos, "%s: position differs", name);
+    CHECK(x->bin == y->bin && x->qual == y->qual && x->flag == y->flag,
+          "%s: bin, MAPQ or flag differs", name);
+    CHECK(x->mtid == y->mtid && x->mpos == y->mpos && x->isize == y->isize,
+          "%s: mate fields differ", name);
+    CHECK(x->n_cigar == y->n_cigar &&
+          memcmp(bam_get_cigar(a), bam_get_cigar(b), x->n_cigar * sizeof(uint32_t)) == 0,
+          "%s: CIGAR differs", name);
+    CHECK(x->l_qseq == y->l_qseq &&
+          memcmp(bam_get_seq(a), bam_get_seq(b), (x->l_qseq + 1) / 2) == 0 &&
+          memcmp(bam_get_qual(a), bam_get_qual(b), x->l_qseq) == 0,
+          "%s: sequence or qualities differ", name);
+    CHECK(bam_get_l_aux(a) == bam_get_l_aux(b) &&
+          memcmp(bam_get_aux(a), bam_get_aux(b), bam_get_l_aux(a)) == 0,
+          "%s: aux data differs", name);
+}
+
+static void check_round_trip(void) {
+    int before = failures;
+    char encoded_path[512], written_path[512];
+    temp_path(encoded_path, sizeof(encoded_path), "encoded.bam");
+    temp_path(written_path, sizeof(written_path), "written.bam");
+
+    sam_hdr_t *header = sam_hdr_parse(strlen(HEADER), HEADER);
+    samFile *encoded = sam_open(encoded_path, "wb");
+    samFile *written = sam_open(written_path, "wb");
+    if (!header || !encoded || !written ||
+        sam_hdr_write(encoded, header) < 0 || sam_hdr_write(written, header) < 0) {
+        CHECK(0, "cannot create test BAMs in %s", encoded_path);
+        return;
+    }
+
+    bam1_t *records[N_RECORDS];
+    kstring_t buf = KS_INITIALIZE;
+    for (int i = 0; i < N_RECORDS; i++) {
+        records[i] = make_record(i);
+        CHECK(encode_bam_record(records[i], &buf) == 0, "record %d not encoded", i);
+        CHECK(append_encoded(encoded, &buf) == 0, "record %d not appended", i);
+        CHECK(sam_write1(written, header, records[i]) >= 0, "record %d not written", i);
+    }
+    CHECK(sam_close(encoded) == 0 && sam_close(written) == 0, "closing test BAMs failed");
+
+    size_t encoded_len = 0, written_len = 0;
+    char *encoded_data = read_all(encoded_path, &encoded_len);
+    char *written_data = read_all(written_path, &written_len);
+    CHECK(encoded_data && written_data && encoded_len == written_len &&
+          memcmp(encoded_data, written_data, encoded_len) == 0,
+          "encoded BAM (%zu bytes) differs from bam_write1 (%zu bytes)",
+          encoded_len, written_len);
+    free(encoded_data);
+    free(written_data);
+
+    samFile *in = sam_open(encoded_path, "r");
+    sam_hdr_t *in_header = in ? sam_hdr_read(in) : NULL;
+    bam1_t *read = bam_init1();
+    for (int i = 0; in_header && i < N_RECORDS; i++) {
+        if (sam_read1(in, in_header, read) < 0) {
+            CHECK(0, "record %d missing from encoded BAM", i);
+            break;
+        }
+        check_same_record(records[i], read);
+    }
+    CHECK(!in_header || sam_read1(in, in_header, read) == -1, "extra records in encoded BAM");
+    bam_destroy1(read);
+    sam_hdr_destroy(in_header);
+    if (in) sam_close(in);
+
+    for (int i = 0; i < N_RECORDS; i++) bam_destroy1(records[i]);
+    ks_free(&buf);
+    sam_hdr_destroy(header);
+    unlink(encoded_path);
+    unlink(written_path);
+    printf("round trip: %s\n", failures == before ? "ok" : "FAILED");
+}
+
+// Records bam_write1() stores differently, and outputs that are not BAM
+static void check_refused(void) {
+    int before = failures;
+    kstring_t buf = KS_INITIALIZE;
+
+    bam1_t *read = make_record(0);
+    read->core.pos = (hts_pos_t) INT32_MAX + 1;
+    CHECK(encode_bam_record(read, &buf) != 0, "encoded a position beyond 32 bits");
+    bam_destroy1(read);
+
+    // CIGARs over 65535 operations move to a CG tag in bam_write1()
+    uint32_t *cigar = malloc(70000 * sizeof(uint32_t));
+    for (int i = 0; i < 70000; i++) {
+        cigar[i] = 1 << BAM_CIGAR_SHIFT | (i % 2 ? BAM_CINS : BAM_CMATCH);
+    }
+    char *seq = malloc(70001);
+    memset(seq, 'A', 70000);
+    seq[70000] = '\0';
+    read = bam_init1();
+    CHECK(bam_set1(read, 4, "long", 0, 0, 100, 60, 70000, cigar, -1, -1, 0, 70000, seq, NULL,
+                   0) >= 0, "bam_set1 failed for a long CIGAR");
+    CHECK(encode_bam_record(read, &buf) != 0, "encoded a CIGAR of 70000 operations");
+    bam_destroy1(read);
+    free(cigar);
+    free(seq);
+
+    char sam_path[512];
+    temp_path(sam_path, sizeof(sam_path), "out.sam");
+    sam_hdr_t *header = sam_hdr_parse(strlen(HEADER), HEADER);
+    samFile *sam = sam_open(sam_path, "w");
+    read = make_record(0);
+    if (header && sam && sam_hdr_write(sam, header) == 0) {
+        CHECK(encode_bam_record(read, &buf) == 0 && append_encoded(sam, &buf) < 0,
+              "appended BAM bytes to a SAM output");
+    } else {
+        CHECK(0, "cannot create %s", sam_path);
+    }
+    if (sam) sam_close(sam);
+    bam_destroy1(read);
+    sam_hdr_destroy(header);
+    ks_free(&buf);
+    unlink(sam_path);
+    printf("refused: %s\n", failures == before ? "ok" : "FAILED");
+}
+
+int main(void) {
+    check_round_trip();
+    check_refused();
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,198 @@
+//
+// Packed barcode kernels: every SIMD kernel must agree with the scalar one
+//
+// For each length 0..BC_MAX_BASES, random A/C/G/T sequences (with and
+// without a "-N" suffix) must pack to the same key under every kernel and
+// unpack back to the input. The same sequences with one base replaced by
+// N, a lowercase base or another byte must be rejected by every kernel.
+// Interned ids and Visium HD spot ids must round trip and never collide
+// with packed sequences. UMIs that do not pack must hash stably and never
+// look one mismatch from another UMI.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "barcode.h"
+
+#define N_RANDOM 200
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                                                    \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);            \
+            fprintf(stderr, __VA_ARGS__);                                   \
+            fputc('\n', stderr);                                            \
+            failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+// Pack seq under the named kernel
+static int8_t pack_with(const char *kernel, const char *seq, bc_key_t *key) {
+    if (bc_select_kernel(kernel) != 0) {
+        fprintf(stderr, "kernel %s unavailable\n", kernel);
+        exit(1);
+    }
+    return bc_pack(seq, strlen(seq), key);
+}
+
+static void random_bases(char *seq, size_t len) {
+    static const char bases[4] = {'A', 'C', 'G', 'T'};
+    for (size_t i = 0; i < len; i++) {
+        seq[i] = bases[rand() & 3];
+    }
+    seq[len] = '\0';
+}
+
+// Valid sequences: identical keys and an exact round trip
+static void check_valid(const char *kernel, const char *seq) {
+    bc_key_t expected = 0, key = 0;
+    int8_t scalar_stat = pack_with("scalar", seq, &expected);
+    int8_t stat = pack_with(kernel, seq, &key);
+    CHECK(scalar_stat == 0, "scalar rejected valid %s", seq);
+    CHECK(stat == 0, "%s rejected valid %s", kernel, seq);
+    CHECK(key == expected, "%s packed %s to %016llx, scalar to %016llx", kernel, seq,
+          (unsigned long long) key, (unsigned long long) expected);
+
+    char unpacked[32];
+    bc_unpack(key, unpacked);
+    CHECK(strcmp(unpacked, seq) == 0, "%s round trip of %s gave %s", kernel, seq, unpacked);
+}
+
+// Invalid sequences: every kernel takes the error path
+static void check_invalid(const char *kernel, const char *seq) {
+    bc_key_t key;
+    CHECK(pack_with("scalar", seq, &key) != 0, "scalar accepted invalid %s", seq);
+    CHECK(pack_with(kernel, seq, &key) != 0, "%s accepted invalid %s", kernel, seq);
+}
+
+static void check_kernel(const char *kernel) {
+    static const char bad[] = {'N', 'a', 'c', 'g', 't', 'n', 'U', '.', ' '};
+    char seq[40];
+
+    srand(1);
+    for (size_t len = 0; len <= BC_MAX_BASES; len++) {
+        for (int r = 0; r < N_RANDOM; r++) {
+            random_bases(seq, len);
+            check_valid(kernel, seq);
+
+            // Cell Ranger style suffix
+            if (len > 0) {
+                snprintf(seq + len, sizeof(seq) - len, "-%d", 1 + r % 7);
+                check_valid(kernel, seq);
+                seq[len] = '\0';
+            }
+
+            // One bad byte at each position, including the last
+            for (size_t pos = 0; pos < len; pos++) {
+                char saved = seq[pos];
+                seq[pos] = bad[(pos + r) % sizeof(bad)];
+                check_invalid(kernel, seq);
+                seq[pos] = saved;
+            }
+        }
+    }
+
+    // Too long for the key, with or without a suffix
+    for (size_t len = BC_MAX_BASES + 1; len <= 32; len++) {
+        random_bases(seq, len);
+        check_invalid(kernel, seq);
+        strcat(seq, "-1");
+        check_invalid(kernel, seq);
+    }
+}
+
+// Interned ids: stable keys, exact round trip, lookups that do not add
+static void check_interned(void) {
+    int before = failures;
+    static const char *ids[] = {"plate1_A01", "plate1_A02", "NNN", "s_2um_123_456-1"};
+    bc_key_t keys[4];
+    for (int i = 0; i < 4; i++) {
+        CHECK(bc_intern(ids[i], strlen(ids[i]), &keys[i]) == 0, "failed to intern %s", ids[i]);
+        CHECK(BC_IS_INTERNED(keys[i]), "%s not marked as interned", ids[i]);
+        char unpacked[32];
+        bc_unpack(keys[i], unpacked);
+        CHECK(strcmp(unpacked, ids[i]) == 0, "round trip of %s gave %s", ids[i], unpacked);
+    }
+    bc_key_t key;
+    CHECK(bc_intern(ids[1], strlen(ids[1]), &key) == 0 && key == keys[1], "re-interning moved %s",
+          ids[1]);
+    CHECK(bc_find_interned("plate1_A03", 10, &key) != 0, "found an id never interned");
+    CHECK(bc_find_interned(ids[0], strlen(ids[0]), &key) == 0 && key == keys[0], "lost %s", ids[0]);
+    CHECK(bc_intern("", 0, &key) != 0, "interned an empty id");
+    CHECK(bc_intern("0123456789012345678901234567890123", 34, &key) != 0, "interned a long id");
+
+    // Sequences never take the interned length
+    char seq[40];
+    random_bases(seq, BC_MAX_BASES);
+    CHECK(bc_pack(seq, BC_MAX_BASES, &key) == 0 && !BC_IS_INTERNED(key) &&
+          bc_sort_key(key) != bc_sort_key(keys[0]), "packed %s looks interned", seq);
+    bc_clear_interned();
+    printf("interned: %s\n", failures == before ? "ok" : "FAILED");
+}
+
+// UMIs that do not pack are hashed: equal strings match, nothing clusters
+static void check_umi_fallback(void) {
+    int before = failures;
+    static const char *umis[] = {"ACGTNACGTACG", "ACGTNACGTACC", "ACGTACGTACGTACGTACGTACGTACGTA",
+                                 "ACGTACGTACGTACGTACGTACGTACGTC"};
+    bc_key_t keys[4];
+    for (int i = 0; i < 4; i++) {
+        CHECK(bc_pack_umi(umis[i], strlen(umis[i]), &keys[i]) == 0, "rejected UMI %s", umis[i]);
+        CHECK(BC_LENGTH(keys[i]) == BC_HASHED, "UMI %s not hashed", umis[i]);
+        bc_key_t again;
+        bc_pack_umi(umis[i], strlen(umis[i]), &again);
+        CHECK(again == keys[i], "UMI %s hashed differently twice", umis[i]);
+    }
+    CHECK(keys[0] != keys[1] && keys[2] != keys[3], "distinct UMIs share a hash");
+    CHECK(bc_hamming(keys[0], keys[1]) > BC_MAX_BASES, "hashed UMIs are comparable");
+
+    // Packable UMIs keep their 2-bit key and never meet a hashed one
+    bc_key_t packed, plain;
+    CHECK(bc_pack_umi("ACGTAACGTACG", 12, &packed) == 0 &&
+          bc_pack("ACGTAACGTACG", 12, &plain) == 0 && packed == plain, "packable UMI not packed");
+    CHECK(bc_hamming(packed, keys[0]) > BC_MAX_BASES, "hashed UMI one mismatch from a sequence");
+    printf("umi fallback: %s\n", failures == before ? "ok" : "FAILED");
+}
+
+// Visium HD spot ids pack from their numbers and unpack exactly
+static void check_visium_hd(void) {
+    int before = failures;
+    static const char *ids[] = {"s_002um_00123_00456-1", "s_008um_00000_00000",
+                                "s_016um_99999_99999-7"};
+    static const char *bad[] = {"s_2um_123_456", "s_002um_00123_0045", "s_002um_00123_00456-8",
+                                "s_002xm_00123_00456", "s_002um_0012a_00456", "S_002um_00123_00456"};
+    bc_key_t keys[3];
+    for (int i = 0; i < 3; i++) {
+        CHECK(bc_pack_id(ids[i], strlen(ids[i]), &keys[i]) == 0, "rejected %s", ids[i]);
+        CHECK(!BC_IS_SEQUENCE(keys[i]) && !BC_IS_INTERNED(keys[i]), "%s packed as another kind",
+              ids[i]);
+        char unpacked[32];
+        bc_unpack(keys[i], unpacked);
+        CHECK(strcmp(unpacked, ids[i]) == 0, "round trip of %s gave %s", ids[i], unpacked);
+    }
+    CHECK(keys[0] != keys[1] && keys[1] != keys[2], "distinct spots share a key");
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        bc_key_t key;
+        CHECK(bc_pack_visium_hd(bad[i], strlen(bad[i]), &key) != 0, "accepted %s", bad[i]);
+    }
+    printf("visium hd: %s\n", failures == before ? "ok" : "FAILED");
+}
+
+int main(void) {
+    const char *kernels[] = {"scalar", "sse4.2", "avx2"};
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (bc_select_kernel(kernels[k]) != 0) {
+            printf("%s: not supported by this CPU, skipped\n", kernels[k]);
+            continue;
+        }
+        int before = failures;
+        check_kernel(kernels[k]);
+        printf("%s: %s\n", kernels[k], failures == before ? "ok" : "FAILED");
+    }
+    check_interned();
+    check_umi_fallback();
+    check_visium_hd();
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,210 @@
+//
+// Cell calling: thresholds picked at the knee of the barcode rank curve
+//
+// Synthetic UMI counts with a known split between cells and ambient
+// barcodes must be called at a threshold inside the gap. A fixed threshold
+// must be honoured as given, a flat curve falls back to the minimum, and
+// too few barcodes above the minimum is an error. Called cells must be routed
+// to the shared output or to their own, and listed in cells.csv.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cell_call.h"
+#include "utils.h"
+
+// Symbols the program defines in main.c, utils.c and hash.c
+log_level_t OUT_LEVEL = ERROR;
+char *OUT_PATH = "";
+
+void log_message(char *log_path, log_level_t out_level, char *message, log_level_t level, ...) {
+    (void) log_path; (void) out_level; (void) message; (void) level;
+}
+
+uint64_t output_file_limit(void) {
+    return UINT64_MAX;
+}
+
+// Outputs opened so far, by label id
+#define MAX_OUTPUTS 16
+static char opened[MAX_OUTPUTS][32];
+static uint32_t n_opened = 0;
+
+int32_t open_label_output(label_registry_t *registry, const char *label, const char *prefix,
+                          sam_hdr_t *header) {
+    (void) registry; (void) prefix; (void) header;
+    if (n_opened == MAX_OUTPUTS || strlen(label) >= sizeof(opened[0])) return -1;
+    strcpy(opened[n_opened], label);
+    return (int32_t) n_opened++;
+}
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                                                    \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);            \
+            fprintf(stderr, __VA_ARGS__);                                   \
+            fputc('\n', stderr);                                            \
+            failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+// Standard normal deviate (Box-Muller)
+static double gauss(void) {
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+// Barcodes 1..n_cells are cells, the rest ambient
+static uint64_t true_cells_called(const cell_caller_t *caller, uint64_t n_cells) {
+    uint64_t called = 0;
+    for (uint64_t i = 0; i < caller->n_cells; i++) {
+        if (caller->cells[i].cb <= n_cells) called++;
+    }
+    return called;
+}
+
+// Log-normal cells well above log-normal ambient barcodes
+static void check_bimodal(uint64_t n_cells, double cell_log10, double ambient_log10) {
+    cell_caller_t *caller = create_cell_caller(CELLS_AT_KNEE);
+    srand(2);
+    for (uint64_t i = 0; i < n_cells + 100000; i++) {
+        double l = i < n_cells ? cell_log10 + 0.25 * gauss() : ambient_log10 + 0.45 * gauss();
+        add_barcode_umis(caller, (bc_key_t) i + 1, (uint32_t) (pow(10, l) + 0.5));
+    }
+    CHECK(select_cells(caller) == 0, "no knee found for %llu cells",
+          (unsigned long long) n_cells);
+    uint64_t real = true_cells_called(caller, n_cells);
+    CHECK(caller->n_cells >= n_cells * 95 / 100 && caller->n_cells <= n_cells * 105 / 100,
+          "%llu cells: called %llu at %u UMIs", (unsigned long long) n_cells,
+          (unsigned long long) caller->n_cells, caller->threshold);
+    CHECK(real >= caller->n_cells * 95 / 100, "%llu cells: only %llu of %llu called are cells",
+          (unsigned long long) n_cells, (unsigned long long) real,
+          (unsigned long long) caller->n_cells);
+    destroy_cell_caller(caller);
+}
+
+// 100 barcodes at 10000 UMIs over 1000 at 100: the threshold sits halfway
+// down the cliff in log scale
+static void check_step(void) {
+    cell_caller_t *caller = create_cell_caller(CELLS_AT_KNEE);
+    for (uint64_t i = 0; i < 1100; i++) {
+        add_barcode_umis(caller, (bc_key_t) i + 1, i < 100 ? 10000 : 100);
+    }
+    CHECK(select_cells(caller) == 0, "no knee found for a step");
+    CHECK(caller->threshold == 1000, "step threshold %u, expected 1000", caller->threshold);
+    CHECK(caller->n_cells == 100 && true_cells_called(caller, 100) == 100,
+          "step called %llu cells", (unsigned long long) caller->n_cells);
+    destroy_cell_caller(caller);
+}
+
+// A given threshold is used as is, with no knee search
+static void check_fixed(void) {
+    cell_caller_t *caller = create_cell_caller(500);
+    for (uint64_t i = 0; i < 1000; i++) {
+        add_barcode_umis(caller, (bc_key_t) i + 1, (uint32_t) i + 1);
+    }
+    CHECK(select_cells(caller) == 0, "fixed threshold failed");
+    CHECK(caller->threshold == 500 && caller->n_cells == 501,
+          "fixed threshold %u called %llu cells", caller->threshold,
+          (unsigned long long) caller->n_cells);
+    destroy_cell_caller(caller);
+}
+
+// No drop anywhere: every barcode at the minimum is called
+static void check_flat(void) {
+    cell_caller_t *caller = create_cell_caller(CELLS_AT_KNEE);
+    for (uint64_t i = 0; i < 50; i++) {
+        add_barcode_umis(caller, (bc_key_t) i + 1, 200);
+    }
+    add_barcode_umis(caller, 51, CELL_KNEE_MIN_UMIS - 1);
+    CHECK(select_cells(caller) == 0, "flat curve failed");
+    CHECK(caller->threshold == CELL_KNEE_MIN_UMIS && caller->n_cells == 50,
+          "flat curve threshold %u called %llu cells", caller->threshold,
+          (unsigned long long) caller->n_cells);
+    destroy_cell_caller(caller);
+}
+
+// Too few barcodes above the minimum to look for a knee
+static void check_too_few(void) {
+    cell_caller_t *caller = create_cell_caller(CELLS_AT_KNEE);
+    for (uint64_t i = 0; i < 2 * CELL_KNEE_MIN_CELLS - 1; i++) {
+        add_barcode_umis(caller, (bc_key_t) i + 1, 5000);
+    }
+    for (uint64_t i = 0; i < 1000; i++) {
+        add_barcode_umis(caller, (bc_key_t) i + 100, CELL_KNEE_MIN_UMIS - 1);
+    }
+    CHECK(select_cells(caller) != 0, "knee found among too few barcodes");
+    destroy_cell_caller(caller);
+}
+
+// Barcodes at or above a fixed threshold get entries pointing at the shared
+// output, or each at an output named after it, and cells.csv lists them
+static void check_routing(bool per_cell) {
+    static const char *barcodes[] = {"AAACCCAAGAAACACT-1", "AAACCCAAGAAACCAT-1",
+                                     "AAACCCAAGAAACCCA-1", "AAACCCAAGAAACCCG-1",
+                                     "AAACCCAAGAAACCTG-1"};
+    static const uint32_t umis[] = {120, 10, 60, 49, 50};
+    static const int called[] = {0, 2, 4};
+    cell_caller_t *caller = create_cell_caller(50);
+    for (int i = 0; i < 5; i++) {
+        bc_key_t cb;
+        CHECK(bc_pack(barcodes[i], strlen(barcodes[i]), &cb) == 0, "cannot pack %s", barcodes[i]);
+        add_barcode_umis(caller, cb, umis[i]);
+    }
+    CHECK(select_cells(caller) == 0 && caller->n_cells == 3, "called %llu cells, expected 3",
+          (unsigned long long) caller->n_cells);
+
+    char prefix[256];
+    const char *dir = getenv("TMPDIR");
+    snprintf(prefix, sizeof(prefix), "%s/test_cell_call_%d_", dir ? dir : "/tmp", (int) getpid());
+    label_registry_t registry = {0};
+    n_opened = 0;
+    CHECK(open_cell_outputs(caller, &registry, prefix, NULL, per_cell) == 0,
+          "opening cell outputs failed");
+    CHECK(n_opened == (per_cell ? 3 : 1), "%u outputs opened", n_opened);
+
+    for (uint64_t c = 0; c < caller->n_cells && c < 3; c++) {
+        const cb2fp *cell = &caller->cells[c];
+        char barcode[32];
+        bc_unpack(cell->cb, barcode);
+        CHECK(strcmp(barcode, barcodes[called[c]]) == 0, "cell %llu is %s, expected %s",
+              (unsigned long long) c, barcode, barcodes[called[c]]);
+        uint32_t label_id = cell->label_ids[0];
+        CHECK(cell->n_labels == 1 && label_id < n_opened &&
+              strcmp(opened[label_id], per_cell ? barcode : CELLS_LABEL) == 0,
+              "%s routed to %s", barcode, label_id < n_opened ? opened[label_id] : "nothing");
+    }
+
+    char path[512], line[64], expected[64];
+    snprintf(path, sizeof(path), "%s%s.csv", prefix, CELLS_LABEL);
+    FILE *list = fopen(path, "r");
+    CHECK(list && fgets(line, sizeof(line), list) && strcmp(line, "barcode,umis\n") == 0,
+          "cell list %s has no header", path);
+    for (int c = 0; list && c < 3; c++) {
+        snprintf(expected, sizeof(expected), "%s,%u\n", barcodes[called[c]], umis[called[c]]);
+        CHECK(fgets(line, sizeof(line), list) && strcmp(line, expected) == 0,
+              "cell list line %d is not %s", c + 2, expected);
+    }
+    CHECK(!list || !fgets(line, sizeof(line), list), "cell list lists uncalled barcodes");
+    if (list) fclose(list);
+    unlink(path);
+    destroy_cell_caller(caller);
+}
+
+int main(void) {
+    check_bimodal(1000, 3.5, 1.5);
+    check_bimodal(10000, 3.0, 1.2);
+    check_step();
+    check_fixed();
+    check_flat();
+    check_too_few();
+    check_routing(false);
+    check_routing(true);
+    printf("cell calling: %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
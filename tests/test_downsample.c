@@ -0,0 +1,169 @@
+//
+// Per-label downsampling: reproducible bottom-N selection by read name
+//
+// Labels offered more reads than the target must select exactly the target,
+// and labels below it must keep every read. The same seed must select the
+// same reads in a second run, and another seed a different set. Both mates
+// of a pair share a name, so they must be selected together.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "downsample.h"
+#include "utils.h"
+
+// Symbols the program defines in main.c and utils.c
+log_level_t OUT_LEVEL = ERROR;
+char *OUT_PATH = "";
+
+void log_message(char *log_path, log_level_t out_level, char *message, log_level_t level, ...) {
+    (void) log_path; (void) out_level; (void) message; (void) level;
+}
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                                                    \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);            \
+            fprintf(stderr, __VA_ARGS__);                                   \
+            fputc('\n', stderr);                                            \
+            failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+#define N_LABELS 4
+#define TARGET 100
+
+// Barcodes 0-2 have one label each; barcode 3 is in labels 0 and 3
+static const uint32_t label_ids[N_LABELS + 1] = {0, 1, 2, 0, 3};
+static const uint32_t reads_per_barcode[N_LABELS] = {1000, 250, 60, 80};
+
+static void init_barcodes(cb2fp barcodes[N_LABELS], label_registry_t *registry,
+                          label_entry_t entries[N_LABELS]) {
+    memset(barcodes, 0, N_LABELS * sizeof(cb2fp));
+    for (uint32_t b = 0; b < N_LABELS; b++) {
+        barcodes[b].label_ids = (uint32_t *) &label_ids[b];
+        barcodes[b].n_labels = b == 3 ? 2 : 1;
+        barcodes[b].id = b;
+    }
+    memset(entries, 0, N_LABELS * sizeof(label_entry_t));
+    for (uint32_t i = 0; i < N_LABELS; i++) snprintf(entries[i].label, 64, "label%u", i);
+    memset(registry, 0, sizeof(label_registry_t));
+    registry->entries = entries;
+    registry->count = N_LABELS;
+}
+
+// Key of a read name, through a record holding just the name
+static uint64_t name_key(const downsampler_t *sampler, const char *name) {
+    bam1_t read = {0};
+    read.data = (uint8_t *) name;
+    return read_sample_key(sampler, &read);
+}
+
+static void read_name(char *name, size_t size, uint32_t barcode, uint32_t i) {
+    snprintf(name, size, "A00123:8:HVWKJDSXY:1:%04u:%05u:%05u", barcode, i, (i * 7919) % 30000);
+}
+
+// Offer every read of every barcode, mates included when paired, and
+// record whether each read is selected for its first label (if asked)
+static downsampler_t *run_sampler(uint64_t seed, bool paired, bool *selected) {
+    cb2fp barcodes[N_LABELS];
+    label_entry_t entries[N_LABELS];
+    label_registry_t registry;
+    init_barcodes(barcodes, &registry, entries);
+
+    downsampler_t *sampler = create_downsampler(N_LABELS, TARGET, seed);
+    char name[64];
+    for (int mate = 0; mate <= paired; mate++) {
+        for (uint32_t b = 0; b < N_LABELS; b++) {
+            for (uint32_t i = 0; i < reads_per_barcode[b]; i++) {
+                read_name(name, sizeof(name), b, i);
+                CHECK(offer_sample(sampler, &barcodes[b], name_key(sampler, name)) == 0,
+                      "offer failed");
+            }
+        }
+    }
+    finish_sampling(sampler, &registry);
+
+    uint64_t n = 0;
+    for (uint32_t b = 0; selected && b < N_LABELS; b++) {
+        for (uint32_t i = 0; i < reads_per_barcode[b]; i++) {
+            read_name(name, sizeof(name), b, i);
+            selected[n++] = sample_selected(sampler, label_ids[b], name_key(sampler, name));
+        }
+    }
+    return sampler;
+}
+
+static uint64_t total_reads(void) {
+    uint64_t n = 0;
+    for (uint32_t b = 0; b < N_LABELS; b++) n += reads_per_barcode[b];
+    return n;
+}
+
+// Reads selected for a label, counted over every barcode routed to it
+static uint64_t label_selected(const downsampler_t *sampler, uint32_t label_id) {
+    uint64_t n = 0;
+    char name[64];
+    for (uint32_t b = 0; b < N_LABELS; b++) {
+        bool routed = label_ids[b] == label_id || (b == 3 && label_ids[b + 1] == label_id);
+        for (uint32_t i = 0; routed && i < reads_per_barcode[b]; i++) {
+            read_name(name, sizeof(name), b, i);
+            n += sample_selected(sampler, label_id, name_key(sampler, name));
+        }
+    }
+    return n;
+}
+
+static void check_exact_counts(void) {
+    int before = failures;
+    downsampler_t *sampler = run_sampler(7, false, NULL);
+
+    // Labels 0 (1080 reads over two barcodes) and 1 (250) are cut to the
+    // target; labels 2 (60) and 3 (80, shared with label 0) keep everything
+    static const uint64_t expected[N_LABELS] = {TARGET, TARGET, 60, 80};
+    for (uint32_t l = 0; l < N_LABELS; l++) {
+        uint64_t n = label_selected(sampler, l);
+        CHECK(n == expected[l], "label %u selected %llu reads, expected %llu", l,
+              (unsigned long long) n, (unsigned long long) expected[l]);
+    }
+    destroy_downsampler(sampler);
+    printf("exact counts: %s\n", failures == before ? "ok" : "FAILED");
+}
+
+static void check_reproducible(void) {
+    int before = failures;
+    uint64_t n = total_reads();
+    bool *first = malloc(n * sizeof(bool));
+    bool *second = malloc(n * sizeof(bool));
+    bool *other = malloc(n * sizeof(bool));
+    destroy_downsampler(run_sampler(7, false, first));
+    destroy_downsampler(run_sampler(7, false, second));
+    destroy_downsampler(run_sampler(8, false, other));
+    CHECK(memcmp(first, second, n * sizeof(bool)) == 0, "seed 7 selected different reads twice");
+    CHECK(memcmp(first, other, n * sizeof(bool)) != 0, "seeds 7 and 8 selected the same reads");
+    free(first);
+    free(second);
+    free(other);
+    printf("reproducible: %s\n", failures == before ? "ok" : "FAILED");
+}
+
+// Mates are offered under the same name, so with an even target the N
+// smallest keys are exactly N/2 whole pairs
+static void check_pairs(void) {
+    int before = failures;
+    downsampler_t *sampler = run_sampler(7, true, NULL);
+    uint64_t pairs = label_selected(sampler, 1);
+    CHECK(pairs == TARGET / 2, "label 1 selected %llu pairs, expected %d",
+          (unsigned long long) pairs, TARGET / 2);
+    destroy_downsampler(sampler);
+    printf("pairs: %s\n", failures == before ? "ok" : "FAILED");
+}
+
+int main(void) {
+    check_exact_counts();
+    check_reproducible();
+    check_pairs();
+    return failures ? 1 : 0;
+}